@@ -0,0 +1,592 @@
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "BTree.h"
+
+/* Every node but the root holds between BTREE_MIN_DEGREE - 1 and
+ * BTREE_MAX_KEYS keys, an inner node one child more than keys. */
+#define BTREE_MIN_DEGREE 32
+#define BTREE_MAX_KEYS (2 * BTREE_MIN_DEGREE - 1)
+
+/* Node of a B-tree. Leaves are allocated without the children array,
+ * which makes them a quarter of the size of inner nodes. */
+struct BTreeNode {
+    unsigned count;
+    int leaf;
+    int keys[BTREE_MAX_KEYS];
+    struct BTreeNode *children[];
+};
+
+struct BTree {
+    struct BTreeNode *root;
+    size_t count;
+};
+
+/* Helper function: returns a new empty node, NULL on failure. */
+struct BTreeNode *makeBTreeNode(int leaf) {
+    size_t size = sizeof(struct BTreeNode);
+    if (!leaf) {
+        size += (BTREE_MAX_KEYS + 1) * sizeof(struct BTreeNode *);
+    }
+
+    struct BTreeNode *node = malloc(size);
+    if (!node) {
+        return NULL;
+    }
+
+    node->count = 0;
+    node->leaf = leaf;
+
+    return node;
+}
+
+/* Helper function: returns the number of keys in node smaller than value,
+ * which is the position of value among the keys or the child to descend
+ * into. With SSE2 four keys are compared at once, stopping at the first
+ * group that is not entirely smaller. */
+unsigned keyRank(const struct BTreeNode *node, int value) {
+    unsigned rank = 0;
+#ifdef __SSE2__
+    __m128i needle = _mm_set1_epi32(value);
+    while (rank + 4 <= node->count) {
+        __m128i keys = _mm_loadu_si128((const __m128i *)&node->keys[rank]);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(keys, needle)));
+        if (mask != 0xf) {
+            return rank + (unsigned)__builtin_popcount((unsigned)mask);
+        }
+        rank += 4;
+    }
+    while (rank < node->count && node->keys[rank] < value) {
+        rank++;
+    }
+#else
+    unsigned hi = node->count;
+    while (rank < hi) {
+        unsigned mid = rank + (hi - rank) / 2;
+        if (node->keys[mid] < value) {
+            rank = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+#endif
+
+    return rank;
+}
+
+struct BTree *BTreeCreate(void) {
+    struct BTree *tree = malloc(sizeof(struct BTree));
+    if (!tree) {
+        return NULL;
+    }
+
+    tree->root = NULL;
+    tree->count = 0;
+
+    return tree;
+}
+
+int BTreeSearch(struct BTree *tree, int value) {
+    if (!tree) {
+        return 0;
+    }
+
+    struct BTreeNode *node = tree->root;
+    while (node) {
+        unsigned rank = keyRank(node, value);
+        if (rank < node->count && node->keys[rank] == value) {
+            return 1;
+        }
+        node = node->leaf ? NULL : node->children[rank];
+    }
+
+    return 0;
+}
+
+/* Helper function: splits the full child at index of parent, which is not
+ * full, moving its middle key up into parent. Returns 0 on success, -1 on
+ * failure. */
+int splitChild(struct BTreeNode *parent, unsigned index) {
+    struct BTreeNode *child = parent->children[index];
+    struct BTreeNode *sibling = makeBTreeNode(child->leaf);
+    if (!sibling) {
+        return -1;
+    }
+
+    sibling->count = BTREE_MIN_DEGREE - 1;
+    memcpy(sibling->keys, &child->keys[BTREE_MIN_DEGREE],
+           (BTREE_MIN_DEGREE - 1) * sizeof(int));
+    if (!child->leaf) {
+        memcpy(sibling->children, &child->children[BTREE_MIN_DEGREE],
+               BTREE_MIN_DEGREE * sizeof(struct BTreeNode *));
+    }
+    child->count = BTREE_MIN_DEGREE - 1;
+
+    memmove(&parent->keys[index + 1], &parent->keys[index],
+            (parent->count - index) * sizeof(int));
+    memmove(&parent->children[index + 2], &parent->children[index + 1],
+            (parent->count - index) * sizeof(struct BTreeNode *));
+    parent->keys[index] = child->keys[BTREE_MIN_DEGREE - 1];
+    parent->children[index + 1] = sibling;
+    parent->count++;
+
+    return 0;
+}
+
+int BTreeInsert(struct BTree *tree, int value) {
+    if (!tree) {
+        return -1;
+    }
+
+    if (!tree->root) {
+        tree->root = makeBTreeNode(1);
+        if (!tree->root) {
+            return -1;
+        }
+    }
+
+    // full nodes are split on the way down, so there is always room for
+    // the key that moves up from a split
+    if (tree->root->count == BTREE_MAX_KEYS) {
+        struct BTreeNode *root = makeBTreeNode(0);
+        if (!root) {
+            return -1;
+        }
+        root->children[0] = tree->root;
+        if (splitChild(root, 0) == -1) {
+            free(root);
+            return -1;
+        }
+        tree->root = root;
+    }
+
+    struct BTreeNode *node = tree->root;
+    while (1) {
+        unsigned rank = keyRank(node, value);
+        if (rank < node->count && node->keys[rank] == value) {
+            return 1;
+        }
+
+        if (node->leaf) {
+            memmove(&node->keys[rank + 1], &node->keys[rank],
+                    (node->count - rank) * sizeof(int));
+            node->keys[rank] = value;
+            node->count++;
+            tree->count++;
+            return 0;
+        }
+
+        if (node->children[rank]->count == BTREE_MAX_KEYS) {
+            if (splitChild(node, rank) == -1) {
+                return -1;
+            }
+            if (value == node->keys[rank]) {
+                return 1;
+            }
+            if (value > node->keys[rank]) {
+                rank++;
+            }
+        }
+        node = node->children[rank];
+    }
+}
+
+/* Helper function: merges the child at index + 1 of parent and the key
+ * between them into the child at index, both of which hold the minimum
+ * number of keys. */
+void mergeChildren(struct BTreeNode *parent, unsigned index) {
+    struct BTreeNode *left = parent->children[index];
+    struct BTreeNode *right = parent->children[index + 1];
+
+    left->keys[left->count] = parent->keys[index];
+    memcpy(&left->keys[left->count + 1], right->keys, right->count * sizeof(int));
+    if (!left->leaf) {
+        memcpy(&left->children[left->count + 1], right->children,
+               (right->count + 1) * sizeof(struct BTreeNode *));
+    }
+    left->count += right->count + 1;
+
+    memmove(&parent->keys[index], &parent->keys[index + 1],
+            (parent->count - index - 1) * sizeof(int));
+    memmove(&parent->children[index + 1], &parent->children[index + 2],
+            (parent->count - index - 1) * sizeof(struct BTreeNode *));
+    parent->count--;
+    free(right);
+}
+
+/* Helper function: moves the last key of the child at index - 1 of parent
+ * up into parent and the key between them down into the child at index. */
+void borrowFromLeft(struct BTreeNode *parent, unsigned index) {
+    struct BTreeNode *child = parent->children[index];
+    struct BTreeNode *sibling = parent->children[index - 1];
+
+    memmove(&child->keys[1], child->keys, child->count * sizeof(int));
+    child->keys[0] = parent->keys[index - 1];
+    parent->keys[index - 1] = sibling->keys[sibling->count - 1];
+    if (!child->leaf) {
+        memmove(&child->children[1], child->children,
+                (child->count + 1) * sizeof(struct BTreeNode *));
+        child->children[0] = sibling->children[sibling->count];
+    }
+    child->count++;
+    sibling->count--;
+}
+
+/* Helper function: moves the first key of the child at index + 1 of parent
+ * up into parent and the key between them down into the child at index. */
+void borrowFromRight(struct BTreeNode *parent, unsigned index) {
+    struct BTreeNode *child = parent->children[index];
+    struct BTreeNode *sibling = parent->children[index + 1];
+
+    child->keys[child->count] = parent->keys[index];
+    parent->keys[index] = sibling->keys[0];
+    memmove(sibling->keys, &sibling->keys[1], (sibling->count - 1) * sizeof(int));
+    if (!child->leaf) {
+        child->children[child->count + 1] = sibling->children[0];
+        memmove(sibling->children, &sibling->children[1],
+                sibling->count * sizeof(struct BTreeNode *));
+    }
+    child->count++;
+    sibling->count--;
+}
+
+int BTreeDelete(struct BTree *tree, int value) {
+    if (!tree) {
+        return -1;
+    }
+
+    // every node entered below the root holds more than the minimum number
+    // of keys, so removing one from a leaf never needs to look back up
+    int result = 1;
+    struct BTreeNode *node = tree->root;
+    while (node) {
+        unsigned rank = keyRank(node, value);
+        int found = rank < node->count && node->keys[rank] == value;
+
+        if (node->leaf) {
+            if (found) {
+                memmove(&node->keys[rank], &node->keys[rank + 1],
+                        (node->count - rank - 1) * sizeof(int));
+                node->count--;
+                tree->count--;
+                result = 0;
+            }
+            break;
+        }
+
+        if (found) {
+            // replace the key by its predecessor or successor and delete
+            // that one from its leaf instead, or merge around the key
+            struct BTreeNode *left = node->children[rank];
+            struct BTreeNode *right = node->children[rank + 1];
+            if (left->count >= BTREE_MIN_DEGREE) {
+                struct BTreeNode *last = left;
+                while (!last->leaf) {
+                    last = last->children[last->count];
+                }
+                value = last->keys[last->count - 1];
+                node->keys[rank] = value;
+                node = left;
+            } else if (right->count >= BTREE_MIN_DEGREE) {
+                struct BTreeNode *first = right;
+                while (!first->leaf) {
+                    first = first->children[0];
+                }
+                value = first->keys[0];
+                node->keys[rank] = value;
+                node = right;
+            } else {
+                mergeChildren(node, rank);
+                node = left;
+            }
+            continue;
+        }
+
+        struct BTreeNode *child = node->children[rank];
+        if (child->count == BTREE_MIN_DEGREE - 1) {
+            if (rank > 0 && node->children[rank - 1]->count >= BTREE_MIN_DEGREE) {
+                borrowFromLeft(node, rank);
+            } else if (rank < node->count
+                       && node->children[rank + 1]->count >= BTREE_MIN_DEGREE) {
+                borrowFromRight(node, rank);
+            } else if (rank < node->count) {
+                mergeChildren(node, rank);
+            } else {
+                mergeChildren(node, rank - 1);
+                child = node->children[rank - 1];
+            }
+        }
+        node = child;
+    }
+
+    // merges may have emptied the root
+    struct BTreeNode *root = tree->root;
+    if (root && root->count == 0) {
+        tree->root = root->leaf ? NULL : root->children[0];
+        free(root);
+    }
+
+    return result;
+}
+
+/* Helper function: returns the number of keys in node smaller than value,
+ * or not greater than value when inclusive. */
+unsigned keysUpTo(const struct BTreeNode *node, int value, int inclusive) {
+    unsigned rank = keyRank(node, value);
+    if (inclusive && rank < node->count && node->keys[rank] == value) {
+        rank++;
+    }
+
+    return rank;
+}
+
+int BTreeCeiling(struct BTree *tree, int value, int strict, int *result) {
+    if (!tree || !result) {
+        return 0;
+    }
+
+    // every key of the child descended into is smaller than the candidate
+    int found = 0;
+    struct BTreeNode *node = tree->root;
+    while (node) {
+        unsigned rank = keysUpTo(node, value, strict);
+        if (rank < node->count) {
+            *result = node->keys[rank];
+            found = 1;
+        }
+        node = node->leaf ? NULL : node->children[rank];
+    }
+
+    return found;
+}
+
+int BTreeFloor(struct BTree *tree, int value, int strict, int *result) {
+    if (!tree || !result) {
+        return 0;
+    }
+
+    // every key of the child descended into is greater than the candidate
+    int found = 0;
+    struct BTreeNode *node = tree->root;
+    while (node) {
+        unsigned rank = keysUpTo(node, value, !strict);
+        if (rank > 0) {
+            *result = node->keys[rank - 1];
+            found = 1;
+        }
+        node = node->leaf ? NULL : node->children[rank];
+    }
+
+    return found;
+}
+
+/* Helper function: returns the number of keys in the subtree at node.
+ * Recursion depth is bounded by the height of the tree. */
+size_t subtreeKeys(const struct BTreeNode *node) {
+    size_t count = node->count;
+    if (!node->leaf) {
+        for (unsigned i = 0; i <= node->count; i++) {
+            count += subtreeKeys(node->children[i]);
+        }
+    }
+
+    return count;
+}
+
+size_t BTreeRank(struct BTree *tree, int value) {
+    if (!tree) {
+        return 0;
+    }
+
+    size_t rank = 0;
+    struct BTreeNode *node = tree->root;
+    while (node) {
+        unsigned keys = keyRank(node, value);
+        rank += keys;
+        if (node->leaf) {
+            break;
+        }
+        for (unsigned i = 0; i < keys; i++) {
+            rank += subtreeKeys(node->children[i]);
+        }
+        node = node->children[keys];
+    }
+
+    return rank;
+}
+
+int BTreeSelect(struct BTree *tree, size_t k, int *result) {
+    if (!tree || !result || k >= tree->count) {
+        return -1;
+    }
+
+    struct BTreeNode *node = tree->root;
+    while (!node->leaf) {
+        unsigned i = 0;
+        for (; i < node->count; i++) {
+            size_t left = subtreeKeys(node->children[i]);
+            if (k < left) {
+                break;
+            }
+            if (k == left) {
+                *result = node->keys[i];
+                return 0;
+            }
+            k -= left + 1;
+        }
+        node = node->children[i];
+    }
+
+    *result = node->keys[k];
+    return 0;
+}
+
+/* Helper function: visits the keys of the subtree at node that are at
+ * least lo in order, returning 1 when visit stopped the walk, 2 when a
+ * key reached hi and 0 otherwise. Recursion depth is bounded by the
+ * height of the tree. */
+int visitKeys(const struct BTreeNode *node, int lo, int hi, BTreeVisitor visit,
+              void *context) {
+    for (unsigned i = keyRank(node, lo); i <= node->count; i++) {
+        if (!node->leaf) {
+            int result = visitKeys(node->children[i], lo, hi, visit, context);
+            if (result) {
+                return result;
+            }
+        }
+        if (i == node->count) {
+            break;
+        }
+        if (node->keys[i] >= hi) {
+            return 2;
+        }
+        if (visit(node->keys[i], context)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int BTreeRange(struct BTree *tree, int lo, int hi, BTreeVisitor visit, void *context) {
+    if (!tree || !visit) {
+        return -1;
+    }
+    if (!tree->root || lo >= hi) {
+        return 0;
+    }
+
+    return visitKeys(tree->root, lo, hi, visit, context) == 1;
+}
+
+size_t BTreeSize(struct BTree *tree) {
+    if (!tree) {
+        return 0;
+    }
+
+    return tree->count;
+}
+
+/* Helper function: returns the bytes allocated for the subtree at node.
+ * Recursion depth is bounded by the height of the tree. */
+size_t nodeBytes(const struct BTreeNode *node) {
+    if (node->leaf) {
+        return sizeof(struct BTreeNode);
+    }
+
+    size_t bytes = sizeof(struct BTreeNode) + (BTREE_MAX_KEYS + 1) * sizeof(struct BTreeNode *);
+    for (unsigned i = 0; i <= node->count; i++) {
+        bytes += nodeBytes(node->children[i]);
+    }
+
+    return bytes;
+}
+
+size_t BTreeBytes(struct BTree *tree) {
+    if (!tree) {
+        return 0;
+    }
+
+    return sizeof(struct BTree) + (tree->root ? nodeBytes(tree->root) : 0);
+}
+
+/* Helper function: checks the subtree at node, whose keys must lie within
+ * (lo, hi) where the bounds are present, and whose leaves must all be at
+ * leafDepth, which is set by the first leaf found. Returns the number of
+ * keys in the subtree or -1 when it is invalid. Recursion depth is bounded
+ * by the height of the tree. */
+long long nodeCheck(const struct BTreeNode *node, const int *lo, const int *hi,
+                    int depth, int *leafDepth, int isRoot) {
+    if (node->count > BTREE_MAX_KEYS
+        || (!isRoot && node->count < BTREE_MIN_DEGREE - 1) || node->count == 0) {
+        return -1;
+    }
+
+    for (unsigned i = 0; i < node->count; i++) {
+        if ((i > 0 && node->keys[i - 1] >= node->keys[i])
+            || (lo && node->keys[i] <= *lo) || (hi && node->keys[i] >= *hi)) {
+            return -1;
+        }
+    }
+
+    if (node->leaf) {
+        if (*leafDepth == -1) {
+            *leafDepth = depth;
+        }
+        return *leafDepth == depth ? (long long)node->count : -1;
+    }
+
+    long long total = node->count;
+    for (unsigned i = 0; i <= node->count; i++) {
+        const int *childLo = i > 0 ? &node->keys[i - 1] : lo;
+        const int *childHi = i < node->count ? &node->keys[i] : hi;
+        long long count = nodeCheck(node->children[i], childLo, childHi, depth + 1,
+                                    leafDepth, 0);
+        if (count == -1) {
+            return -1;
+        }
+        total += count;
+    }
+
+    return total;
+}
+
+int BTreeCheck(struct BTree *tree) {
+    if (!tree) {
+        return -1;
+    }
+    if (!tree->root) {
+        return tree->count == 0 ? 0 : -1;
+    }
+
+    int leafDepth = -1;
+    long long count = nodeCheck(tree->root, NULL, NULL, 0, &leafDepth, 1);
+
+    return count == (long long)tree->count ? 0 : -1;
+}
+
+/* Helper function: frees the subtree at node. Recursion depth is bounded
+ * by the height of the tree. */
+void nodeFreeAll(struct BTreeNode *node) {
+    if (!node->leaf) {
+        for (unsigned i = 0; i <= node->count; i++) {
+            nodeFreeAll(node->children[i]);
+        }
+    }
+    free(node);
+}
+
+void BTreeFree(struct BTree *tree) {
+    if (!tree) {
+        return;
+    }
+
+    if (tree->root) {
+        nodeFreeAll(tree->root);
+    }
+    free(tree);
+}
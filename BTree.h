@@ -0,0 +1,70 @@
+/* Header file for the B-tree backend of RBTree.c, selected with
+ * RBCreateBTree. Keys are kept in sorted blocks of up to BTREE_MAX_KEYS
+ * ints per node, so a search touches a handful of wide nodes instead of
+ * one 40-byte node per level. Structure can only contain unique values of
+ * type int. */
+
+#ifndef BTREE_H
+#define BTREE_H
+
+#include <stddef.h>
+
+struct BTree;
+
+/* Create a new empty B-tree, return a pointer to the tree on success,
+ * NULL on failure. */
+struct BTree *BTreeCreate(void);
+
+/* Insert a value into the tree, return 0 on success, -1 on failure.
+ * If the value is already present, leave the tree unchanged and
+ * return 1. */
+int BTreeInsert(struct BTree *tree, int value);
+
+/* Search for a value in the tree, return 1 when the value is present
+ * or 0 when the value is not found. */
+int BTreeSearch(struct BTree *tree, int value);
+
+/* Delete a value from the tree, return 0 on success. If the value is not
+ * present, leave the values unchanged and return 1. */
+int BTreeDelete(struct BTree *tree, int value);
+
+/* Find the smallest value not less than value, or greater than value when
+ * strict, and store it in result. Return 1 when there is one, 0 when
+ * not. */
+int BTreeCeiling(struct BTree *tree, int value, int strict, int *result);
+
+/* Find the largest value not greater than value, or less than value when
+ * strict, and store it in result. Return 1 when there is one, 0 when
+ * not. */
+int BTreeFloor(struct BTree *tree, int value, int strict, int *result);
+
+/* Return the number of values in the tree smaller than value. Takes time
+ * linear in the values below it, since nodes keep no subtree sizes. */
+size_t BTreeRank(struct BTree *tree, int value);
+
+/* Store the k-th smallest value of the tree, counting from 0, in result.
+ * Return 0 on success, -1 when k is out of range. Takes linear time like
+ * BTreeRank. */
+int BTreeSelect(struct BTree *tree, size_t k, int *result);
+
+/* Callback of BTreeRange, return nonzero to stop the walk. */
+typedef int (*BTreeVisitor)(int value, void *context);
+
+/* Call visit in ascending order for every value in [lo, hi). Return 0
+ * when the walk completed, 1 when visit stopped it, -1 on failure. */
+int BTreeRange(struct BTree *tree, int lo, int hi, BTreeVisitor visit, void *context);
+
+/* Return the number of values in the tree. */
+size_t BTreeSize(struct BTree *tree);
+
+/* Return the number of bytes allocated for the tree and its nodes. */
+size_t BTreeBytes(struct BTree *tree);
+
+/* Check if the tree is a valid B-tree, return 0 on success, -1 on
+ * failure. */
+int BTreeCheck(struct BTree *tree);
+
+/* Free the tree and all of its nodes. */
+void BTreeFree(struct BTree *tree);
+
+#endif /* BTREE_H */
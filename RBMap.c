@@ -0,0 +1,462 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "RBMap.h"
+
+struct RBMap {
+    struct RBLink *root;
+    size_t count;
+    RBCompare compare;
+    size_t keySize;
+    size_t valueSize;
+    /* Offset of the value behind the key, keeping the value aligned. */
+    size_t valueOffset;
+};
+
+/* Node of a runtime map: the key followed by the value. */
+struct RBMapNode {
+    struct RBLink link;
+    max_align_t data[];
+};
+
+/* Helper function */
+void linkRotateLeft(struct RBLink **root, struct RBLink *node) {
+    struct RBLink *right = node->right;
+    node->right = right->left;
+    if (right->left) {
+        right->left->parent = node;
+    }
+
+    right->parent = node->parent;
+    if (!node->parent) {
+        *root = right;
+    } else if (node == node->parent->left) {
+        node->parent->left = right;
+    } else {
+        node->parent->right = right;
+    }
+
+    right->left = node;
+    node->parent = right;
+}
+
+/* Helper function */
+void linkRotateRight(struct RBLink **root, struct RBLink *node) {
+    struct RBLink *left = node->left;
+    node->left = left->right;
+    if (left->right) {
+        left->right->parent = node;
+    }
+
+    left->parent = node->parent;
+    if (!node->parent) {
+        *root = left;
+    } else if (node == node->parent->left) {
+        node->parent->left = left;
+    } else {
+        node->parent->right = left;
+    }
+
+    left->right = node;
+    node->parent = left;
+}
+
+void RBLinkInsertFixup(struct RBLink **root, struct RBLink *node) {
+    while (node->parent && node->parent->red) {
+        struct RBLink *parent = node->parent;
+        struct RBLink *grandparent = parent->parent;
+        struct RBLink *uncle = parent == grandparent->left ? grandparent->right
+                                                            : grandparent->left;
+
+        if (uncle && uncle->red) {
+            parent->red = 0;
+            uncle->red = 0;
+            grandparent->red = 1;
+            node = grandparent;
+            continue;
+        }
+
+        // triangle case
+        if (parent == grandparent->left && node == parent->right) {
+            linkRotateLeft(root, parent);
+            node = parent;
+            parent = node->parent;
+        } else if (parent == grandparent->right && node == parent->left) {
+            linkRotateRight(root, parent);
+            node = parent;
+            parent = node->parent;
+        }
+
+        // line case (always follows triangle case)
+        if (node == parent->left) {
+            linkRotateRight(root, grandparent);
+        } else {
+            linkRotateLeft(root, grandparent);
+        }
+        parent->red = 0;
+        grandparent->red = 1;
+        break;
+    }
+
+    (*root)->red = 0;
+}
+
+/* Helper function: puts replacement in the place of node below the parent
+ * of node. */
+void linkTransplant(struct RBLink **root, struct RBLink *node, struct RBLink *replacement) {
+    if (!node->parent) {
+        *root = replacement;
+    } else if (node == node->parent->left) {
+        node->parent->left = replacement;
+    } else {
+        node->parent->right = replacement;
+    }
+
+    if (replacement) {
+        replacement->parent = node->parent;
+    }
+}
+
+/* Helper function: restores red-black properties after a black node was
+ * removed above node, which may be NULL and therefore comes with its
+ * parent. */
+void linkEraseFixup(struct RBLink **root, struct RBLink *node, struct RBLink *parent) {
+    while (node != *root && (!node || !node->red)) {
+        if (node == parent->left) {
+            struct RBLink *sibling = parent->right;
+            if (sibling->red) {
+                sibling->red = 0;
+                parent->red = 1;
+                linkRotateLeft(root, parent);
+                sibling = parent->right;
+            }
+
+            if ((!sibling->left || !sibling->left->red)
+                && (!sibling->right || !sibling->right->red)) {
+                sibling->red = 1;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+
+            if (!sibling->right || !sibling->right->red) {
+                sibling->left->red = 0;
+                sibling->red = 1;
+                linkRotateRight(root, sibling);
+                sibling = parent->right;
+            }
+
+            sibling->red = parent->red;
+            parent->red = 0;
+            sibling->right->red = 0;
+            linkRotateLeft(root, parent);
+        } else {
+            struct RBLink *sibling = parent->left;
+            if (sibling->red) {
+                sibling->red = 0;
+                parent->red = 1;
+                linkRotateRight(root, parent);
+                sibling = parent->left;
+            }
+
+            if ((!sibling->left || !sibling->left->red)
+                && (!sibling->right || !sibling->right->red)) {
+                sibling->red = 1;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+
+            if (!sibling->left || !sibling->left->red) {
+                sibling->right->red = 0;
+                sibling->red = 1;
+                linkRotateLeft(root, sibling);
+                sibling = parent->left;
+            }
+
+            sibling->red = parent->red;
+            parent->red = 0;
+            sibling->left->red = 0;
+            linkRotateRight(root, parent);
+        }
+        node = *root;
+    }
+
+    if (node) {
+        node->red = 0;
+    }
+}
+
+void RBLinkErase(struct RBLink **root, struct RBLink *node) {
+    struct RBLink *child;
+    struct RBLink *parent;
+    int removedRed = node->red;
+
+    if (!node->left) {
+        child = node->right;
+        parent = node->parent;
+        linkTransplant(root, node, child);
+    } else if (!node->right) {
+        child = node->left;
+        parent = node->parent;
+        linkTransplant(root, node, child);
+    } else {
+        // the successor takes the place and color of node
+        struct RBLink *successor = RBLinkFirst(node->right);
+        removedRed = successor->red;
+        child = successor->right;
+        if (successor->parent == node) {
+            parent = successor;
+        } else {
+            parent = successor->parent;
+            linkTransplant(root, successor, child);
+            successor->right = node->right;
+            successor->right->parent = successor;
+        }
+
+        linkTransplant(root, node, successor);
+        successor->left = node->left;
+        successor->left->parent = successor;
+        successor->red = node->red;
+    }
+
+    if (!removedRed) {
+        linkEraseFixup(root, child, parent);
+    }
+}
+
+struct RBLink *RBLinkFirst(struct RBLink *root) {
+    if (!root) {
+        return NULL;
+    }
+
+    while (root->left) {
+        root = root->left;
+    }
+
+    return root;
+}
+
+struct RBLink *RBLinkNext(struct RBLink *node) {
+    if (node->right) {
+        return RBLinkFirst(node->right);
+    }
+
+    while (node->parent && node == node->parent->right) {
+        node = node->parent;
+    }
+
+    return node->parent;
+}
+
+int RBLinkCheck(struct RBLink *root) {
+    if (!root) {
+        return 0;
+    }
+    if (root->red || root->parent) {
+        return -1;
+    }
+
+    // every node without two children ends a path, all of which must hold
+    // the black depth of the leftmost one
+    int expected = -1;
+    for (struct RBLink *node = RBLinkFirst(root); node; node = RBLinkNext(node)) {
+        if ((node->left && node->left->parent != node)
+            || (node->right && node->right->parent != node)) {
+            return -1;
+        }
+        if (node->red && node->parent && node->parent->red) {
+            return -1;
+        }
+        if (node->left && node->right) {
+            continue;
+        }
+
+        int depth = 0;
+        for (struct RBLink *ancestor = node; ancestor; ancestor = ancestor->parent) {
+            depth += !ancestor->red;
+        }
+        if (expected == -1) {
+            expected = depth;
+        } else if (depth != expected) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void RBLinkFreeAll(struct RBLink *root) {
+    // free leaves bottom up, detaching each one from its parent
+    struct RBLink *node = root;
+    while (node) {
+        if (node->left) {
+            node = node->left;
+        } else if (node->right) {
+            node = node->right;
+        } else {
+            struct RBLink *parent = node->parent;
+            if (parent) {
+                if (node == parent->left) {
+                    parent->left = NULL;
+                } else {
+                    parent->right = NULL;
+                }
+            }
+            free(node);
+            node = parent;
+        }
+    }
+}
+
+/* Helper function: returns a pointer to the key stored in node. */
+void *nodeKey(struct RBMapNode *node) {
+    return node->data;
+}
+
+/* Helper function: returns a pointer to the value stored in node. */
+void *nodeValue(struct RBMap *map, struct RBMapNode *node) {
+    return (unsigned char *)node->data + map->valueOffset;
+}
+
+struct RBMap *RBMapCreate(RBCompare compare, size_t keySize, size_t valueSize) {
+    if (!compare) {
+        return NULL;
+    }
+
+    struct RBMap *map = malloc(sizeof(struct RBMap));
+    if (!map) {
+        return NULL;
+    }
+
+    map->root = NULL;
+    map->count = 0;
+    map->compare = compare;
+    map->keySize = keySize;
+    map->valueSize = valueSize;
+    map->valueOffset = (keySize + sizeof(max_align_t) - 1)
+                       / sizeof(max_align_t) * sizeof(max_align_t);
+
+    return map;
+}
+
+/* Helper function: finds and returns the node holding key, NULL when the
+ * key is not present. */
+struct RBMapNode *mapFind(struct RBMap *map, const void *key) {
+    struct RBLink *link = map->root;
+    while (link) {
+        int order = map->compare(key, nodeKey((struct RBMapNode *)link));
+        if (order == 0) {
+            return (struct RBMapNode *)link;
+        }
+        link = order < 0 ? link->left : link->right;
+    }
+
+    return NULL;
+}
+
+int RBMapPut(struct RBMap *map, const void *key, const void *value) {
+    if (!map || !key || (!value && map->valueSize > 0)) {
+        return -1;
+    }
+
+    struct RBLink *parent = NULL;
+    struct RBLink **slot = &map->root;
+    while (*slot) {
+        parent = *slot;
+        int order = map->compare(key, nodeKey((struct RBMapNode *)parent));
+        if (order == 0) {
+            if (map->valueSize > 0) {
+                memcpy(nodeValue(map, (struct RBMapNode *)parent), value, map->valueSize);
+            }
+            return 1;
+        }
+        slot = order < 0 ? &parent->left : &parent->right;
+    }
+
+    struct RBMapNode *node = malloc(sizeof(struct RBMapNode) + map->valueOffset
+                                    + map->valueSize);
+    if (!node) {
+        return -1;
+    }
+
+    memcpy(nodeKey(node), key, map->keySize);
+    if (map->valueSize > 0) {
+        memcpy(nodeValue(map, node), value, map->valueSize);
+    }
+    node->link.left = NULL;
+    node->link.right = NULL;
+    node->link.parent = parent;
+    node->link.red = 1;
+    *slot = &node->link;
+    RBLinkInsertFixup(&map->root, &node->link);
+    map->count++;
+
+    return 0;
+}
+
+void *RBMapGet(struct RBMap *map, const void *key) {
+    if (!map || !key) {
+        return NULL;
+    }
+
+    struct RBMapNode *node = mapFind(map, key);
+    return node ? nodeValue(map, node) : NULL;
+}
+
+int RBMapRemove(struct RBMap *map, const void *key) {
+    if (!map || !key) {
+        return -1;
+    }
+
+    struct RBMapNode *node = mapFind(map, key);
+    if (!node) {
+        return 1;
+    }
+
+    RBLinkErase(&map->root, &node->link);
+    free(node);
+    map->count--;
+
+    return 0;
+}
+
+size_t RBMapSize(struct RBMap *map) {
+    if (!map) {
+        return 0;
+    }
+
+    return map->count;
+}
+
+int RBMapCheck(struct RBMap *map) {
+    if (!map) {
+        return -1;
+    }
+
+    if (RBLinkCheck(map->root) == -1) {
+        return -1;
+    }
+
+    size_t count = 0;
+    struct RBLink *previous = NULL;
+    for (struct RBLink *link = RBLinkFirst(map->root); link; link = RBLinkNext(link)) {
+        if (previous && map->compare(nodeKey((struct RBMapNode *)previous),
+                                     nodeKey((struct RBMapNode *)link)) >= 0) {
+            return -1;
+        }
+        previous = link;
+        count++;
+    }
+
+    return count == map->count ? 0 : -1;
+}
+
+void RBMapFree(struct RBMap *map) {
+    if (!map) {
+        return;
+    }
+
+    RBLinkFreeAll(map->root);
+    free(map);
+}
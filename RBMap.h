@@ -0,0 +1,214 @@
+/* Header file for red-black tree maps from keys of any type to values.
+ * Structure is ordered by a user comparator and holds unique keys, each with
+ * one value stored inline in its node.
+ *
+ * Two flavors share the balancing code in RBMap.c, which only rewires
+ * struct RBLink members and never looks at keys:
+ * - RBMapCreate builds a map at runtime from a comparator function and the
+ *   sizes of keys and values.
+ * - RBMAP_DEFINE instantiates a typed map for one key and value type, with
+ *   the comparison inlined into every descent. */
+
+#ifndef RBMAP_H
+#define RBMAP_H
+
+#include <stddef.h>
+#include <stdlib.h>
+
+/* Tree linkage, embedded as the first member of every map node. */
+struct RBLink {
+    struct RBLink *left;
+    struct RBLink *right;
+    struct RBLink *parent;
+    int red;
+};
+
+/* Restore the red-black properties of the tree rooted at *root after node
+ * was linked in as a new red leaf. */
+void RBLinkInsertFixup(struct RBLink **root, struct RBLink *node);
+
+/* Unlink node from the tree rooted at *root by relinking its neighbours and
+ * restore the red-black properties. Node is not freed. */
+void RBLinkErase(struct RBLink **root, struct RBLink *node);
+
+/* Return the leftmost node of the tree, NULL when it is empty. */
+struct RBLink *RBLinkFirst(struct RBLink *root);
+
+/* Return the in-order successor of node, NULL when node is the last. */
+struct RBLink *RBLinkNext(struct RBLink *node);
+
+/* Check the red-black and parent pointer properties of the tree, ignoring
+ * key order, return 0 on success, -1 on failure. */
+int RBLinkCheck(struct RBLink *root);
+
+/* Free every node of the tree. Nodes must have been allocated with malloc
+ * and have their struct RBLink as first member. */
+void RBLinkFreeAll(struct RBLink *root);
+
+/* Comparator for runtime maps, returns a negative number, zero or a
+ * positive number when the key at a is smaller than, equal to or greater
+ * than the key at b. */
+typedef int (*RBCompare)(const void *a, const void *b);
+
+struct RBMap;
+
+/* Create a new map ordered by compare whose keys and values are copied into
+ * its nodes as keySize and valueSize bytes, return a pointer to the map on
+ * success, NULL on failure. */
+struct RBMap *RBMapCreate(RBCompare compare, size_t keySize, size_t valueSize);
+
+/* Store a copy of value under a copy of key, return 0 when the key is new,
+ * 1 when its value was replaced and -1 on failure. */
+int RBMapPut(struct RBMap *map, const void *key, const void *value);
+
+/* Return a pointer to the value stored under key, or NULL when the key is
+ * not present. The pointer stays valid until the key is removed. */
+void *RBMapGet(struct RBMap *map, const void *key);
+
+/* Remove key and its value, return 0 on success, -1 on failure.
+ * If the key is not present, leave the map unchanged and return 1. */
+int RBMapRemove(struct RBMap *map, const void *key);
+
+/* Return the number of keys in the map. */
+size_t RBMapSize(struct RBMap *map);
+
+/* Check if the map is a valid red-black tree ordered by its comparator,
+ * return 0 on success, -1 on failure. */
+int RBMapCheck(struct RBMap *map);
+
+/* Free the map and all of its nodes. */
+void RBMapFree(struct RBMap *map);
+
+/* Instantiate a map type struct Name from KeyType to ValueType, ordered by
+ * compare(KeyType a, KeyType b), which returns a negative number, zero or a
+ * positive number like strcmp. The map offers
+ *   struct Name *NameCreate(void)
+ *   int NamePut(struct Name *map, KeyType key, ValueType value)
+ *   ValueType *NameGet(struct Name *map, KeyType key)
+ *   int NameRemove(struct Name *map, KeyType key)
+ *   struct NameNode *NameFirst(struct Name *map)
+ *   struct NameNode *NameNext(struct NameNode *node)
+ *   size_t NameSize(struct Name *map)
+ *   void NameFree(struct Name *map)
+ * with the return values of their RBMap counterparts. Nodes expose their
+ * key and value members for iteration. */
+#define RBMAP_DEFINE(Name, KeyType, ValueType, compare)                         \
+struct Name##Node {                                                             \
+    struct RBLink link;                                                         \
+    KeyType key;                                                                \
+    ValueType value;                                                            \
+};                                                                              \
+                                                                                \
+struct Name {                                                                   \
+    struct RBLink *root;                                                        \
+    size_t count;                                                               \
+};                                                                              \
+                                                                                \
+static inline struct Name *Name##Create(void) {                                 \
+    struct Name *map = malloc(sizeof(struct Name));                             \
+    if (!map) {                                                                 \
+        return NULL;                                                            \
+    }                                                                           \
+                                                                                \
+    map->root = NULL;                                                           \
+    map->count = 0;                                                             \
+                                                                                \
+    return map;                                                                 \
+}                                                                               \
+                                                                                \
+static inline struct Name##Node *Name##Find(struct Name *map, KeyType key) {    \
+    struct RBLink *link = map->root;                                            \
+    while (link) {                                                              \
+        int order = compare(key, ((struct Name##Node *)link)->key);             \
+        if (order == 0) {                                                       \
+            return (struct Name##Node *)link;                                   \
+        }                                                                       \
+        link = order < 0 ? link->left : link->right;                            \
+    }                                                                           \
+                                                                                \
+    return NULL;                                                                \
+}                                                                               \
+                                                                                \
+static inline int Name##Put(struct Name *map, KeyType key, ValueType value) {   \
+    if (!map) {                                                                 \
+        return -1;                                                              \
+    }                                                                           \
+                                                                                \
+    struct RBLink *parent = NULL;                                               \
+    struct RBLink **slot = &map->root;                                          \
+    while (*slot) {                                                             \
+        parent = *slot;                                                         \
+        int order = compare(key, ((struct Name##Node *)parent)->key);           \
+        if (order == 0) {                                                       \
+            ((struct Name##Node *)parent)->value = value;                       \
+            return 1;                                                           \
+        }                                                                       \
+        slot = order < 0 ? &parent->left : &parent->right;                      \
+    }                                                                           \
+                                                                                \
+    struct Name##Node *node = malloc(sizeof(struct Name##Node));                \
+    if (!node) {                                                                \
+        return -1;                                                              \
+    }                                                                           \
+                                                                                \
+    node->key = key;                                                            \
+    node->value = value;                                                        \
+    node->link.left = NULL;                                                     \
+    node->link.right = NULL;                                                    \
+    node->link.parent = parent;                                                 \
+    node->link.red = 1;                                                         \
+    *slot = &node->link;                                                        \
+    RBLinkInsertFixup(&map->root, &node->link);                                 \
+    map->count++;                                                               \
+                                                                                \
+    return 0;                                                                   \
+}                                                                               \
+                                                                                \
+static inline ValueType *Name##Get(struct Name *map, KeyType key) {             \
+    if (!map) {                                                                 \
+        return NULL;                                                            \
+    }                                                                           \
+                                                                                \
+    struct Name##Node *node = Name##Find(map, key);                             \
+    return node ? &node->value : NULL;                                          \
+}                                                                               \
+                                                                                \
+static inline int Name##Remove(struct Name *map, KeyType key) {                 \
+    if (!map) {                                                                 \
+        return -1;                                                              \
+    }                                                                           \
+                                                                                \
+    struct Name##Node *node = Name##Find(map, key);                             \
+    if (!node) {                                                                \
+        return 1;                                                               \
+    }                                                                           \
+                                                                                \
+    RBLinkErase(&map->root, &node->link);                                       \
+    free(node);                                                                 \
+    map->count--;                                                               \
+                                                                                \
+    return 0;                                                                   \
+}                                                                               \
+                                                                                \
+static inline struct Name##Node *Name##First(struct Name *map) {                \
+    return map ? (struct Name##Node *)RBLinkFirst(map->root) : NULL;            \
+}                                                                               \
+                                                                                \
+static inline struct Name##Node *Name##Next(struct Name##Node *node) {          \
+    return (struct Name##Node *)RBLinkNext(&node->link);                        \
+}                                                                               \
+                                                                                \
+static inline size_t Name##Size(struct Name *map) {                             \
+    return map ? map->count : 0;                                                \
+}                                                                               \
+                                                                                \
+static inline void Name##Free(struct Name *map) {                               \
+    if (!map) {                                                                 \
+        return;                                                                 \
+    }                                                                           \
+                                                                                \
+    RBLinkFreeAll(map->root);                                                   \
+    free(map);                                                                  \
+}
+
+#endif /* RBMAP_H */
@@ -1,75 +1,744 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
+#include "BTree.h"
 #include "RBTree.h"
 
+/* Define RB_NO_ORDER_STATISTICS to leave out the subtree size kept in every
+ * node. RBRank, RBSelect and RBRangeCount then walk the tree in order
+ * instead of descending in O(log n). */
+#ifndef RB_NO_ORDER_STATISTICS
+#define RB_ORDER_STATISTICS
+#endif
+
+/* Define RB_PREFETCH_SEARCH to make RBSearch prefetch the children of every
+ * node it visits, as RBSearchPrefetch does. This pays off once the tree no
+ * longer fits in cache. */
+
+/* Define RB_COMPACT_NODES to store the color of a node in the lowest bit of
+ * its parent pointer and, with order statistics, keep 32-bit subtree sizes.
+ * This shrinks a node from 40 to 32 bytes on 64-bit targets, but limits a
+ * tree to UINT_MAX values. */
+
+/* Define RB_MULTISET to keep the number of occurrences of its value in
+ * every node, which RBCreateMultiset needs. This grows a node by 8 bytes
+ * on 64-bit targets. */
+
+/* Define RB_STATS to count operations, rotations, recolorings and fixup
+ * cases per tree for RBGetStats. Without it the counters compile away and
+ * RBGetStats only reports the size and memory of the tree. */
+
+#ifdef RB_STATS
+/* Number of nodes visited by the search the thread is running. Searches
+ * count their visits with STAT_VISIT between STAT_SEARCH_START and
+ * STAT_SEARCH_END, which records them in the stats of the tree. */
+static _Thread_local size_t searchVisits;
+
+#define STAT_ADD(tree, counter, n) ((tree)->stats.counter += (n))
+#define STAT_VISIT() (searchVisits++)
+#define STAT_SEARCH_START() (searchVisits = 0)
+#define STAT_SEARCH_END(tree, found) recordSearch(tree, found)
+#else
+#define STAT_ADD(tree, counter, n) ((void)0)
+#define STAT_VISIT() ((void)0)
+#define STAT_SEARCH_START() ((void)0)
+#define STAT_SEARCH_END(tree, found) ((void)0)
+#endif
+
+/* Define RB_DEBUG_CHECKS to assert RBCheckLocal after every modification,
+ * which costs O(log^2 n) per operation. */
+
+#ifdef RB_DEBUG_CHECKS
+#define DEBUG_CHECK(tree) assert(treeCheckLocal(tree) == 0)
+#else
+#define DEBUG_CHECK(tree) ((void)0)
+#endif
+
+#if defined(__GNUC__)
+#define PREFETCH(address) __builtin_prefetch(address)
+#else
+#define PREFETCH(address) ((void)(address))
+#endif
+
 typedef enum {BLACK, RED} Color;
 
-struct RBTree {
-    struct RBNode *root;
-};
+/* Number of optimistic RBSearch attempts on a concurrent tree before the
+ * search falls back to the read lock. */
+#define OPTIMISTIC_ATTEMPTS 8
+
+/* Upper bound on the depth of a red-black tree with 64-bit sizes. An
+ * optimistic descent that goes deeper has read a half-rotated tree. */
+#define MAX_DEPTH 130
+
+/* Number of nodes in a pool chunk when no capacity is requested. */
+#define POOL_CHUNK_NODES 1024
+
+/* Parallel operations only hand a subtree to another thread if it has at
+ * least this black height, or 2^PARALLEL_MIN_HEIGHT nodes when it is yet to
+ * be built. Smaller subtrees finish before a thread would start. */
+#define PARALLEL_MIN_HEIGHT 10
+
+#ifdef RB_COMPACT_NODES
+typedef unsigned int SubtreeSize;
+#else
+typedef size_t SubtreeSize;
+#endif
 
 struct RBNode {
     int value;
+#ifdef RB_MULTISET
+    /* Number of times value is in a multiset, 1 in other trees. */
+    unsigned int multiplicity;
+#endif
+#ifndef RB_COMPACT_NODES
     Color color;
+#endif
+#ifdef RB_ORDER_STATISTICS
+    /* Number of nodes in the subtree rooted at this node. */
+    SubtreeSize size;
+#endif
     struct RBNode *left;
     struct RBNode *right;
+#ifdef RB_COMPACT_NODES
+    /* Parent pointer with the color in its lowest bit, which is always
+     * clear in a pointer to a node. */
+    uintptr_t parentColor;
+#else
     struct RBNode *parent;
+#endif
+};
+
+/* Helper function: returns the parent of the node. */
+struct RBNode *getParent(const struct RBNode *node) {
+#ifdef RB_COMPACT_NODES
+    return (struct RBNode *)(node->parentColor & ~(uintptr_t)1);
+#else
+    return node->parent;
+#endif
+}
+
+/* Helper function: sets the parent of the node, keeping its color. */
+void setParent(struct RBNode *node, struct RBNode *parent) {
+#ifdef RB_COMPACT_NODES
+    node->parentColor = (uintptr_t)parent | (node->parentColor & 1);
+#else
+    node->parent = parent;
+#endif
+}
+
+/* Helper function: returns the color of the node. */
+Color getColor(const struct RBNode *node) {
+#ifdef RB_COMPACT_NODES
+    return node->parentColor & 1 ? RED : BLACK;
+#else
+    return node->color;
+#endif
+}
+
+/* Helper function: sets the color of the node, keeping its parent. */
+void setColor(struct RBNode *node, Color color) {
+#ifdef RB_COMPACT_NODES
+    node->parentColor = (node->parentColor & ~(uintptr_t)1) | (color == RED);
+#else
+    node->color = color;
+#endif
+}
+
+/* Slab of nodes owned by a pool. Chunks are linked together so that
+ * the whole pool can be released without visiting individual nodes. */
+struct RBPoolChunk {
+    struct RBPoolChunk *next;
+    size_t capacity;
+    size_t used;
+    struct RBNode nodes[];
+};
+
+/* Stack of released subtrees, linked through the parent pointer of their
+ * roots. The nodes below a root are only pushed once the root is reused,
+ * so a whole subtree is released in O(1). */
+struct FreeList {
+    struct RBNode *head;
+    struct RBNode *tail;
+};
+
+/* Reference from one pool to another whose nodes it holds. */
+struct RBPoolLink {
+    struct RBPool *pool;
+    struct RBPoolLink *next;
+};
+
+/* Nodes of one or more trees. A tree owns its pool alone until RBSplit
+ * shares it with the second half. Joining trees of different pools links
+ * the pool of the consumed tree to the pool of the result, so every node a
+ * tree may hold stays valid until its last holder is freed. */
+struct RBPool {
+    struct RBPoolChunk *chunks;
+    struct FreeList free;
+    /* Number of trees and pools holding this pool. Allocations take the
+     * mutex while more than one holder exists. */
+    atomic_size_t refs;
+    pthread_mutex_t mutex;
+    struct RBPoolLink *links;
+};
+
+/* Guards the links between pools. */
+static pthread_mutex_t poolLinkMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Synchronization of a concurrent tree. Writers hold the write lock and
+ * make the sequence odd while they modify the tree, so optimistic readers
+ * can detect that a rotation overlapped their descent. */
+struct RBLock {
+    pthread_rwlock_t rwlock;
+    atomic_uint sequence;
+};
+
+/* Node of the persistent copy of the values of a tree that snapshots share
+ * with it. Nodes are immutable once linked and have no parent pointer, so a
+ * modification copies the path down to its value and shares every other
+ * node with the older versions. The copy is a treap: priority is a hash of
+ * the value, which keeps it balanced in expectation without rebalancing.
+ * references counts the parents and versions holding the node. */
+struct SharedNode {
+    atomic_uint references;
+    int value;
+    unsigned priority;
+    struct SharedNode *left;
+    struct SharedNode *right;
+};
+
+/* Point-in-time view of a tree: a version of its persistent copy. */
+struct RBSnapshot {
+    struct SharedNode *root;
+    size_t count;
+};
+
+#ifdef RB_STATS
+/* Operation counters of a tree, named as in struct RBStats. Modifications
+ * update them under the write lock, searches, which may run side by side,
+ * atomically. */
+struct TreeStats {
+    size_t inserts;
+    size_t duplicates;
+    size_t deletes;
+    size_t deleteMisses;
+    size_t rotations;
+    size_t recolorings;
+    size_t insertUncleRed;
+    size_t insertTriangle;
+    size_t insertLine;
+    size_t deleteSiblingRed;
+    size_t deleteBlackChildren;
+    size_t deleteNearChildRed;
+    size_t deleteFarChildRed;
+    atomic_size_t searches;
+    atomic_size_t searchMisses;
+    atomic_size_t searchDepth;
+    atomic_size_t maxSearchDepth;
+};
+#endif
+
+struct RBTree {
+    struct RBNode *root;
+    size_t count;
+    struct RBPool *pool;
+    /* Set for concurrent trees, NULL otherwise. */
+    struct RBLock *lock;
+    /* Persistent copy of the values, kept from the first snapshot on while
+     * sharing is set, so that later snapshots only take its root. */
+    struct SharedNode *shared;
+    int sharing;
+    /* Number of nodes allocated for shared so far. */
+    size_t sharedNodes;
+    /* Set for trees created with RBCreateBTree, which keep their values
+     * there instead of below root. */
+    struct BTree *btree;
+    /* Node inserted, or parent of the node unlinked, by the last
+     * modification, NULL when it was none of these. */
+    struct RBNode *touched;
+    /* Set for trees created with RBCreateMultiset. */
+    int multiset;
+#ifdef RB_STATS
+    struct TreeStats stats;
+#endif
 };
 
+/* Helper function: RBCheckLocal without taking the tree lock. */
+int treeCheckLocal(struct RBTree *tree);
+
+/* Helper function: updates the persistent copy of a tree after a
+ * modification that may have added or removed value. */
+void shareChange(struct RBTree *tree, int value);
+
+/* Helper function: stops keeping the persistent copy of a tree after a
+ * modification that changed too much of it to copy paths. */
+void shareDrop(struct RBTree *tree);
+
+/* Helper function: drops a reference to a node of a persistent copy. */
+void sharedRelease(struct SharedNode *node);
+
+/* Helper function: pushes the subtree rooted at node onto the list. */
+void freeListPush(struct FreeList *list, struct RBNode *node) {
+    setParent(node, list->head);
+    list->head = node;
+    if (!list->tail) {
+        list->tail = node;
+    }
+}
+
+/* Helper function: pops the root of the top subtree off the list and pushes
+ * its children instead, returns NULL when the list is empty. */
+struct RBNode *freeListPop(struct FreeList *list) {
+    struct RBNode *node = list->head;
+    if (!node) {
+        return NULL;
+    }
+
+    list->head = getParent(node);
+    if (!list->head) {
+        list->tail = NULL;
+    }
+    if (node->left) {
+        freeListPush(list, node->left);
+    }
+    if (node->right) {
+        freeListPush(list, node->right);
+    }
+
+    return node;
+}
+
+/* Helper function: moves every subtree of source onto the list in O(1). */
+void freeListSplice(struct FreeList *list, struct FreeList *source) {
+    if (!source->head) {
+        return;
+    }
+
+    if (list->head) {
+        setParent(source->tail, list->head);
+    } else {
+        list->tail = source->tail;
+    }
+    list->head = source->head;
+    source->head = NULL;
+    source->tail = NULL;
+}
+
+/* Helper function: returns a new empty pool with one holder, NULL on
+ * failure. */
+struct RBPool *poolCreate(void) {
+    struct RBPool *pool = malloc(sizeof(struct RBPool));
+    if (!pool) {
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0) {
+        free(pool);
+        return NULL;
+    }
+    pool->chunks = NULL;
+    pool->free.head = NULL;
+    pool->free.tail = NULL;
+    atomic_init(&pool->refs, 1);
+    pool->links = NULL;
+
+    return pool;
+}
+
+/* Helper function: drops one hold on the pool. The last holder releases
+ * every chunk, which frees all nodes without walking any tree, and drops
+ * the holds of the pool on the pools it links. */
+void poolDrop(struct RBPool *pool) {
+    if (atomic_fetch_sub(&pool->refs, 1) != 1) {
+        return;
+    }
+
+    struct RBPoolChunk *chunk = pool->chunks;
+    while (chunk) {
+        struct RBPoolChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    struct RBPoolLink *link = pool->links;
+    while (link) {
+        struct RBPoolLink *next = link->next;
+        poolDrop(link->pool);
+        free(link);
+        link = next;
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+/* Helper function: takes the mutex of the pool if other holders may use it
+ * at the same time, returns 1 when the mutex was taken, 0 otherwise. */
+int poolLock(struct RBPool *pool) {
+    if (atomic_load_explicit(&pool->refs, memory_order_acquire) == 1) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    return 1;
+}
+
+/* Helper function: releases the mutex of the pool if poolLock took it. */
+void poolUnlock(struct RBPool *pool, int locked) {
+    if (locked) {
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+/* Helper function: prepends a chunk with room for capacity nodes to the
+ * pool, returns 0 on success, -1 on failure, including a capacity whose
+ * chunk size does not fit in a size_t. */
+int poolGrow(struct RBPool *pool, size_t capacity) {
+    if (capacity > (SIZE_MAX - sizeof(struct RBPoolChunk)) / sizeof(struct RBNode)) {
+        return -1;
+    }
+
+    struct RBPoolChunk *chunk = malloc(sizeof(struct RBPoolChunk)
+                                       + capacity * sizeof(struct RBNode));
+    if (!chunk) {
+        return -1;
+    }
+
+    chunk->capacity = capacity;
+    chunk->used = 0;
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+
+    return 0;
+}
+
+/* Helper function: returns an unused node from the pool of the tree,
+ * NULL on failure. */
+struct RBNode *poolAlloc(struct RBTree *tree) {
+    struct RBPool *pool = tree->pool;
+    int locked = poolLock(pool);
+
+    struct RBNode *n = freeListPop(&pool->free);
+    if (!n) {
+        struct RBPoolChunk *chunk = pool->chunks;
+        if (!chunk || chunk->used == chunk->capacity) {
+            chunk = poolGrow(pool, POOL_CHUNK_NODES) == -1 ? NULL : pool->chunks;
+        }
+        n = chunk ? &chunk->nodes[chunk->used++] : NULL;
+    }
+
+    poolUnlock(pool, locked);
+    return n;
+}
+
+/* Helper function: hands a node back to the pool of the tree. */
+void poolRelease(struct RBTree *tree, struct RBNode *node) {
+    node->left = NULL;
+    node->right = NULL;
+
+    int locked = poolLock(tree->pool);
+    freeListPush(&tree->pool->free, node);
+    poolUnlock(tree->pool, locked);
+}
+
+/* Helper function: hands every subtree of the list back to the pool of the
+ * tree. */
+void poolReleaseList(struct RBTree *tree, struct FreeList *list) {
+    int locked = poolLock(tree->pool);
+    freeListSplice(&tree->pool->free, list);
+    poolUnlock(tree->pool, locked);
+}
+
+/* Helper function: returns 1 when pool is target or links it, directly or
+ * through other pools, 0 otherwise. The caller holds poolLinkMutex. */
+int poolHolds(struct RBPool *pool, struct RBPool *target) {
+    if (pool == target) {
+        return 1;
+    }
+
+    for (struct RBPoolLink *link = pool->links; link; link = link->next) {
+        if (poolHolds(link->pool, target)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Helper function: makes sure the pool of tree keeps the nodes of other
+ * alive, so that they can move into tree. Links only ever point from the
+ * newer holder to the older pool, which keeps the links free of cycles.
+ * Returns 0 on success, -1 on failure. */
+int poolAdopt(struct RBTree *tree, struct RBTree *other) {
+    struct RBPool *pool = tree->pool;
+    struct RBPool *source = other->pool;
+    int result = 0;
+
+    pthread_mutex_lock(&poolLinkMutex);
+    if (poolHolds(pool, source)) {
+        // nothing to do, which covers trees split from each other
+    } else if (poolHolds(source, pool)) {
+        // the pool of other already keeps the pool of tree alive
+        atomic_fetch_add(&source->refs, 1);
+        tree->pool = source;
+        poolDrop(pool);
+    } else {
+        struct RBPoolLink *link = malloc(sizeof(struct RBPoolLink));
+        if (link) {
+            atomic_fetch_add(&source->refs, 1);
+            link->pool = source;
+            link->next = pool->links;
+            pool->links = link;
+        } else {
+            result = -1;
+        }
+    }
+    pthread_mutex_unlock(&poolLinkMutex);
+
+    return result;
+}
+
 /* Helper function: return a pointer to made node on success,
  * NULL on failure. */
-struct RBNode *makeNode(int value) {
-    struct RBNode *n = malloc(sizeof(struct RBNode));
+struct RBNode *makeNode(struct RBTree *tree, int value) {
+    struct RBNode *n = poolAlloc(tree);
     if (!n) {
         return NULL;
     }
 
     n->value = value;
-    n->color = RED;
+#ifdef RB_MULTISET
+    n->multiplicity = 1;
+#endif
+    setColor(n, RED);
+#ifdef RB_ORDER_STATISTICS
+    n->size = 1;
+#endif
     n->left = NULL;
     n->right = NULL;
-    n->parent = NULL;
+    setParent(n, NULL);
 
     return n;
 }
 
+/* Helper function: returns the number of times the value of node is in
+ * its tree. */
+size_t nodeMultiplicity(const struct RBNode *node) {
+#ifdef RB_MULTISET
+    return node->multiplicity;
+#else
+    (void)node;
+    return 1;
+#endif
+}
+
 struct RBTree *RBCreate(void) {
     struct RBTree *tree = malloc(sizeof(struct RBTree));
     if (!tree) {
         return NULL;
     }
 
+    tree->pool = poolCreate();
+    if (!tree->pool) {
+        free(tree);
+        return NULL;
+    }
     tree->root = NULL;
+    tree->count = 0;
+    tree->lock = NULL;
+    tree->shared = NULL;
+    tree->sharing = 0;
+    tree->sharedNodes = 0;
+    tree->btree = NULL;
+    tree->touched = NULL;
+    tree->multiset = 0;
+#ifdef RB_STATS
+    memset(&tree->stats, 0, sizeof(struct TreeStats));
+#endif
 
     return tree;
 }
 
-/* Helper function: returns the root of the input (sub)tree
- * after unbalanced tree insertion. */
-struct RBNode *nodeInsert(struct RBNode *root, struct RBNode *newNode, int *duplicateFlag) {
-    if (!root) {
-        return newNode;
+struct RBTree *RBCreateMultiset(void) {
+#ifdef RB_MULTISET
+    struct RBTree *tree = RBCreate();
+    if (tree) {
+        tree->multiset = 1;
     }
 
-    if (newNode->value < root->value) {
-        root->left = nodeInsert(root->left, newNode, duplicateFlag);
-        if (root->left) {
-            root->left->parent = root;
-        }
-    } else if (newNode->value > root->value) {
-        root->right = nodeInsert(root->right, newNode, duplicateFlag);
-        if (root->right) {
-            root->right->parent = root;
-        }
-    } else {
-        *duplicateFlag = 1;
+    return tree;
+#else
+    return NULL;
+#endif
+}
+
+struct RBTree *RBCreateBTree(void) {
+    struct RBTree *tree = RBCreate();
+    if (!tree) {
+        return NULL;
+    }
+
+    tree->btree = BTreeCreate();
+    if (!tree->btree) {
+        RBFree(tree);
+        return NULL;
+    }
+
+    return tree;
+}
+
+struct RBTree *RBCreateWithCapacity(size_t capacity) {
+    struct RBTree *tree = RBCreate();
+    if (!tree) {
+        return NULL;
+    }
+
+    if (capacity > 0 && poolGrow(tree->pool, capacity) == -1) {
+        RBFree(tree);
+        return NULL;
+    }
+
+    return tree;
+}
+
+int RBMakeConcurrent(struct RBTree *tree) {
+    if (!tree) {
+        return -1;
+    }
+    if (tree->lock) {
+        return 0;
+    }
+
+    struct RBLock *lock = malloc(sizeof(struct RBLock));
+    if (!lock) {
+        return -1;
+    }
+
+    if (pthread_rwlock_init(&lock->rwlock, NULL) != 0) {
+        free(lock);
+        return -1;
+    }
+    atomic_init(&lock->sequence, 0);
+    tree->lock = lock;
+
+    return 0;
+}
+
+struct RBTree *RBCreateConcurrent(void) {
+    struct RBTree *tree = RBCreate();
+    if (!tree) {
+        return NULL;
+    }
+
+    if (RBMakeConcurrent(tree) == -1) {
+        RBFree(tree);
+        return NULL;
+    }
+
+    return tree;
+}
+
+/* Helper function: takes the read lock of a concurrent tree. */
+void readLock(struct RBTree *tree) {
+    if (tree && tree->lock) {
+        pthread_rwlock_rdlock(&tree->lock->rwlock);
+    }
+}
+
+/* Helper function: releases the read lock of a concurrent tree. */
+void readUnlock(struct RBTree *tree) {
+    if (tree && tree->lock) {
+        pthread_rwlock_unlock(&tree->lock->rwlock);
+    }
+}
+
+/* Helper function: returns the leftmost node of the (sub)tree. */
+struct RBNode *nodeFirst(struct RBNode *node) {
+    if (!node) {
+        return NULL;
+    }
+
+    while (node->left) {
+        node = node->left;
+    }
+
+    return node;
+}
+
+/* Helper function: returns the in-order successor of the node, following
+ * parent pointers when the node has no right subtree. */
+struct RBNode *nodeNext(struct RBNode *node) {
+    if (node->right) {
+        return nodeFirst(node->right);
     }
 
-    return root;
+    while (getParent(node) && node == getParent(node)->right) {
+        node = getParent(node);
+    }
+
+    return getParent(node);
+}
+
+/* Helper function: takes the write lock of a concurrent tree and marks the
+ * tree as being modified for optimistic readers. */
+void writeLock(struct RBTree *tree) {
+    if (!tree) {
+        return;
+    }
+
+    if (tree->lock) {
+        pthread_rwlock_wrlock(&tree->lock->rwlock);
+        atomic_fetch_add_explicit(&tree->lock->sequence, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+    }
+    tree->touched = NULL;
+}
+
+/* Helper function: ends the modification of a concurrent tree and releases
+ * its write lock. */
+void writeUnlock(struct RBTree *tree) {
+    if (tree && tree->lock) {
+        atomic_fetch_add_explicit(&tree->lock->sequence, 1, memory_order_release);
+        pthread_rwlock_unlock(&tree->lock->rwlock);
+    }
+}
+
+void RBReadLock(struct RBTree *tree) {
+    readLock(tree);
+}
+
+void RBReadUnlock(struct RBTree *tree) {
+    readUnlock(tree);
 }
 
+#ifdef RB_ORDER_STATISTICS
+/* Helper function: returns the number of nodes in the subtree rooted
+ * at node. */
+size_t nodeSize(struct RBNode *node) {
+    return node ? node->size : 0;
+}
+
+/* Helper function: recomputes the subtree size of node from its children. */
+void updateSize(struct RBNode *node) {
+    node->size = (SubtreeSize)(nodeSize(node->left) + nodeSize(node->right) + 1);
+}
+#endif
+
 /* Helper function */
 void leftRotate(struct RBTree *tree, struct RBNode *node) {
     if (!tree || !node) {
@@ -79,20 +748,26 @@ void leftRotate(struct RBTree *tree, struct RBNode *node) {
     struct RBNode *right = node->right;
     node->right = right->left;
     if (right->left) {
-        right->left->parent = node;
+        setParent(right->left, node);
     }
 
-    right->parent = node->parent;
-    if (!node->parent) {
+    setParent(right, getParent(node));
+    if (!getParent(node)) {
         tree->root = right;
-    } else if (node == node->parent->left) {
-        node->parent->left = right;
+    } else if (node == getParent(node)->left) {
+        getParent(node)->left = right;
     } else {
-        node->parent->right = right;
+        getParent(node)->right = right;
     }
 
     right->left = node;
-    node->parent = right;
+    setParent(node, right);
+    STAT_ADD(tree, rotations, 1);
+
+#ifdef RB_ORDER_STATISTICS
+    updateSize(node);
+    updateSize(right);
+#endif
 }
 
 /* Helper function */
@@ -104,20 +779,26 @@ void rightRotate(struct RBTree *tree, struct RBNode *node) {
     struct RBNode *left = node->left;
     node->left = left->right;
     if (left->right) {
-        left->right->parent = node;
+        setParent(left->right, node);
     }
 
-    left->parent = node->parent;
-    if (!node->parent) {
+    setParent(left, getParent(node));
+    if (!getParent(node)) {
         tree->root = left;
-    } else if (node == node->parent->left) {
-        node->parent->left = left;
+    } else if (node == getParent(node)->left) {
+        getParent(node)->left = left;
     } else {
-        node->parent->right = left;
+        getParent(node)->right = left;
     }
 
     left->right = node;
-    node->parent = left;
+    setParent(node, left);
+    STAT_ADD(tree, rotations, 1);
+
+#ifdef RB_ORDER_STATISTICS
+    updateSize(node);
+    updateSize(left);
+#endif
 }
 
 /* Helper function: catches the simple cases where no fix or barely any fix
@@ -126,14 +807,15 @@ int catchSimpleCases(struct RBTree *tree, struct RBNode *node) {
     if (!tree || !node) {
         return 1;
     }
-    if (node->color == BLACK) {
+    if (getColor(node) == BLACK) {
         return 1;
     }
-    if (!node->parent) {
-        node->color = BLACK;
+    if (!getParent(node)) {
+        setColor(node, BLACK);
+        STAT_ADD(tree, recolorings, 1);
         return 1;
     }
-    if (node->parent->color == BLACK) {
+    if (getColor(getParent(node)) == BLACK) {
         return 1;
     }
 
@@ -143,434 +825,3824 @@ int catchSimpleCases(struct RBTree *tree, struct RBNode *node) {
 /* Helper function */
 void uncleRedCaseColorSwap(struct RBNode *parent, struct RBNode *uncle,
                            struct RBNode *grandparent) {
-    parent->color = BLACK;
-    uncle->color = BLACK;
-    grandparent->color = RED;
+    setColor(parent, BLACK);
+    setColor(uncle, BLACK);
+    setColor(grandparent, RED);
+}
+
+/* Helper function */
+void lineCaseColorSwap(struct RBNode *parent, struct RBNode *grandparent) {
+    Color temp = getColor(parent);
+    setColor(parent, getColor(grandparent));
+    setColor(grandparent, temp);
+}
+
+/* Helper function: restores red-black properties after insertion. Returns 1
+ * when a red root was recolored, which raises the black height of the tree
+ * by one, 0 otherwise. */
+int insertFixup(struct RBTree *tree, struct RBNode *node) {
+    while (!catchSimpleCases(tree, node)) {
+        struct RBNode *parent = getParent(node);
+        struct RBNode *grandparent = getParent(parent);
+        struct RBNode *uncle;
+        if (grandparent->left == parent) {
+            uncle = grandparent->right;
+        } else {
+            uncle = grandparent->left;
+        }
+
+        if (uncle && getColor(uncle) == RED) {
+            uncleRedCaseColorSwap(parent, uncle, grandparent);
+            STAT_ADD(tree, insertUncleRed, 1);
+            STAT_ADD(tree, recolorings, 3);
+            node = grandparent;
+            continue;
+        }
+
+        // triangle case
+        if (node == parent->left && parent == grandparent->right) {
+            rightRotate(tree, parent);
+            STAT_ADD(tree, insertTriangle, 1);
+            node = parent;
+            parent = getParent(node);
+        } else if (node == parent->right && parent == grandparent->left) {
+            leftRotate(tree, parent);
+            STAT_ADD(tree, insertTriangle, 1);
+            node = parent;
+            parent = getParent(node);
+        }
+
+        // line case (always follows triangle case), leaves a black parent
+        if (node == parent->left) {
+            rightRotate(tree, grandparent);
+        } else {
+            leftRotate(tree, grandparent);
+        }
+        lineCaseColorSwap(parent, grandparent);
+        STAT_ADD(tree, insertLine, 1);
+        STAT_ADD(tree, recolorings, 2);
+        return 0;
+    }
+
+    return node && !getParent(node);
+}
+
+/* Helper function: counts another occurrence of the value of node in a
+ * multiset, returns 0 on success or when the tree is not a multiset, -1
+ * when the count would overflow. */
+int countDuplicate(struct RBTree *tree, struct RBNode *node) {
+#ifdef RB_MULTISET
+    if (tree->multiset) {
+        if (node->multiplicity == UINT_MAX) {
+            return -1;
+        }
+        node->multiplicity++;
+        tree->touched = node;
+    }
+#else
+    (void)tree;
+    (void)node;
+#endif
+
+    return 0;
+}
+
+/* Helper function: descends once from start, or from the root when start is
+ * NULL, to the attach point of value and links in a new node there, which
+ * still needs an insertFixup. The subtree of start must be able to hold
+ * value. Nothing is allocated when value is already present, in which case
+ * duplicateFlag is set, a multiset counts the value again and the existing
+ * node is returned.
+ * Returns NULL on failure. */
+struct RBNode *nodeInsert(struct RBTree *tree, struct RBNode *start, int value,
+                          int *duplicateFlag) {
+    struct RBNode *parent = start ? getParent(start) : NULL;
+    struct RBNode **link = &tree->root;
+    if (parent) {
+        link = start == parent->left ? &parent->left : &parent->right;
+    }
+    while (*link) {
+        parent = *link;
+        if (value < parent->value) {
+            link = &parent->left;
+        } else if (value > parent->value) {
+            link = &parent->right;
+        } else {
+            *duplicateFlag = 1;
+            return countDuplicate(tree, parent) == 0 ? parent : NULL;
+        }
+    }
+
+#ifdef RB_COMPACT_NODES
+    if (tree->count == UINT_MAX) {
+        return NULL;
+    }
+#endif
+
+    struct RBNode *newNode = makeNode(tree, value);
+    if (!newNode) {
+        return NULL;
+    }
+
+    setParent(newNode, parent);
+    *link = newNode;
+    tree->count++;
+    tree->touched = newNode;
+
+#ifdef RB_ORDER_STATISTICS
+    for (; parent; parent = getParent(parent)) {
+        parent->size++;
+    }
+#endif
+
+    return newNode;
+}
+
+/* Helper function: RBInsertGetNode without taking the tree lock. */
+int treeInsertGetNode(struct RBTree *tree, int value, struct RBNode **node) {
+    *node = NULL;
+    if (!tree || tree->btree) {
+        return -1;
+    }
+
+    int duplicateFlag = 0;
+    struct RBNode *newNode = nodeInsert(tree, NULL, value, &duplicateFlag);
+    if (!newNode) {
+        return -1;
+    }
+
+    *node = newNode;
+    if (duplicateFlag) {
+        return 1;
+    }
+
+    insertFixup(tree, newNode);
+
+    return 0;
+}
+
+/* Helper function: RBInsert without taking the tree lock. */
+int treeInsert(struct RBTree *tree, int value) {
+    struct RBNode *node;
+    return treeInsertGetNode(tree, value, &node);
+}
+
+int RBInsert(struct RBTree *tree, int value) {
+    writeLock(tree);
+    int result = tree && tree->btree ? BTreeInsert(tree->btree, value)
+                                     : treeInsert(tree, value);
+    if (result == 0) {
+        shareChange(tree, value);
+    }
+#ifdef RB_STATS
+    if (result == 0) {
+        tree->stats.inserts++;
+    } else if (result == 1) {
+        tree->stats.duplicates++;
+    }
+#endif
+    DEBUG_CHECK(tree);
+    writeUnlock(tree);
+
+    return result;
+}
+
+/* Helper function: fills in the node at the midpoint of [lo, hi), the root
+ * of the balanced subtree over these nodes, and returns it. Its value is
+ * taken from keys unless keys is NULL, and its children are left to the
+ * caller. Nodes at redDepth are colored red and all others black, which is
+ * valid because a midpoint split fills every level except the deepest. */
+struct RBNode *buildRoot(struct RBNode *nodes, const int *keys, size_t lo, size_t hi,
+                         struct RBNode *parent, size_t depth, size_t redDepth) {
+    size_t mid = lo + (hi - lo) / 2;
+    struct RBNode *node = &nodes[mid];
+    if (keys) {
+        node->value = keys[mid];
+    }
+#ifdef RB_MULTISET
+    node->multiplicity = 1;
+#endif
+    setColor(node, depth == redDepth ? RED : BLACK);
+#ifdef RB_ORDER_STATISTICS
+    node->size = (SubtreeSize)(hi - lo);
+#endif
+    setParent(node, parent);
+
+    return node;
+}
+
+/* Helper function: links nodes[lo, hi) into a balanced subtree below parent
+ * and returns its root. The node at index i receives keys[i], so the nodes
+ * end up in key order in memory. Recursion depth is bounded by the height
+ * of the result. */
+struct RBNode *buildSubtree(struct RBNode *nodes, const int *keys, size_t lo, size_t hi,
+                            struct RBNode *parent, size_t depth, size_t redDepth) {
+    if (lo == hi) {
+        return NULL;
+    }
+
+    size_t mid = lo + (hi - lo) / 2;
+    struct RBNode *node = buildRoot(nodes, keys, lo, hi, parent, depth, redDepth);
+    node->left = buildSubtree(nodes, keys, lo, mid, node, depth + 1, redDepth);
+    node->right = buildSubtree(nodes, keys, mid + 1, hi, node, depth + 1, redDepth);
+
+    return node;
+}
+
+/* Part of a build from sorted keys, carried out by one thread. */
+struct BuildTask {
+    struct RBNode *nodes;
+    const int *keys;
+    size_t lo;
+    size_t hi;
+    struct RBNode *parent;
+    size_t depth;
+    size_t redDepth;
+    /* Number of threads the task may use, its own included. */
+    unsigned threads;
+    struct RBNode *result;
+};
+
+/* Helper function: thread entry point running a build task. */
+void *buildTaskThread(void *argument);
+
+/* Helper function: stores the subtree buildSubtree would return in
+ * task->result, building the left half in a new thread while the task has
+ * threads to spare. */
+void runBuildTask(struct BuildTask *task) {
+    size_t lo = task->lo;
+    size_t hi = task->hi;
+    if (task->threads <= 1 || (hi - lo) >> PARALLEL_MIN_HEIGHT == 0) {
+        task->result = buildSubtree(task->nodes, task->keys, lo, hi, task->parent,
+                                    task->depth, task->redDepth);
+        return;
+    }
+
+    size_t mid = lo + (hi - lo) / 2;
+    struct RBNode *node = buildRoot(task->nodes, task->keys, lo, hi, task->parent,
+                                    task->depth, task->redDepth);
+    struct BuildTask low = *task;
+    struct BuildTask high = *task;
+    low.hi = mid;
+    high.lo = mid + 1;
+    low.parent = node;
+    high.parent = node;
+    low.depth++;
+    high.depth++;
+    low.threads = task->threads / 2;
+    high.threads = task->threads - low.threads;
+
+    pthread_t thread;
+    int forked = pthread_create(&thread, NULL, buildTaskThread, &low) == 0;
+    if (!forked) {
+        low.threads = task->threads;
+        high.threads = task->threads;
+    }
+    runBuildTask(&high);
+    if (forked) {
+        pthread_join(thread, NULL);
+    } else {
+        runBuildTask(&low);
+    }
+
+    node->left = low.result;
+    node->right = high.result;
+    task->result = node;
+}
+
+void *buildTaskThread(void *argument) {
+    runBuildTask(argument);
+    return NULL;
+}
+
+/* Helper function: links the n nodes of the only chunk of the empty tree
+ * into a balanced tree holding keys with up to threads threads. When keys
+ * is NULL, the nodes already hold their values in increasing order. */
+void buildTree(struct RBTree *tree, const int *keys, size_t n, unsigned threads) {
+    if (n == 0) {
+        return;
+    }
+
+    // the deepest level is red unless it is the root level, which keeps the
+    // black depth equal on paths that end one level higher
+    size_t height = 0;
+    while ((n >> height) > 1) {
+        height++;
+    }
+    size_t redDepth = height > 0 ? height : 1;
+
+    struct BuildTask task = {
+        .nodes = tree->pool->chunks->nodes,
+        .keys = keys,
+        .hi = n,
+        .redDepth = redDepth,
+        .threads = threads > 0 ? threads : 1,
+    };
+    runBuildTask(&task);
+    tree->pool->chunks->used = n;
+    tree->root = task.result;
+    tree->count = n;
+}
+
+/* Helper function: RBBuildFromSorted with up to threads threads. */
+struct RBTree *treeBuildFromSorted(const int *keys, size_t n, unsigned threads) {
+    if (!keys && n > 0) {
+        return NULL;
+    }
+#ifdef RB_COMPACT_NODES
+    if (n > UINT_MAX) {
+        return NULL;
+    }
+#endif
+
+    for (size_t i = 1; i < n; i++) {
+        if (keys[i - 1] >= keys[i]) {
+            return NULL;
+        }
+    }
+
+    struct RBTree *tree = RBCreateWithCapacity(n);
+    if (tree) {
+        buildTree(tree, keys, n, threads);
+    }
+
+    return tree;
+}
+
+struct RBTree *RBBuildFromSorted(const int *keys, size_t n) {
+    return treeBuildFromSorted(keys, n, 1);
+}
+
+struct RBTree *RBBuildFromSortedParallel(const int *keys, size_t n, unsigned threads) {
+    return treeBuildFromSorted(keys, n, threads);
+}
+
+/* Helper function: comparison function for qsort on int values. */
+int compareInts(const void *a, const void *b) {
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Helper function: returns a sorted copy of the n keys, NULL on failure. */
+int *sortedCopy(const int *keys, size_t n) {
+    int *sorted = malloc(n * sizeof(int));
+    if (!sorted) {
+        return NULL;
+    }
+
+    memcpy(sorted, keys, n * sizeof(int));
+    qsort(sorted, n, sizeof(int), compareInts);
+
+    return sorted;
+}
+
+struct RBTree *RBBuildFromUnsorted(const int *keys, size_t n) {
+    if (!keys && n > 0) {
+        return NULL;
+    }
+    if (n == 0) {
+        return RBCreate();
+    }
+
+    int *sorted = sortedCopy(keys, n);
+    if (!sorted) {
+        return NULL;
+    }
+
+    size_t unique = 1;
+    for (size_t i = 1; i < n; i++) {
+        if (sorted[i] != sorted[unique - 1]) {
+            sorted[unique++] = sorted[i];
+        }
+    }
+
+    struct RBTree *tree = RBBuildFromSorted(sorted, unique);
+    free(sorted);
+
+    return tree;
+}
+
+/* Helper function: finds and returns the node with node->value == value. */
+struct RBNode *nodeSearch(struct RBNode *node, int value) {
+    while (node) {
+        STAT_VISIT();
+        if (node->value == value) {
+            return node;
+        }
+        node = value < node->value ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+/* Helper function: nodeSearch that requests both children of every node
+ * from memory while the node itself is compared, so the next level is
+ * already on its way whichever way the descent turns. */
+struct RBNode *nodeSearchPrefetch(struct RBNode *node, int value) {
+    while (node) {
+        PREFETCH(node->left);
+        PREFETCH(node->right);
+        STAT_VISIT();
+        if (node->value == value) {
+            return node;
+        }
+        node = value < node->value ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+/* Helper function: loads the value of a node that a writer may be storing
+ * to at the same time, through an atomic view of the field. */
+int loadValue(const struct RBNode *node) {
+    return atomic_load_explicit((const _Atomic int *)&node->value, memory_order_relaxed);
+}
+
+/* Helper function: loads a child or root link that a writer may be storing
+ * to at the same time, through an atomic view of the link. */
+struct RBNode *loadLink(struct RBNode *const *link) {
+    return atomic_load_explicit((_Atomic(struct RBNode *) const *)link, memory_order_relaxed);
+}
+
+/* Helper function: searches a concurrent tree without taking a lock.
+ * The descent may overlap a writer that rotates, unlinks or reuses the
+ * nodes it reads, so it reads the root, values and links with relaxed
+ * atomic loads and may follow a stale link anywhere. That stays within
+ * memory of the tree: released nodes go back onto the free list of the
+ * pool and may be reused at once, but the chunks holding them are only
+ * freed with the pool, after the tree itself. A stale link can form a
+ * cycle, which the depth bound ends, and the outcome only counts when the
+ * sequence shows that no writer was active meanwhile. Returns 1 or 0 like
+ * RBSearch, or -1 when every attempt overlapped a writer. */
+int optimisticSearch(struct RBTree *tree, int value) {
+    for (int attempt = 0; attempt < OPTIMISTIC_ATTEMPTS; attempt++) {
+        unsigned int before = atomic_load_explicit(&tree->lock->sequence,
+                                                   memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+
+        int found = 0;
+        struct RBNode *node = loadLink(&tree->root);
+        STAT_SEARCH_START();
+        for (int depth = 0; node && depth < MAX_DEPTH; depth++) {
+            STAT_VISIT();
+            int nodeValue = loadValue(node);
+            if (nodeValue == value) {
+                found = 1;
+                break;
+            }
+            node = loadLink(value < nodeValue ? &node->left : &node->right);
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&tree->lock->sequence, memory_order_relaxed) == before) {
+            return found;
+        }
+    }
+
+    return -1;
+}
+
+#ifdef RB_STATS
+/* Helper function: records a search in the stats of tree, with the number
+ * of nodes it visited since STAT_SEARCH_START. */
+void recordSearch(struct RBTree *tree, int found) {
+    struct TreeStats *stats = &tree->stats;
+    size_t depth = searchVisits;
+    atomic_fetch_add_explicit(&stats->searches, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->searchMisses, (size_t)!found, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->searchDepth, depth, memory_order_relaxed);
+
+    size_t max = atomic_load_explicit(&stats->maxSearchDepth, memory_order_relaxed);
+    while (depth > max
+           && !atomic_compare_exchange_weak_explicit(&stats->maxSearchDepth, &max, depth,
+                                                     memory_order_relaxed,
+                                                     memory_order_relaxed)) {
+    }
+}
+#endif
+
+int RBSearch(struct RBTree *tree, int value) {
+    if (!tree) {
+        return 0;
+    }
+
+    STAT_SEARCH_START();
+    if (tree->btree) {
+        readLock(tree);
+        int found = BTreeSearch(tree->btree, value);
+        readUnlock(tree);
+        STAT_SEARCH_END(tree, found);
+
+        return found;
+    }
+
+    if (tree->lock) {
+        int found = optimisticSearch(tree, value);
+        if (found == -1) {
+            STAT_SEARCH_START();
+            readLock(tree);
+            found = nodeSearch(tree->root, value) != NULL;
+            readUnlock(tree);
+        }
+        STAT_SEARCH_END(tree, found);
+
+        return found;
+    }
+
+#ifdef RB_PREFETCH_SEARCH
+    int found = nodeSearchPrefetch(tree->root, value) != NULL;
+#else
+    int found = nodeSearch(tree->root, value) != NULL;
+#endif
+    STAT_SEARCH_END(tree, found);
+
+    return found;
+}
+
+/* Helper function: RBSearchPrefetch without taking the tree lock. */
+int treeSearchPrefetch(struct RBTree *tree, int value) {
+    if (!tree) {
+        return 0;
+    }
+    if (tree->btree) {
+        return BTreeSearch(tree->btree, value);
+    }
+
+    if (nodeSearchPrefetch(tree->root, value)) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+int RBSearchPrefetch(struct RBTree *tree, int value) {
+    readLock(tree);
+    STAT_SEARCH_START();
+    int result = treeSearchPrefetch(tree, value);
+    if (tree) {
+        STAT_SEARCH_END(tree, result);
+    }
+    readUnlock(tree);
+
+    return result;
+}
+
+/* Helper function */
+void leafDelete(struct RBTree *tree, struct RBNode *node) {
+    if (!tree || !node) {
+        return;
+    }
+
+    tree->count--;
+    if (!getParent(node)) {
+        tree->root = NULL;
+        poolRelease(tree, node);
+        return;
+    }
+
+#ifdef RB_ORDER_STATISTICS
+    for (struct RBNode *ancestor = getParent(node); ancestor; ancestor = getParent(ancestor)) {
+        ancestor->size--;
+    }
+#endif
+
+    if (node == getParent(node)->left) {
+        getParent(node)->left = NULL;
+    } else {
+        getParent(node)->right = NULL;
+    }
+
+    poolRelease(tree, node);
+}
+
+/* Helper function: exchanges the places of node, which has two children,
+ * and its successor in the tree, together with their colors and subtree
+ * sizes. Values stay with their nodes, so the tree is ordered again once
+ * node, which now has no left child, is removed. */
+void swapWithSuccessor(struct RBTree *tree, struct RBNode *node) {
+    struct RBNode *successor = nodeFirst(node->right);
+    struct RBNode *parent = getParent(node);
+    struct RBNode *successorParent = getParent(successor);
+    struct RBNode *successorRight = successor->right;
+    Color color = getColor(node);
+    Color successorColor = getColor(successor);
+
+    if (!parent) {
+        tree->root = successor;
+    } else if (node == parent->left) {
+        parent->left = successor;
+    } else {
+        parent->right = successor;
+    }
+    setParent(successor, parent);
+    successor->left = node->left;
+    setParent(successor->left, successor);
+
+    if (successor == node->right) {
+        successor->right = node;
+        setParent(node, successor);
+    } else {
+        successor->right = node->right;
+        setParent(successor->right, successor);
+        successorParent->left = node;
+        setParent(node, successorParent);
+    }
+
+    node->left = NULL;
+    node->right = successorRight;
+    if (successorRight) {
+        setParent(successorRight, node);
+    }
+
+    setColor(node, successorColor);
+    setColor(successor, color);
+#ifdef RB_ORDER_STATISTICS
+    SubtreeSize size = node->size;
+    node->size = successor->size;
+    successor->size = size;
+#endif
+}
+
+/* Helper function: returns the sibling of the input node. */
+struct RBNode *findSibling(struct RBNode *node) {
+    if (!node || !getParent(node)) {
+        return NULL;
+    }
+
+    if (node == getParent(node)->left) {
+        return getParent(node)->right;
+    } else {
+        return getParent(node)->left;
+    }
+}
+
+/* Helper function: returns the case code of the relevant case in deleteFixup.
+ * Format of the case code is
+ * R for red sibling,
+ * RB for near child being red and far child being black,
+ * BR for far child being red,
+ * BB for two black children. */
+typedef enum {R, BB, RB, BR} CaseCode;
+CaseCode findCaseCode(struct RBNode *sibling) {
+    int isSiblingLeftChild;
+    if (sibling == getParent(sibling)->left) {
+        isSiblingLeftChild = 1;
+    } else {
+        isSiblingLeftChild = 0;
+    }
+
+    if (getColor(sibling) == RED) {
+        return R;
+    }
+
+    struct RBNode *nearChild = isSiblingLeftChild ? sibling->right : sibling->left;
+    struct RBNode *farChild = isSiblingLeftChild ? sibling->left : sibling->right;
+    if (nearChild && getColor(nearChild) == RED) {
+        return RB;
+    }
+    if (farChild && getColor(farChild) == RED) {
+        return BR;
+    }
+
+    return BB;
+}
+
+/* Helper function */
+void siblingRedCase(struct RBTree *tree, struct RBNode *node, struct RBNode *sibling) {
+    setColor(sibling, BLACK);
+    setColor(getParent(node), RED);
+    if (node == getParent(node)->left) {
+        leftRotate(tree, getParent(node));
+    } else {
+        rightRotate(tree, getParent(node));
+    }
+}
+
+/* Helper function */
+Color siblingBlackBlackChildrenCase(struct RBNode *node, struct RBNode *sibling) {
+    Color originalColor = getColor(getParent(node));
+    setColor(getParent(node), BLACK);
+    setColor(sibling, RED);
+    return originalColor;
+}
+
+/* Helper function */
+void siblingBlackNearChildRedCase(struct RBTree *tree, struct RBNode *node,
+                                  struct RBNode *sibling) {
+    if (node == getParent(node)->left) {
+        setColor(sibling->left, BLACK);
+        setColor(sibling, RED);
+        rightRotate(tree, sibling);
+    } else {
+        setColor(sibling->right, BLACK);
+        setColor(sibling, RED);
+        leftRotate(tree, sibling);
+    }
+}
+
+/* Helper function */
+void siblingBlackFarChildRedCase(struct RBTree *tree, struct RBNode *node,
+                                 struct RBNode *sibling) {
+    setColor(sibling, getColor(getParent(node)));
+    setColor(getParent(node), BLACK);
+    if (node == getParent(node)->left) {
+        setColor(sibling->right, BLACK);
+        leftRotate(tree, getParent(node));
+    } else {
+        setColor(sibling->left, BLACK);
+        rightRotate(tree, getParent(node));
+    }
+}
+
+/* Helper function: restores red-black properties after deletion. */
+void deleteFixup(struct RBTree *tree, struct RBNode *node) {
+    if (!tree || !node) {
+        return;
+    }
+
+    while (getColor(node) == BLACK) {
+        struct RBNode *sibling = findSibling(node);
+        if (!sibling) {
+            return;
+        }
+
+        CaseCode caseCode = findCaseCode(sibling);
+        switch (caseCode) {
+            case R:
+                siblingRedCase(tree, node, sibling);
+                STAT_ADD(tree, deleteSiblingRed, 1);
+                STAT_ADD(tree, recolorings, 2);
+                break;
+            case BB:
+                STAT_ADD(tree, deleteBlackChildren, 1);
+                STAT_ADD(tree, recolorings, 2);
+                if (siblingBlackBlackChildrenCase(node, sibling) == RED) {
+                    return;
+                }
+                node = getParent(node);
+                break;
+            case RB:
+                siblingBlackNearChildRedCase(tree, node, sibling);
+                STAT_ADD(tree, deleteNearChildRed, 1);
+                STAT_ADD(tree, recolorings, 2);
+                break;
+            case BR:
+                siblingBlackFarChildRedCase(tree, node, sibling);
+                STAT_ADD(tree, deleteFarChildRed, 1);
+                STAT_ADD(tree, recolorings, 3);
+                return;
+        }
+    }
+}
+
+/* Helper function: unlinks node from the tree by relinking its neighbours,
+ * so that every other node keeps its value. Returns the parent of the
+ * place node was unlinked from, or NULL when that was the root. */
+struct RBNode *nodeDelete(struct RBTree *tree, struct RBNode *node) {
+    if (node->left && node->right) {
+        swapWithSuccessor(tree, node);
+    }
+
+    // a node with a single child is black and the child a red leaf, which
+    // takes its place and color
+    struct RBNode *child = node->left ? node->left : node->right;
+    struct RBNode *parent = getParent(node);
+    if (child) {
+        if (!parent) {
+            tree->root = child;
+        } else if (node == parent->left) {
+            parent->left = child;
+        } else {
+            parent->right = child;
+        }
+        setParent(child, parent);
+        setColor(child, BLACK);
+#ifdef RB_ORDER_STATISTICS
+        for (struct RBNode *ancestor = parent; ancestor; ancestor = getParent(ancestor)) {
+            ancestor->size--;
+        }
+#endif
+        tree->count--;
+        poolRelease(tree, node);
+    } else {
+        deleteFixup(tree, node);
+        parent = getParent(node);
+        leafDelete(tree, node);
+    }
+    tree->touched = parent;
+
+    return parent;
+}
+
+/* Helper function: removes one occurrence of the value of node, which
+ * only unlinks node from a multiset once its count drops to zero. Returns
+ * a node to resume from as nodeDelete does. */
+struct RBNode *nodeRemoveOne(struct RBTree *tree, struct RBNode *node) {
+#ifdef RB_MULTISET
+    if (node->multiplicity > 1) {
+        node->multiplicity--;
+        tree->touched = node;
+        return node;
+    }
+#endif
+
+    return nodeDelete(tree, node);
+}
+
+/* Helper function: RBDelete without taking the tree lock. */
+int treeDelete(struct RBTree *tree, int value) {
+    if (!tree) {
+        return -1;
+    }
+
+    struct RBNode *toRemoveNode = nodeSearch(tree->root, value);
+    if (!toRemoveNode) {
+        return 1;
+    }
+
+    nodeRemoveOne(tree, toRemoveNode);
+
+    return 0;
+}
+
+int RBDelete(struct RBTree *tree, int value) {
+    writeLock(tree);
+    int result = tree && tree->btree ? BTreeDelete(tree->btree, value)
+                                     : treeDelete(tree, value);
+    if (result == 0) {
+        shareChange(tree, value);
+    }
+#ifdef RB_STATS
+    if (result == 0) {
+        tree->stats.deletes++;
+    } else if (result == 1) {
+        tree->stats.deleteMisses++;
+    }
+#endif
+    DEBUG_CHECK(tree);
+    writeUnlock(tree);
+
+    return result;
+}
+
+int RBInsertGetNode(struct RBTree *tree, int value, struct RBNode **node) {
+    if (!node) {
+        return -1;
+    }
+    writeLock(tree);
+    int result = treeInsertGetNode(tree, value, node);
+    if (result == 0) {
+        shareChange(tree, value);
+    }
+#ifdef RB_STATS
+    if (result == 0) {
+        tree->stats.inserts++;
+    } else if (result == 1) {
+        tree->stats.duplicates++;
+    }
+#endif
+    DEBUG_CHECK(tree);
+    writeUnlock(tree);
+
+    return result;
+}
+
+struct RBNode *RBFind(struct RBTree *tree, int value) {
+    if (!tree || tree->btree) {
+        return NULL;
+    }
+
+    readLock(tree);
+    STAT_SEARCH_START();
+    struct RBNode *node = nodeSearch(tree->root, value);
+    STAT_SEARCH_END(tree, node != NULL);
+    readUnlock(tree);
+
+    return node;
+}
+
+int RBNodeValue(const struct RBNode *node) {
+    return node->value;
+}
+
+size_t RBCount(struct RBTree *tree, int value) {
+    if (!tree) {
+        return 0;
+    }
+    if (tree->btree) {
+        return (size_t)BTreeSearch(tree->btree, value);
+    }
+
+    readLock(tree);
+    STAT_SEARCH_START();
+    struct RBNode *node = nodeSearch(tree->root, value);
+    STAT_SEARCH_END(tree, node != NULL);
+    size_t count = node ? nodeMultiplicity(node) : 0;
+    readUnlock(tree);
+
+    return count;
+}
+
+#ifdef RB_DEBUG_CHECKS
+/* Helper function: returns the root of the tree that holds node. */
+struct RBNode *nodeRoot(struct RBNode *node) {
+    while (getParent(node)) {
+        node = getParent(node);
+    }
+
+    return node;
+}
+#endif
+
+int RBDeleteNode(struct RBTree *tree, struct RBNode *node) {
+    if (!node) {
+        return -1;
+    }
+    writeLock(tree);
+    if (!tree || tree->btree) {
+        writeUnlock(tree);
+        return -1;
+    }
+
+#ifdef RB_DEBUG_CHECKS
+    assert(nodeRoot(node) == tree->root);
+#endif
+    int value = node->value;
+    nodeRemoveOne(tree, node);
+    shareChange(tree, value);
+    STAT_ADD(tree, deletes, 1);
+    DEBUG_CHECK(tree);
+    writeUnlock(tree);
+
+    return 0;
+}
+
+/* Helper function: returns 1 if node is present and red, 0 otherwise. */
+int isRed(const struct RBNode *node) {
+    return node && getColor(node) == RED;
+}
+
+/* Helper function: RBInsertTopDown without taking the tree lock. The new
+ * node is allocated up front, so that nothing can fail once the descent
+ * has started changing the tree. */
+int treeInsertTopDown(struct RBTree *tree, int value) {
+    if (!tree) {
+        return -1;
+    }
+#ifdef RB_COMPACT_NODES
+    if (tree->count == UINT_MAX) {
+        return -1;
+    }
+#endif
+
+    struct RBNode *newNode = makeNode(tree, value);
+    if (!newNode) {
+        return -1;
+    }
+
+    struct RBNode *node = tree->root;
+    if (!node) {
+        setColor(newNode, BLACK);
+        tree->root = newNode;
+        tree->count++;
+        tree->touched = newNode;
+        return 0;
+    }
+
+    // every node on the path counts the new node in its size as soon as the
+    // descent reaches it
+#ifdef RB_ORDER_STATISTICS
+    node->size++;
+#endif
+    struct RBNode **link;
+    while (1) {
+        // split 4-nodes on the way down, which leaves the uncle of a red
+        // node with a red parent black, so insertFixup only rotates
+        if (isRed(node->left) && isRed(node->right)) {
+            struct RBNode *parent = getParent(node);
+            int triangle = isRed(parent)
+                           && (node == parent->left) != (parent == getParent(parent)->left);
+            setColor(node, RED);
+            setColor(node->left, BLACK);
+            setColor(node->right, BLACK);
+            STAT_ADD(tree, recolorings, 3);
+            insertFixup(tree, node);
+#ifdef RB_ORDER_STATISTICS
+            // the double rotation put node above two nodes that were
+            // resized from children the descent has yet to reach
+            if (triangle) {
+                node->size++;
+            }
+#else
+            (void)triangle;
+#endif
+        }
+
+        if (value == node->value) {
+            int result = countDuplicate(tree, node) == 0 ? 1 : -1;
+#ifdef RB_ORDER_STATISTICS
+            for (; node; node = getParent(node)) {
+                node->size--;
+            }
+#endif
+            poolRelease(tree, newNode);
+            return result;
+        }
+
+        link = value < node->value ? &node->left : &node->right;
+        if (!*link) {
+            break;
+        }
+        node = *link;
+#ifdef RB_ORDER_STATISTICS
+        node->size++;
+#endif
+    }
+
+    setParent(newNode, node);
+    *link = newNode;
+    tree->count++;
+    tree->touched = newNode;
+    insertFixup(tree, newNode);
+
+    return 0;
+}
+
+int RBInsertTopDown(struct RBTree *tree, int value) {
+    writeLock(tree);
+    int result = tree && tree->btree ? BTreeInsert(tree->btree, value)
+                                     : treeInsertTopDown(tree, value);
+    if (result == 0) {
+        shareChange(tree, value);
+    }
+#ifdef RB_STATS
+    if (result == 0) {
+        tree->stats.inserts++;
+    } else if (result == 1) {
+        tree->stats.duplicates++;
+    }
+#endif
+    DEBUG_CHECK(tree);
+    writeUnlock(tree);
+
+    return result;
+}
+
+/* Helper function: puts node, which has been unlinked, in the place of old
+ * in the tree, with the children, color and size of old. */
+void replaceNode(struct RBTree *tree, struct RBNode *old, struct RBNode *node) {
+    struct RBNode *parent = getParent(old);
+    if (!parent) {
+        tree->root = node;
+    } else if (old == parent->left) {
+        parent->left = node;
+    } else {
+        parent->right = node;
+    }
+
+    node->left = old->left;
+    node->right = old->right;
+    setParent(node, parent);
+    setColor(node, getColor(old));
+#ifdef RB_ORDER_STATISTICS
+    node->size = old->size;
+#endif
+    if (node->left) {
+        setParent(node->left, node);
+    }
+    if (node->right) {
+        setParent(node->right, node);
+    }
+}
+
+/* Helper function: RBDeleteTopDown without taking the tree lock. The
+ * descent keeps the current node or its child on the path red by rotating
+ * or recoloring around it, so the node that is finally unlinked, the one
+ * holding value or its predecessor, is a red leaf or the root. */
+int treeDeleteTopDown(struct RBTree *tree, int value) {
+    if (!tree) {
+        return -1;
+    }
+    if (!tree->root) {
+        return 1;
+    }
+
+    struct RBNode *found = NULL;
+    struct RBNode *counted = NULL;
+    struct RBNode *node = NULL;
+    struct RBNode *next = tree->root;
+    while (next) {
+        node = next;
+        int right = node->value < value;
+        if (node->value == value) {
+#ifdef RB_MULTISET
+            // a value counted more than once only loses an occurrence and
+            // keeps its node, so the descent ends there as on a miss
+            if (node->multiplicity > 1) {
+                node->multiplicity--;
+                counted = node;
+                break;
+            }
+#endif
+            found = node;
+        }
+
+        struct RBNode *child = right ? node->right : node->left;
+        struct RBNode *other = right ? node->left : node->right;
+        struct RBNode *parent = getParent(node);
+        struct RBNode *sibling = findSibling(node);
+        if (getColor(node) == BLACK && !isRed(child)) {
+            if (isRed(other)) {
+                // the red child on the other side becomes the parent
+                if (right) {
+                    rightRotate(tree, node);
+                } else {
+                    leftRotate(tree, node);
+                }
+                setColor(node, RED);
+                setColor(other, BLACK);
+                STAT_ADD(tree, recolorings, 2);
+#ifdef RB_ORDER_STATISTICS
+                other->size--;
+#endif
+            } else if (sibling) {
+                int last = node == parent->right;
+                struct RBNode *near = last ? sibling->right : sibling->left;
+                struct RBNode *far = last ? sibling->left : sibling->right;
+                if (!isRed(near) && !isRed(far)) {
+                    setColor(parent, BLACK);
+                    setColor(sibling, RED);
+                    setColor(node, RED);
+                    STAT_ADD(tree, recolorings, 3);
+                } else {
+                    // borrow from the sibling, which rotates a red nephew
+                    // or the sibling itself above the parent
+                    struct RBNode *top = sibling;
+                    if (isRed(near)) {
+                        if (last) {
+                            leftRotate(tree, sibling);
+                        } else {
+                            rightRotate(tree, sibling);
+                        }
+                        top = near;
+                    }
+                    if (last) {
+                        rightRotate(tree, parent);
+                    } else {
+                        leftRotate(tree, parent);
+                    }
+                    setColor(node, RED);
+                    setColor(top, RED);
+                    setColor(top->left, BLACK);
+                    setColor(top->right, BLACK);
+                    STAT_ADD(tree, recolorings, 4);
+#ifdef RB_ORDER_STATISTICS
+                    parent->size--;
+                    top->size--;
+#endif
+                }
+            }
+        }
+
+        // every node on the path stops counting the deleted value once the
+        // descent leaves it, rotations having resized the nodes around it
+#ifdef RB_ORDER_STATISTICS
+        node->size--;
+#endif
+        next = right ? node->right : node->left;
+    }
+
+    if (!found) {
+#ifdef RB_ORDER_STATISTICS
+        // a counted node was left before its own size was decremented
+        for (node = counted ? getParent(node) : node; node; node = getParent(node)) {
+            node->size++;
+        }
+#endif
+        if (getColor(tree->root) == RED) {
+            setColor(tree->root, BLACK);
+        }
+        if (counted) {
+            tree->touched = counted;
+            return 0;
+        }
+        return 1;
+    }
+
+    // unlink node, which has at most one child, and let it take the place
+    // of the node holding value
+    struct RBNode *parent = getParent(node);
+    struct RBNode *child = node->left ? node->left : node->right;
+    if (!parent) {
+        tree->root = child;
+    } else if (node == parent->left) {
+        parent->left = child;
+    } else {
+        parent->right = child;
+    }
+    if (child) {
+        setParent(child, parent);
+    }
+
+    if (found != node) {
+        replaceNode(tree, found, node);
+        if (parent == found) {
+            parent = node;
+        }
+    }
+    if (tree->root && getColor(tree->root) == RED) {
+        setColor(tree->root, BLACK);
+    }
+
+    tree->count--;
+    tree->touched = parent;
+    poolRelease(tree, found);
+
+    return 0;
+}
+
+int RBDeleteTopDown(struct RBTree *tree, int value) {
+    writeLock(tree);
+    int result = tree && tree->btree ? BTreeDelete(tree->btree, value)
+                                     : treeDeleteTopDown(tree, value);
+    if (result == 0) {
+        shareChange(tree, value);
+    }
+#ifdef RB_STATS
+    if (result == 0) {
+        tree->stats.deletes++;
+    } else if (result == 1) {
+        tree->stats.deleteMisses++;
+    }
+#endif
+    DEBUG_CHECK(tree);
+    writeUnlock(tree);
+
+    return result;
+}
+
+/* Helper function: climbs from node to the lowest ancestor whose subtree
+ * spans value, i.e. lies between the nearest ancestors it hangs left and
+ * right of. Consecutive keys of a sorted batch restart their descent there
+ * instead of at the root. */
+struct RBNode *fingerStart(struct RBNode *node, int value) {
+    struct RBNode *start = node;
+    int hasLow = 0;
+    int hasHigh = 0;
+    while (getParent(node) && !(hasLow && hasHigh)) {
+        struct RBNode *parent = getParent(node);
+        if (node == parent->left && !hasHigh) {
+            if (value < parent->value) {
+                hasHigh = 1;
+            } else {
+                start = parent;
+                hasLow = 0;
+            }
+        } else if (node == parent->right && !hasLow) {
+            if (value > parent->value) {
+                hasLow = 1;
+            } else {
+                start = parent;
+                hasHigh = 0;
+            }
+        }
+        node = parent;
+    }
+
+    return start;
+}
+
+/* Helper function: RBInsertBatch without taking the tree lock. */
+int treeInsertBatch(struct RBTree *tree, const int *keys, size_t n, size_t *inserted) {
+    if (!tree || tree->btree || (!keys && n > 0)) {
+        return -1;
+    }
+
+    int *sorted = sortedCopy(keys, n);
+    if (!sorted && n > 0) {
+        return -1;
+    }
+
+    size_t count = 0;
+    struct RBNode *finger = NULL;
+    for (size_t i = 0; i < n; i++) {
+        int duplicateFlag = 0;
+        struct RBNode *start = finger ? fingerStart(finger, sorted[i]) : NULL;
+        struct RBNode *node = nodeInsert(tree, start, sorted[i], &duplicateFlag);
+        if (!node) {
+            free(sorted);
+            if (inserted) {
+                *inserted = count;
+            }
+            return -1;
+        }
+
+        if (!duplicateFlag) {
+            insertFixup(tree, node);
+            shareChange(tree, sorted[i]);
+            count++;
+        }
+        finger = node;
+    }
+
+    free(sorted);
+    STAT_ADD(tree, inserts, count);
+    STAT_ADD(tree, duplicates, n - count);
+    if (inserted) {
+        *inserted = count;
+    }
+
+    return 0;
+}
+
+int RBInsertBatch(struct RBTree *tree, const int *keys, size_t n, size_t *inserted) {
+    writeLock(tree);
+    int result = treeInsertBatch(tree, keys, n, inserted);
+    DEBUG_CHECK(tree);
+    writeUnlock(tree);
+
+    return result;
+}
+
+/* Number of lookups that RBSearchBatch advances in lock-step. */
+#define BATCH_LANES 8
+
+/* Key of a search batch together with its position in the caller's array. */
+struct BatchKey {
+    int value;
+    size_t index;
+};
+
+/* Helper function: sorts the n batch keys by value with a least significant
+ * digit radix sort over the bytes of the value, which is linear in n unlike
+ * qsort. Scratch must have room for n keys. */
+void radixSortBatch(struct BatchKey *keys, struct BatchKey *scratch, size_t n) {
+    for (unsigned int shift = 0; shift < 32; shift += 8) {
+        size_t offsets[256] = {0};
+        for (size_t i = 0; i < n; i++) {
+            // flipping the sign bit orders negative values first
+            unsigned int digit = (((unsigned int)keys[i].value ^ 0x80000000u) >> shift) & 0xFFu;
+            offsets[digit]++;
+        }
+
+        size_t total = 0;
+        for (size_t digit = 0; digit < 256; digit++) {
+            size_t count = offsets[digit];
+            offsets[digit] = total;
+            total += count;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            unsigned int digit = (((unsigned int)keys[i].value ^ 0x80000000u) >> shift) & 0xFFu;
+            scratch[offsets[digit]++] = keys[i];
+        }
+
+        struct BatchKey *temp = keys;
+        keys = scratch;
+        scratch = temp;
+    }
+}
+
+/* One of the interleaved lookups of RBSearchBatch, working through the
+ * sorted keys in [key, end). */
+struct BatchLane {
+    const struct BatchKey *key;
+    const struct BatchKey *end;
+    struct RBNode *node;
+    struct RBNode *finger;
+};
+
+/* Helper function: RBSearchBatch without taking the tree lock. */
+int treeSearchBatch(struct RBTree *tree, const int *keys, size_t n, unsigned char *found) {
+    if (!tree || ((!keys || !found) && n > 0)) {
+        return -1;
+    }
+
+    if (tree->btree) {
+        for (size_t i = 0; i < n; i++) {
+            found[i] = (unsigned char)BTreeSearch(tree->btree, keys[i]);
+        }
+        return 0;
+    }
+
+    if (!tree->root) {
+        memset(found, 0, n);
+        return 0;
+    }
+
+    struct BatchKey *sorted = malloc(2 * n * sizeof(struct BatchKey));
+    if (!sorted && n > 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        sorted[i].value = keys[i];
+        sorted[i].index = i;
+    }
+    radixSortBatch(sorted, sorted + n, n);
+
+    // every lane takes a contiguous slice of the sorted keys, so each lane
+    // shares path prefixes between its own consecutive keys while the lanes
+    // overlap their cache misses with each other
+    struct BatchLane lanes[BATCH_LANES];
+    size_t active = 0;
+    for (size_t i = 0; i < BATCH_LANES; i++) {
+        struct BatchLane *lane = &lanes[active];
+        lane->key = sorted + n * i / BATCH_LANES;
+        lane->end = sorted + n * (i + 1) / BATCH_LANES;
+        lane->node = tree->root;
+        lane->finger = tree->root;
+        if (lane->key < lane->end) {
+            active++;
+        }
+    }
+
+    while (active > 0) {
+        for (size_t i = 0; i < active; i++) {
+            struct BatchLane *lane = &lanes[i];
+            struct RBNode *node = lane->node;
+            int value = lane->key->value;
+            if (node && node->value != value) {
+                lane->finger = node;
+                lane->node = value < node->value ? node->left : node->right;
+                PREFETCH(lane->node);
+                continue;
+            }
+
+            found[lane->key->index] = node != NULL;
+            if (node) {
+                lane->finger = node;
+            }
+
+            lane->key++;
+            if (lane->key == lane->end) {
+                lanes[i--] = lanes[--active];
+                continue;
+            }
+            lane->node = fingerStart(lane->finger, lane->key->value);
+            PREFETCH(lane->node);
+        }
+    }
+
+    free(sorted);
+
+    return 0;
+}
+
+int RBSearchBatch(struct RBTree *tree, const int *keys, size_t n, unsigned char *found) {
+    readLock(tree);
+    int result = treeSearchBatch(tree, keys, n, found);
+    readUnlock(tree);
+
+    return result;
+}
+
+/* Helper function: RBSearchMulti without taking the tree lock. */
+int treeSearchMulti(struct RBTree *tree, const int *keys, size_t n, unsigned char *found) {
+    if (!tree || ((!keys || !found) && n > 0)) {
+        return -1;
+    }
+
+    if (tree->btree) {
+        for (size_t i = 0; i < n; i++) {
+            found[i] = (unsigned char)BTreeSearch(tree->btree, keys[i]);
+        }
+        return 0;
+    }
+
+    if (!tree->root) {
+        memset(found, 0, n);
+        return 0;
+    }
+
+    // each lane holds one independent descent, a lane that finishes takes
+    // the next key so that all lanes stay busy until the keys run out
+    struct RBNode *nodes[BATCH_LANES];
+    size_t indices[BATCH_LANES];
+    size_t next = 0;
+    size_t active = 0;
+    while (active < BATCH_LANES && next < n) {
+        nodes[active] = tree->root;
+        indices[active++] = next++;
+    }
+
+    while (active > 0) {
+        for (size_t i = 0; i < active; i++) {
+            struct RBNode *node = nodes[i];
+            int value = keys[indices[i]];
+            if (node && node->value != value) {
+                nodes[i] = value < node->value ? node->left : node->right;
+                PREFETCH(nodes[i]);
+                continue;
+            }
+
+            found[indices[i]] = node != NULL;
+            if (next < n) {
+                nodes[i] = tree->root;
+                indices[i] = next++;
+            } else {
+                active--;
+                nodes[i] = nodes[active];
+                indices[i] = indices[active];
+                i--;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int RBSearchMulti(struct RBTree *tree, const int *keys, size_t n, unsigned char *found) {
+    readLock(tree);
+    int result = treeSearchMulti(tree, keys, n, found);
+    readUnlock(tree);
+
+    return result;
+}
+
+/* Helper function: RBDeleteBatch without taking the tree lock. */
+int treeDeleteBatch(struct RBTree *tree, const int *keys, size_t n, size_t *deleted) {
+    if (!tree || tree->btree || (!keys && n > 0)) {
+        return -1;
+    }
+
+    int *sorted = sortedCopy(keys, n);
+    if (!sorted && n > 0) {
+        return -1;
+    }
+
+    size_t count = 0;
+    struct RBNode *finger = NULL;
+    for (size_t i = 0; i < n && tree->root; i++) {
+        struct RBNode *start = finger ? fingerStart(finger, sorted[i]) : tree->root;
+        struct RBNode *node = nodeSearch(start, sorted[i]);
+        if (!node) {
+            continue;
+        }
+
+        finger = nodeRemoveOne(tree, node);
+        shareChange(tree, sorted[i]);
+        count++;
+    }
+
+    free(sorted);
+    STAT_ADD(tree, deletes, count);
+    STAT_ADD(tree, deleteMisses, n - count);
+    if (deleted) {
+        *deleted = count;
+    }
+
+    return 0;
+}
+
+int RBDeleteBatch(struct RBTree *tree, const int *keys, size_t n, size_t *deleted) {
+    writeLock(tree);
+    int result = treeDeleteBatch(tree, keys, n, deleted);
+    DEBUG_CHECK(tree);
+    writeUnlock(tree);
+
+    return result;
+}
+
+/* Helper function: returns the rightmost node of the (sub)tree. */
+struct RBNode *nodeLast(struct RBNode *node) {
+    if (!node) {
+        return NULL;
+    }
+
+    while (node->right) {
+        node = node->right;
+    }
+
+    return node;
+}
+
+/* Helper function: returns the in-order predecessor of the node, following
+ * parent pointers when the node has no left subtree. */
+struct RBNode *nodePrev(struct RBNode *node) {
+    if (node->left) {
+        return nodeLast(node->left);
+    }
+
+    while (getParent(node) && node == getParent(node)->left) {
+        node = getParent(node);
+    }
+
+    return getParent(node);
+}
+
+/* Helper function: returns the node with the smallest value that is
+ * greater than or equal to value, or strictly greater when strict is set.
+ * Returns NULL if there is no such node. */
+struct RBNode *nodeBound(struct RBNode *node, int value, int strict) {
+    struct RBNode *bound = NULL;
+    while (node) {
+        if (node->value > value || (!strict && node->value == value)) {
+            bound = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+
+    return bound;
+}
+
+/* Helper function: positions an iterator over a B-tree tree at its value
+ * when found is set, past the end otherwise, and returns found. */
+int btreeIterSet(struct RBIter *iter, int found) {
+    iter->node = NULL;
+    iter->atValue = found;
+
+    return found;
+}
+
+int RBIterFirst(struct RBTree *tree, struct RBIter *iter) {
+    if (!tree || !iter) {
+        return 0;
+    }
+
+    iter->tree = tree;
+    if (tree->btree) {
+        return btreeIterSet(iter, BTreeCeiling(tree->btree, INT_MIN, 0, &iter->value));
+    }
+    iter->node = nodeFirst(tree->root);
+
+    return iter->node != NULL;
+}
+
+int RBIterLast(struct RBTree *tree, struct RBIter *iter) {
+    if (!tree || !iter) {
+        return 0;
+    }
+
+    iter->tree = tree;
+    if (tree->btree) {
+        return btreeIterSet(iter, BTreeFloor(tree->btree, INT_MAX, 0, &iter->value));
+    }
+    iter->node = nodeLast(tree->root);
+
+    return iter->node != NULL;
+}
+
+int RBIterNext(struct RBIter *iter) {
+    if (iter && iter->tree && iter->tree->btree) {
+        return iter->atValue
+               && btreeIterSet(iter, BTreeCeiling(iter->tree->btree, iter->value, 1,
+                                                  &iter->value));
+    }
+    if (!iter || !iter->node) {
+        return 0;
+    }
+
+    iter->node = nodeNext(iter->node);
+
+    return iter->node != NULL;
+}
+
+int RBIterPrev(struct RBIter *iter) {
+    if (!iter || !iter->tree) {
+        return 0;
+    }
+
+    if (iter->tree->btree) {
+        int value = iter->atValue ? iter->value : INT_MAX;
+        return btreeIterSet(iter, BTreeFloor(iter->tree->btree, value, iter->atValue,
+                                             &iter->value));
+    }
+    if (!iter->node) {
+        iter->node = nodeLast(iter->tree->root);
+    } else {
+        iter->node = nodePrev(iter->node);
+    }
+
+    return iter->node != NULL;
+}
+
+int RBIterValue(const struct RBIter *iter) {
+    return iter->tree->btree ? iter->value : iter->node->value;
+}
+
+size_t RBIterCount(const struct RBIter *iter) {
+    return iter->tree->btree ? 1 : nodeMultiplicity(iter->node);
+}
+
+int RBLowerBound(struct RBTree *tree, int value, struct RBIter *iter) {
+    if (!tree || !iter) {
+        return 0;
+    }
+
+    iter->tree = tree;
+    if (tree->btree) {
+        return btreeIterSet(iter, BTreeCeiling(tree->btree, value, 0, &iter->value));
+    }
+    iter->node = nodeBound(tree->root, value, 0);
+
+    return iter->node != NULL;
+}
+
+int RBUpperBound(struct RBTree *tree, int value, struct RBIter *iter) {
+    if (!tree || !iter) {
+        return 0;
+    }
+
+    iter->tree = tree;
+    if (tree->btree) {
+        return btreeIterSet(iter, BTreeCeiling(tree->btree, value, 1, &iter->value));
+    }
+    iter->node = nodeBound(tree->root, value, 1);
+
+    return iter->node != NULL;
+}
+
+/* Helper function: RBRange without taking the tree lock. */
+int treeRange(struct RBTree *tree, int lo, int hi, RBVisitor visit, void *context) {
+    if (!tree || !visit) {
+        return -1;
+    }
+    if (tree->btree) {
+        return BTreeRange(tree->btree, lo, hi, visit, context);
+    }
+
+    // the descent to the lower bound skips every subtree left of lo, the walk
+    // stops at the first value outside the range
+    struct RBNode *node = nodeBound(tree->root, lo, 0);
+    for (; node && node->value < hi; node = nodeNext(node)) {
+        if (visit(node->value, context)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int RBRange(struct RBTree *tree, int lo, int hi, RBVisitor visit, void *context) {
+    readLock(tree);
+    int result = treeRange(tree, lo, hi, visit, context);
+    readUnlock(tree);
+
+    return result;
+}
+
+/* Callback of RBRangeCounts over a B-tree tree, with the visitor it wraps. */
+struct CountVisit {
+    RBCountVisitor visit;
+    void *context;
+};
+
+/* Helper function: passes a value of a B-tree tree, which holds each value
+ * once, on to the wrapped count visitor. */
+int visitOnce(int value, void *context) {
+    struct CountVisit *wrapped = context;
+
+    return wrapped->visit(value, 1, wrapped->context);
+}
+
+int RBRangeCounts(struct RBTree *tree, int lo, int hi, RBCountVisitor visit, void *context) {
+    if (!tree || !visit) {
+        return -1;
+    }
+
+    readLock(tree);
+    if (tree->btree) {
+        struct CountVisit wrapped = {visit, context};
+        int result = BTreeRange(tree->btree, lo, hi, visitOnce, &wrapped);
+        readUnlock(tree);
+        return result;
+    }
+    int result = 0;
+    struct RBNode *node = nodeBound(tree->root, lo, 0);
+    for (; node && node->value < hi; node = nodeNext(node)) {
+        if (visit(node->value, nodeMultiplicity(node), context)) {
+            result = 1;
+            break;
+        }
+    }
+    readUnlock(tree);
+
+    return result;
+}
+
+size_t RBRangeFill(struct RBIter *iter, int hi, int *buffer, size_t capacity) {
+    if (!iter || !buffer) {
+        return 0;
+    }
+
+    size_t count = 0;
+    if (iter->tree && iter->tree->btree) {
+        while (count < capacity && iter->atValue && iter->value < hi) {
+            buffer[count++] = iter->value;
+            btreeIterSet(iter, BTreeCeiling(iter->tree->btree, iter->value, 1, &iter->value));
+        }
+        return count;
+    }
+    struct RBNode *node = iter->node;
+    while (count < capacity && node && node->value < hi) {
+        buffer[count++] = node->value;
+        node = nodeNext(node);
+    }
+
+    iter->node = node;
+
+    return count;
+}
+
+/* Helper function: returns the number of values in the tree that are
+ * strictly smaller than value. */
+size_t nodeRank(struct RBNode *root, int value) {
+    size_t rank = 0;
+#ifdef RB_ORDER_STATISTICS
+    struct RBNode *node = root;
+    while (node) {
+        if (value <= node->value) {
+            node = node->left;
+        } else {
+            rank += nodeSize(node->left) + 1;
+            node = node->right;
+        }
+    }
+#else
+    for (struct RBNode *node = nodeFirst(root); node && node->value < value;
+         node = nodeNext(node)) {
+        rank++;
+    }
+#endif
+
+    return rank;
+}
+
+/* Helper function: returns the node holding the k-th smallest value,
+ * counting from 0, or NULL if the tree holds no more than k values. */
+struct RBNode *nodeSelect(struct RBNode *root, size_t k) {
+    struct RBNode *node = root;
+#ifdef RB_ORDER_STATISTICS
+    while (node) {
+        size_t leftSize = nodeSize(node->left);
+        if (k < leftSize) {
+            node = node->left;
+        } else if (k == leftSize) {
+            return node;
+        } else {
+            k -= leftSize + 1;
+            node = node->right;
+        }
+    }
+#else
+    for (node = nodeFirst(root); node && k > 0; node = nodeNext(node)) {
+        k--;
+    }
+#endif
+
+    return node;
+}
+
+/* Helper function: counts visited values in context. */
+int countKey(int value, void *context) {
+    (void)value;
+    (*(size_t *)context)++;
+
+    return 0;
+}
+
+/* Helper function: RBRangeCount without taking the tree lock. */
+size_t treeRangeCount(struct RBTree *tree, int lo, int hi) {
+    if (!tree || lo >= hi) {
+        return 0;
+    }
+
+    // the B-tree keeps no subtree sizes, walking the range beats two ranks,
+    // which each walk every value below their bound
+    if (tree->btree) {
+        size_t count = 0;
+        BTreeRange(tree->btree, lo, hi, countKey, &count);
+        return count;
+    }
+
+    return nodeRank(tree->root, hi) - nodeRank(tree->root, lo);
+}
+
+size_t RBRangeCount(struct RBTree *tree, int lo, int hi) {
+    readLock(tree);
+    size_t result = treeRangeCount(tree, lo, hi);
+    readUnlock(tree);
+
+    return result;
+}
+
+size_t RBSize(struct RBTree *tree) {
+    if (!tree) {
+        return 0;
+    }
+
+    return tree->btree ? BTreeSize(tree->btree) : tree->count;
+}
+
+/* Helper function: RBRank without taking the tree lock. */
+size_t treeRank(struct RBTree *tree, int value) {
+    if (!tree) {
+        return 0;
+    }
+
+    return tree->btree ? BTreeRank(tree->btree, value) : nodeRank(tree->root, value);
+}
+
+size_t RBRank(struct RBTree *tree, int value) {
+    readLock(tree);
+    size_t result = treeRank(tree, value);
+    readUnlock(tree);
+
+    return result;
+}
+
+/* Helper function: RBSelect without taking the tree lock. */
+int treeSelect(struct RBTree *tree, size_t k, int *value) {
+    if (!tree || !value) {
+        return -1;
+    }
+    if (tree->btree) {
+        return BTreeSelect(tree->btree, k, value);
+    }
+
+    struct RBNode *node = nodeSelect(tree->root, k);
+    if (!node) {
+        return -1;
+    }
+
+    *value = node->value;
+
+    return 0;
+}
+
+int RBSelect(struct RBTree *tree, size_t k, int *value) {
+    readLock(tree);
+    int result = treeSelect(tree, k, value);
+    readUnlock(tree);
+
+    return result;
+}
+
+/* Detached subtree with a black or empty root, together with its black
+ * height, the number of black nodes on every path from its root down. */
+struct Subtree {
+    struct RBNode *root;
+    size_t height;
+};
+
+typedef enum {SET_UNION, SET_INTERSECTION, SET_DIFFERENCE} SetOperation;
+
+/* Set operation between two subtrees, carried out by one thread. */
+struct SetTask {
+    SetOperation operation;
+    struct Subtree a;
+    struct Subtree b;
+    struct Subtree result;
+    /* Number of threads the task may use, its own included. */
+    unsigned threads;
+    /* Nodes dropped by the task, released once every thread is done. */
+    struct FreeList garbage;
+    /* Number of values found in both a and b. */
+    size_t matched;
+    /* Tree whose counters record the rebalancing done by the task. */
+    struct RBTree *counter;
+};
+
+/* Helper function: returns the black height of the subtree at node. */
+size_t blackHeight(struct RBNode *node) {
+    size_t height = 0;
+    for (; node; node = node->left) {
+        if (getColor(node) == BLACK) {
+            height++;
+        }
+    }
+
+    return height;
+}
+
+/* Helper function: detaches node from its parent and returns it as a
+ * subtree, where height is its black height if node is black. A red node is
+ * recolored black, which raises the height by one. */
+struct Subtree detachSubtree(struct RBNode *node, size_t height) {
+    if (node) {
+        setParent(node, NULL);
+        if (getColor(node) == RED) {
+            setColor(node, BLACK);
+            height++;
+        }
+    }
+
+    struct Subtree subtree = {node, height};
+    return subtree;
+}
+
+#ifdef RB_STATS
+/* Helper function: adds the rebalancing counters of part, a stand-in for a
+ * piece of tree, to those of tree. */
+void addRebalanceStats(struct RBTree *tree, const struct RBTree *part) {
+    tree->stats.rotations += part->stats.rotations;
+    tree->stats.recolorings += part->stats.recolorings;
+    tree->stats.insertUncleRed += part->stats.insertUncleRed;
+    tree->stats.insertTriangle += part->stats.insertTriangle;
+    tree->stats.insertLine += part->stats.insertLine;
+}
+#endif
+
+/* Helper function: returns the subtree holding the values of left, the
+ * value of pivot and the values of right, which must be in this order.
+ * When the heights differ, pivot is linked in red where the spine of the
+ * taller subtree reaches the height of the other one and fixed up from
+ * there, so joining costs O(1) plus the difference in height. The
+ * rotations and recolorings are counted in the counters of counter. */
+struct Subtree joinSubtrees(struct RBTree *counter, struct Subtree left, struct RBNode *pivot,
+                            struct Subtree right) {
+    if (left.height == right.height) {
+        pivot->left = left.root;
+        pivot->right = right.root;
+        if (left.root) {
+            setParent(left.root, pivot);
+        }
+        if (right.root) {
+            setParent(right.root, pivot);
+        }
+        setParent(pivot, NULL);
+        setColor(pivot, BLACK);
+#ifdef RB_ORDER_STATISTICS
+        updateSize(pivot);
+#endif
+
+        struct Subtree joined = {pivot, left.height + 1};
+        return joined;
+    }
+
+    int rightSpine = left.height > right.height;
+    struct Subtree tall = rightSpine ? left : right;
+    size_t target = rightSpine ? right.height : left.height;
+
+    struct RBNode *parent = NULL;
+    struct RBNode *node = tall.root;
+    size_t height = tall.height;
+    while (height > target || (node && getColor(node) == RED)) {
+        if (getColor(node) == BLACK) {
+            height--;
+        }
+        parent = node;
+        node = rightSpine ? node->right : node->left;
+    }
+
+    if (rightSpine) {
+        pivot->left = node;
+        pivot->right = right.root;
+        parent->right = pivot;
+    } else {
+        pivot->left = left.root;
+        pivot->right = node;
+        parent->left = pivot;
+    }
+    if (pivot->left) {
+        setParent(pivot->left, pivot);
+    }
+    if (pivot->right) {
+        setParent(pivot->right, pivot);
+    }
+    setParent(pivot, parent);
+    setColor(pivot, RED);
+#ifdef RB_ORDER_STATISTICS
+    for (struct RBNode *ancestor = pivot; ancestor; ancestor = getParent(ancestor)) {
+        updateSize(ancestor);
+    }
+#endif
+
+    // the fixup runs on a stand-in for the taller subtree, whose counters
+    // are passed on
+    struct RBTree part = {.root = tall.root};
+    size_t grown = insertFixup(&part, pivot) ? 1 : 0;
+#ifdef RB_STATS
+    addRebalanceStats(counter, &part);
+#else
+    (void)counter;
+#endif
+
+    struct Subtree joined = {part.root, tall.height + grown};
+    return joined;
+}
+
+/* Helper function: splits the subtree into the values below key, stored in
+ * lo, and the values above key, stored in hi. Returns the detached node
+ * holding key, or NULL when key is not present. Recursion depth is bounded
+ * by the height of the subtree. */
+struct RBNode *splitSubtree(struct RBTree *counter, struct Subtree tree, int key,
+                            struct Subtree *lo, struct Subtree *hi) {
+    struct RBNode *node = tree.root;
+    if (!node) {
+        *lo = tree;
+        *hi = tree;
+        return NULL;
+    }
+
+    struct Subtree left = detachSubtree(node->left, tree.height - 1);
+    struct Subtree right = detachSubtree(node->right, tree.height - 1);
+    if (key == node->value) {
+        node->left = NULL;
+        node->right = NULL;
+        *lo = left;
+        *hi = right;
+        return node;
+    }
+
+    struct Subtree rest;
+    struct RBNode *found;
+    if (key < node->value) {
+        found = splitSubtree(counter, left, key, lo, &rest);
+        *hi = joinSubtrees(counter, rest, node, right);
+    } else {
+        found = splitSubtree(counter, right, key, &rest, hi);
+        *lo = joinSubtrees(counter, left, node, rest);
+    }
+
+    return found;
+}
+
+/* Helper function: detaches the node holding the largest value of the
+ * nonempty subtree, stores what is left in rest and returns the node. */
+struct RBNode *splitLast(struct RBTree *counter, struct Subtree tree, struct Subtree *rest) {
+    struct RBNode *node = tree.root;
+    struct Subtree left = detachSubtree(node->left, tree.height - 1);
+    struct Subtree right = detachSubtree(node->right, tree.height - 1);
+    if (!right.root) {
+        node->left = NULL;
+        *rest = left;
+        return node;
+    }
+
+    struct Subtree restRight;
+    struct RBNode *last = splitLast(counter, right, &restRight);
+    *rest = joinSubtrees(counter, left, node, restRight);
+
+    return last;
+}
+
+/* Helper function: joins two subtrees whose values are in this order,
+ * borrowing the last node of left as pivot. */
+struct Subtree joinPair(struct RBTree *counter, struct Subtree left, struct Subtree right) {
+    if (!left.root) {
+        return right;
+    }
+
+    struct Subtree rest;
+    struct RBNode *last = splitLast(counter, left, &rest);
+
+    return joinSubtrees(counter, rest, last, right);
+}
+
+/* Helper function: thread entry point running a set task. */
+void *setTaskThread(void *argument);
+
+/* Helper function: computes task->result from task->a and task->b, which
+ * are consumed. The root of b splits a in two, after which both halves are
+ * independent subproblems, the lower one run by a new thread while the task
+ * has threads to spare. Recursion depth is bounded by the heights of a and
+ * b. */
+void runSetTask(struct SetTask *task) {
+    struct Subtree a = task->a;
+    struct Subtree b = task->b;
+    struct Subtree empty = {NULL, 0};
+
+    if (!a.root || !b.root) {
+        switch (task->operation) {
+        case SET_UNION:
+            task->result = a.root ? a : b;
+            break;
+        case SET_INTERSECTION:
+            if (a.root) {
+                freeListPush(&task->garbage, a.root);
+            }
+            if (b.root) {
+                freeListPush(&task->garbage, b.root);
+            }
+            task->result = empty;
+            break;
+        case SET_DIFFERENCE:
+            if (b.root) {
+                freeListPush(&task->garbage, b.root);
+            }
+            task->result = a;
+            break;
+        }
+        return;
+    }
+
+    struct RBNode *pivot = b.root;
+    struct SetTask low = {
+        .operation = task->operation, .threads = task->threads, .counter = task->counter};
+    struct SetTask high = {
+        .operation = task->operation, .threads = task->threads, .counter = task->counter};
+    low.b = detachSubtree(pivot->left, b.height - 1);
+    high.b = detachSubtree(pivot->right, b.height - 1);
+    pivot->left = NULL;
+    pivot->right = NULL;
+
+    struct RBNode *match = splitSubtree(task->counter, a, pivot->value, &low.a, &high.a);
+    if (match) {
+        task->matched++;
+        freeListPush(&task->garbage, match);
+    }
+
+    // a task run by another thread counts in a tree of its own, added to
+    // the counters of this task once the thread is done
+    pthread_t thread;
+    struct RBTree lowCounter = {.root = NULL};
+    int forked = 0;
+    if (task->threads > 1
+        && (low.a.height >= PARALLEL_MIN_HEIGHT || low.b.height >= PARALLEL_MIN_HEIGHT)) {
+        low.threads = task->threads / 2;
+        high.threads = task->threads - low.threads;
+        low.counter = &lowCounter;
+        forked = pthread_create(&thread, NULL, setTaskThread, &low) == 0;
+        if (!forked) {
+            low.threads = task->threads;
+            high.threads = task->threads;
+            low.counter = task->counter;
+        }
+    }
+
+    runSetTask(&high);
+    if (forked) {
+        pthread_join(thread, NULL);
+#ifdef RB_STATS
+        addRebalanceStats(task->counter, &lowCounter);
+#endif
+    } else {
+        runSetTask(&low);
+    }
+
+    freeListSplice(&task->garbage, &low.garbage);
+    freeListSplice(&task->garbage, &high.garbage);
+    task->matched += low.matched + high.matched;
+
+    if (task->operation == SET_UNION || (task->operation == SET_INTERSECTION && match)) {
+        task->result = joinSubtrees(task->counter, low.result, pivot, high.result);
+    } else {
+        freeListPush(&task->garbage, pivot);
+        task->result = joinPair(task->counter, low.result, high.result);
+    }
+}
+
+void *setTaskThread(void *argument) {
+    runSetTask(argument);
+    return NULL;
+}
+
+/* Helper function: frees the tree itself, its lock and its hold on its
+ * pool, leaving the nodes to any other holder of the pool. */
+void treeDiscard(struct RBTree *tree) {
+    BTreeFree(tree->btree);
+    sharedRelease(tree->shared);
+    poolDrop(tree->pool);
+    if (tree->lock) {
+        pthread_rwlock_destroy(&tree->lock->rwlock);
+        free(tree->lock);
+    }
+    free(tree);
+}
+
+/* Helper function: takes the write locks of two distinct trees, returns 0
+ * on success, -1 on failure, in which case neither lock is held. The tree
+ * at the lower address is always locked first, so calls naming the same
+ * trees in either order cannot deadlock. */
+int writeLockPair(struct RBTree *t1, struct RBTree *t2) {
+    if (!t1 || !t2 || t1 == t2 || t1->btree || t2->btree) {
+        return -1;
+    }
+
+    struct RBTree *first = (uintptr_t)t1 < (uintptr_t)t2 ? t1 : t2;
+    writeLock(first);
+    writeLock(first == t1 ? t2 : t1);
+
+    return 0;
+}
+
+struct RBTree *RBJoin(struct RBTree *t1, int pivot, struct RBTree *t2) {
+    if (writeLockPair(t1, t2) == -1) {
+        return NULL;
+    }
+
+    int valid = t1->multiset == t2->multiset
+                && (!t1->root || nodeLast(t1->root)->value < pivot)
+                && (!t2->root || nodeFirst(t2->root)->value > pivot);
+#ifdef RB_COMPACT_NODES
+    valid = valid && t2->count < UINT_MAX - t1->count;
+#endif
+    struct RBNode *node = NULL;
+    if (valid && poolAdopt(t1, t2) == 0) {
+        node = makeNode(t1, pivot);
+    }
+    if (!node) {
+        writeUnlock(t2);
+        writeUnlock(t1);
+        return NULL;
+    }
+
+    struct Subtree joined = joinSubtrees(t1, detachSubtree(t1->root, blackHeight(t1->root)), node,
+                                         detachSubtree(t2->root, blackHeight(t2->root)));
+    t1->root = joined.root;
+    t1->count += t2->count + 1;
+    shareDrop(t1);
+    DEBUG_CHECK(t1);
+
+    writeUnlock(t2);
+    writeUnlock(t1);
+    treeDiscard(t2);
+
+    return t1;
+}
+
+int RBSplit(struct RBTree *tree, int key, struct RBTree **lo, struct RBTree **hi) {
+    if (!tree || tree->btree || !lo || !hi) {
+        return -1;
+    }
+
+    struct RBTree *upper = RBCreate();
+    if (!upper || (tree->lock && RBMakeConcurrent(upper) == -1)) {
+        RBFree(upper);
+        return -1;
+    }
+    upper->multiset = tree->multiset;
+    writeLock(tree);
+
+    // both halves allocate from the pool of tree from now on
+    poolDrop(upper->pool);
+    atomic_fetch_add(&tree->pool->refs, 1);
+    upper->pool = tree->pool;
+
+    struct Subtree lower;
+    struct Subtree higher;
+    struct RBNode *match = splitSubtree(tree, detachSubtree(tree->root, blackHeight(tree->root)),
+                                        key, &lower, &higher);
+    if (match) {
+        struct Subtree empty = {NULL, 0};
+        higher = joinSubtrees(tree, empty, match, higher);
+    }
+
+    size_t count = tree->count;
+    tree->root = lower.root;
+#ifdef RB_ORDER_STATISTICS
+    tree->count = nodeSize(lower.root);
+#else
+    tree->count = 0;
+    for (struct RBNode *node = nodeFirst(lower.root); node; node = nodeNext(node)) {
+        tree->count++;
+    }
+#endif
+    upper->root = higher.root;
+    upper->count = count - tree->count;
+    shareDrop(tree);
+    DEBUG_CHECK(tree);
+    DEBUG_CHECK(upper);
+    writeUnlock(tree);
+
+    *lo = tree;
+    *hi = upper;
+
+    return 0;
+}
+
+/* Helper function: carries out the set operation on t1 and t2 with up to
+ * threads threads, leaving the result in t1 and freeing t2. Returns t1 on
+ * success, NULL on failure, in which case both trees are unchanged. */
+struct RBTree *treeSetOperation(struct RBTree *t1, struct RBTree *t2,
+                                SetOperation operation, unsigned threads) {
+    // matching values would have to merge their counts
+    if ((t1 && t1->multiset) || (t2 && t2->multiset)) {
+        return NULL;
+    }
+    if (writeLockPair(t1, t2) == -1) {
+        return NULL;
+    }
+
+    int valid = 1;
+#ifdef RB_COMPACT_NODES
+    valid = operation != SET_UNION || t2->count <= UINT_MAX - t1->count;
+#endif
+    if (!valid || poolAdopt(t1, t2) == -1) {
+        writeUnlock(t2);
+        writeUnlock(t1);
+        return NULL;
+    }
+
+    struct SetTask task = {
+        .operation = operation,
+        .a = detachSubtree(t1->root, blackHeight(t1->root)),
+        .b = detachSubtree(t2->root, blackHeight(t2->root)),
+        .threads = threads > 0 ? threads : 1,
+        .counter = t1,
+    };
+    runSetTask(&task);
+    poolReleaseList(t1, &task.garbage);
+
+    t1->root = task.result.root;
+    switch (operation) {
+    case SET_UNION:
+        t1->count += t2->count - task.matched;
+        break;
+    case SET_INTERSECTION:
+        t1->count = task.matched;
+        break;
+    case SET_DIFFERENCE:
+        t1->count -= task.matched;
+        break;
+    }
+    shareDrop(t1);
+
+    writeUnlock(t2);
+    writeUnlock(t1);
+    treeDiscard(t2);
+
+    return t1;
+}
+
+struct RBTree *RBUnion(struct RBTree *t1, struct RBTree *t2) {
+    return treeSetOperation(t1, t2, SET_UNION, 1);
+}
+
+struct RBTree *RBIntersect(struct RBTree *t1, struct RBTree *t2) {
+    return treeSetOperation(t1, t2, SET_INTERSECTION, 1);
+}
+
+struct RBTree *RBDifference(struct RBTree *t1, struct RBTree *t2) {
+    return treeSetOperation(t1, t2, SET_DIFFERENCE, 1);
+}
+
+struct RBTree *RBUnionParallel(struct RBTree *t1, struct RBTree *t2, unsigned threads) {
+    return treeSetOperation(t1, t2, SET_UNION, threads);
+}
+
+struct RBTree *RBIntersectParallel(struct RBTree *t1, struct RBTree *t2, unsigned threads) {
+    return treeSetOperation(t1, t2, SET_INTERSECTION, threads);
+}
+
+struct RBTree *RBDifferenceParallel(struct RBTree *t1, struct RBTree *t2, unsigned threads) {
+    return treeSetOperation(t1, t2, SET_DIFFERENCE, threads);
+}
+
+/* Helper function */
+void nodePrint(struct RBNode *node) {
+    for (node = nodeFirst(node); node; node = nodeNext(node)) {
+        printf("%d\n", node->value);
+    }
+}
+
+/* Helper function: RBPrint without taking the tree lock. */
+void treePrint(struct RBTree *tree) {
+    if (!tree) {
+        return;
+    }
+
+    if (tree->btree) {
+        int value;
+        for (int found = BTreeCeiling(tree->btree, INT_MIN, 0, &value); found;
+             found = BTreeCeiling(tree->btree, value, 1, &value)) {
+            printf("%d\n", value);
+        }
+        return;
+    }
+
+    nodePrint(tree->root);
+
+    return;
+}
+
+void RBPrint(struct RBTree *tree) {
+    readLock(tree);
+    treePrint(tree);
+    readUnlock(tree);
+}
+
+/* Helper function: checks every node of the (sub)tree in a single walk
+ * through the parent pointers: children point back at their parent, values
+ * strictly increase in order, no red node has a red parent, subtree sizes
+ * match those of the children and every path down has the same number of
+ * black nodes. Stores the number of nodes in *count and returns the black
+ * depth of the subtree, counting the empty leaves, or -1 if it is
+ * invalid. */
+int subtreeCheck(struct RBNode *root, size_t *count) {
+    *count = 0;
+    if (!root) {
+        return 1;
+    }
+
+    int expected = -1;
+    int depth = 0;
+    struct RBNode *inOrder = NULL;
+    struct RBNode *previous = getParent(root);
+    struct RBNode *node = root;
+    while (node != getParent(root)) {
+        struct RBNode *next;
+        int visit = 0;
+        if (previous == getParent(node)) {
+            if ((node->left && getParent(node->left) != node)
+                || (node->right && getParent(node->right) != node)) {
+                return -1;
+            }
+            if (getColor(node) == RED && getParent(node) && getColor(getParent(node)) == RED) {
+                return -1;
+            }
+#ifdef RB_ORDER_STATISTICS
+            if (node->size != nodeSize(node->left) + nodeSize(node->right) + 1) {
+                return -1;
+            }
+#endif
+#ifdef RB_MULTISET
+            if (node->multiplicity == 0) {
+                return -1;
+            }
+#endif
+            if (getColor(node) == BLACK) {
+                depth++;
+            }
+            if (!node->left || !node->right) {
+                if (expected == -1) {
+                    expected = depth + 1;
+                } else if (expected != depth + 1) {
+                    return -1;
+                }
+            }
+            next = node->left;
+            visit = !next;
+        } else if (previous == node->left) {
+            next = NULL;
+            visit = 1;
+        } else {
+            next = NULL;
+        }
+
+        // the in-order visit happens once the left subtree is done
+        if (visit) {
+            if (inOrder && inOrder->value >= node->value) {
+                return -1;
+            }
+            inOrder = node;
+            (*count)++;
+            next = node->right;
+        }
+
+        if (!next) {
+            if (getColor(node) == BLACK) {
+                depth--;
+            }
+            next = getParent(node);
+        }
+
+        previous = node;
+        node = next;
+    }
+
+    return expected;
+}
+
+/* Check of a subtree, carried out by one thread. */
+struct CheckTask {
+    struct RBNode *root;
+    /* Number of threads the task may use, its own included. */
+    unsigned threads;
+    /* What subtreeCheck returns for the subtree, -1 if it is invalid. */
+    int result;
+    /* Number of nodes in the subtree. */
+    size_t count;
+};
+
+/* Helper function: thread entry point running a check task. */
+void *checkTaskThread(void *argument);
+
+/* Helper function: runs every check of treeCheck below the root color on
+ * the subtree of the task. While the task has threads to spare, the root
+ * is checked against its neighbours and the left subtree is checked by a
+ * new thread. */
+void runCheckTask(struct CheckTask *task) {
+    struct RBNode *root = task->root;
+    if (task->threads <= 1 || blackHeight(root) < PARALLEL_MIN_HEIGHT) {
+        task->result = subtreeCheck(root, &task->count);
+        return;
+    }
+
+    if ((root->left && getParent(root->left) != root)
+        || (root->right && getParent(root->right) != root)
+        || (root->left && nodeLast(root->left)->value >= root->value)
+        || (root->right && nodeFirst(root->right)->value <= root->value)
+        || (getColor(root) == RED && getParent(root) && getColor(getParent(root)) == RED)) {
+        task->result = -1;
+        return;
+    }
+#ifdef RB_ORDER_STATISTICS
+    if (root->size != nodeSize(root->left) + nodeSize(root->right) + 1) {
+        task->result = -1;
+        return;
+    }
+#endif
+
+    struct CheckTask low = {root->left, task->threads / 2, 0, 0};
+    struct CheckTask high = {root->right, task->threads - low.threads, 0, 0};
+    pthread_t thread;
+    int forked = pthread_create(&thread, NULL, checkTaskThread, &low) == 0;
+    if (!forked) {
+        low.threads = task->threads;
+        high.threads = task->threads;
+    }
+    runCheckTask(&high);
+    if (forked) {
+        pthread_join(thread, NULL);
+    } else {
+        runCheckTask(&low);
+    }
+
+    if (low.result == -1 || low.result != high.result) {
+        task->result = -1;
+    } else {
+        task->result = low.result + (getColor(root) == BLACK);
+        task->count = low.count + high.count + 1;
+    }
+}
+
+void *checkTaskThread(void *argument) {
+    runCheckTask(argument);
+    return NULL;
+}
+
+/* Helper function: RBCheck with up to threads threads, without taking the
+ * tree lock. */
+int treeCheck(struct RBTree *tree, unsigned threads) {
+    if (!tree) {
+        return -1;
+    }
+    if (tree->btree) {
+        return BTreeCheck(tree->btree);
+    }
+
+    if (!tree->root) {
+        return 0;
+    }
+
+    if (getColor(tree->root) != BLACK || getParent(tree->root)) {
+        return -1;
+    }
+
+    struct CheckTask task = {tree->root, threads > 0 ? threads : 1, 0, 0};
+    runCheckTask(&task);
+    if (task.result == -1 || task.count != tree->count) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int RBCheck(struct RBTree *tree) {
+    readLock(tree);
+    int result = treeCheck(tree, 1);
+    readUnlock(tree);
+
+    return result;
+}
+
+int RBCheckParallel(struct RBTree *tree, unsigned threads) {
+    readLock(tree);
+    int result = treeCheck(tree, threads);
+    readUnlock(tree);
+
+    return result;
+}
+
+/* Helper function: checks node against its children: they point back at
+ * it, are ordered around it and are not both red with it, the subtree size
+ * matches and the leftmost paths below both children hold the same number
+ * of black nodes. Returns 0 on success, -1 on failure. */
+int nodeCheckLocal(struct RBNode *node) {
+    struct RBNode *left = node->left;
+    struct RBNode *right = node->right;
+    if ((left && (getParent(left) != node || left->value >= node->value))
+        || (right && (getParent(right) != node || right->value <= node->value))) {
+        return -1;
+    }
+    if (getColor(node) == RED && ((left && getColor(left) == RED)
+                                  || (right && getColor(right) == RED))) {
+        return -1;
+    }
+#ifdef RB_ORDER_STATISTICS
+    if (node->size != nodeSize(left) + nodeSize(right) + 1) {
+        return -1;
+    }
+#endif
+#ifdef RB_MULTISET
+    if (node->multiplicity == 0) {
+        return -1;
+    }
+#endif
+
+    return blackHeight(left) == blackHeight(right) ? 0 : -1;
+}
+
+int treeCheckLocal(struct RBTree *tree) {
+    if (!tree) {
+        return -1;
+    }
+    if (tree->btree) {
+        return 0;
+    }
+
+    struct RBNode *root = tree->root;
+    if (!root) {
+        return tree->count == 0 ? 0 : -1;
+    }
+    if (getColor(root) != BLACK || getParent(root)) {
+        return -1;
+    }
+#ifdef RB_ORDER_STATISTICS
+    if (root->size != tree->count) {
+        return -1;
+    }
+#endif
+
+    // descending to the touched node by its value checks the order along
+    // the path, the walk back up everything next to it
+    struct RBNode *node = tree->touched;
+    if (!node) {
+        return nodeCheckLocal(root);
+    }
+    if (nodeSearch(root, node->value) != node) {
+        return -1;
+    }
+    for (int depth = 0; node; depth++) {
+        struct RBNode *parent = getParent(node);
+        if (depth == MAX_DEPTH || (parent && parent->left != node && parent->right != node)) {
+            return -1;
+        }
+        if (nodeCheckLocal(node) == -1 || (node->left && nodeCheckLocal(node->left) == -1)
+            || (node->right && nodeCheckLocal(node->right) == -1)) {
+            return -1;
+        }
+        node = parent;
+    }
+
+    return 0;
+}
+
+int RBCheckLocal(struct RBTree *tree) {
+    readLock(tree);
+    int result = treeCheckLocal(tree);
+    readUnlock(tree);
+
+    return result;
+}
+
+/* State of a change to the persistent copy of a tree: the number of nodes
+ * allocated and whether an allocation failed. */
+struct ShareState {
+    size_t allocated;
+    int failed;
+};
+
+/* Helper function: returns the treap priority of value, a hash mixing all of
+ * its bits. The hash is a bijection, so distinct values never tie. */
+unsigned sharedPriority(int value) {
+    uint32_t x = (uint32_t)value;
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+
+    return x;
+}
+
+/* Helper function: takes a reference to node, returns node. */
+struct SharedNode *sharedRetain(struct SharedNode *node) {
+    if (node) {
+        atomic_fetch_add_explicit(&node->references, 1, memory_order_relaxed);
+    }
+
+    return node;
+}
+
+/* Helper function: drops a reference to node, freeing it and dropping its
+ * references to its children when it was the last one. Recursion depth is
+ * bounded by the height of the copy. */
+void sharedRelease(struct SharedNode *node) {
+    while (node && atomic_fetch_sub_explicit(&node->references, 1, memory_order_acq_rel) == 1) {
+        struct SharedNode *right = node->right;
+        sharedRelease(node->left);
+        free(node);
+        node = right;
+    }
+}
+
+/* Helper function: returns a new node holding value that takes over the
+ * references to left and right. On failure drops them, records the failure
+ * in state and returns NULL. */
+struct SharedNode *sharedMake(struct ShareState *state, int value, unsigned priority,
+                              struct SharedNode *left, struct SharedNode *right) {
+    struct SharedNode *node = malloc(sizeof(struct SharedNode));
+    if (!node) {
+        sharedRelease(left);
+        sharedRelease(right);
+        state->failed = 1;
+        return NULL;
+    }
+
+    atomic_init(&node->references, 1);
+    node->value = value;
+    node->priority = priority;
+    node->left = left;
+    node->right = right;
+    state->allocated++;
+
+    return node;
+}
+
+/* Helper function: returns a copy of node with the children left and right,
+ * whose references it takes over. */
+struct SharedNode *sharedCopy(struct ShareState *state, const struct SharedNode *node,
+                              struct SharedNode *left, struct SharedNode *right) {
+    return sharedMake(state, node->value, node->priority, left, right);
+}
+
+/* Helper function: returns whether the version at node holds value. */
+int sharedContains(const struct SharedNode *node, int value) {
+    while (node && node->value != value) {
+        node = value < node->value ? node->left : node->right;
+    }
+
+    return node != NULL;
+}
+
+/* Helper function: splits the version at node around value, which it does
+ * not hold, into versions of the smaller values, stored in lo, and of the
+ * greater ones, stored in hi, copying only the nodes on the path of value.
+ * Recursion depth is bounded by the height of the copy. */
+void sharedSplit(struct ShareState *state, struct SharedNode *node, int value,
+                 struct SharedNode **lo, struct SharedNode **hi) {
+    if (!node) {
+        *lo = NULL;
+        *hi = NULL;
+        return;
+    }
+
+    struct SharedNode *rest;
+    if (node->value < value) {
+        sharedSplit(state, node->right, value, &rest, hi);
+        *lo = sharedCopy(state, node, sharedRetain(node->left), rest);
+    } else {
+        sharedSplit(state, node->left, value, lo, &rest);
+        *hi = sharedCopy(state, node, rest, sharedRetain(node->right));
+    }
+}
+
+/* Helper function: returns a version of the values at node and value, which
+ * node does not hold. The path down to where value ranks by priority is
+ * copied, and the path below it split around value. Recursion depth is
+ * bounded by the height of the copy. */
+struct SharedNode *sharedInsert(struct ShareState *state, struct SharedNode *node, int value,
+                                unsigned priority) {
+    if (!node || priority > node->priority) {
+        struct SharedNode *lo;
+        struct SharedNode *hi;
+        sharedSplit(state, node, value, &lo, &hi);
+        return sharedMake(state, value, priority, lo, hi);
+    }
+
+    if (value < node->value) {
+        struct SharedNode *left = sharedInsert(state, node->left, value, priority);
+        return sharedCopy(state, node, left, sharedRetain(node->right));
+    }
+    struct SharedNode *right = sharedInsert(state, node->right, value, priority);
+    return sharedCopy(state, node, sharedRetain(node->left), right);
+}
+
+/* Helper function: returns a version of the values at lo followed by those
+ * at hi, copying the spines along which they are merged. Recursion depth is
+ * bounded by the heights of both. */
+struct SharedNode *sharedMerge(struct ShareState *state, struct SharedNode *lo,
+                               struct SharedNode *hi) {
+    if (!lo || !hi) {
+        return sharedRetain(lo ? lo : hi);
+    }
+
+    if (lo->priority > hi->priority) {
+        struct SharedNode *right = sharedMerge(state, lo->right, hi);
+        return sharedCopy(state, lo, sharedRetain(lo->left), right);
+    }
+    struct SharedNode *left = sharedMerge(state, lo, hi->left);
+    return sharedCopy(state, hi, left, sharedRetain(hi->right));
+}
+
+/* Helper function: returns a version of the values at node without value,
+ * which node holds, copying the path down to it and merging its children.
+ * Recursion depth is bounded by the height of the copy. */
+struct SharedNode *sharedErase(struct ShareState *state, struct SharedNode *node, int value) {
+    if (value == node->value) {
+        return sharedMerge(state, node->left, node->right);
+    }
+
+    if (value < node->value) {
+        struct SharedNode *left = sharedErase(state, node->left, value);
+        return sharedCopy(state, node, left, sharedRetain(node->right));
+    }
+    struct SharedNode *right = sharedErase(state, node->right, value);
+    return sharedCopy(state, node, sharedRetain(node->left), right);
+}
+
+/* Helper function: builds the persistent copy of the values of the tree in
+ * one in-order pass, keeping the right spine of the treap built so far on a
+ * stack, and starts sharing it. Returns 0 on success, -1 on failure. */
+int shareBuild(struct RBTree *tree) {
+    struct ShareState state = {0, 0};
+    size_t capacity = 64;
+    size_t depth = 0;
+    struct SharedNode **spine = malloc(capacity * sizeof(struct SharedNode *));
+    if (!spine) {
+        return -1;
+    }
+
+    for (struct RBNode *node = nodeFirst(tree->root); node; node = nodeNext(node)) {
+        unsigned priority = sharedPriority(node->value);
+        struct SharedNode *added = sharedMake(&state, node->value, priority, NULL, NULL);
+        if (!added) {
+            break;
+        }
+
+        // the spine nodes of lower priority move below the new node, which
+        // takes their place at the end of the spine
+        while (depth > 0 && spine[depth - 1]->priority < priority) {
+            added->left = spine[--depth];
+        }
+        if (depth > 0) {
+            spine[depth - 1]->right = added;
+        }
+        if (depth == capacity) {
+            struct SharedNode **grown = realloc(spine, 2 * capacity * sizeof(struct SharedNode *));
+            if (!grown) {
+                sharedRelease(depth > 0 ? spine[0] : added);
+                state.failed = 1;
+                depth = 0;
+                break;
+            }
+            spine = grown;
+            capacity *= 2;
+        }
+        spine[depth++] = added;
+    }
+
+    if (state.failed) {
+        if (depth > 0) {
+            sharedRelease(spine[0]);
+        }
+        free(spine);
+        return -1;
+    }
+
+    tree->shared = depth > 0 ? spine[0] : NULL;
+    tree->sharing = 1;
+    tree->sharedNodes += state.allocated;
+    free(spine);
+
+    return 0;
+}
+
+void shareDrop(struct RBTree *tree) {
+    sharedRelease(tree->shared);
+    tree->shared = NULL;
+    tree->sharing = 0;
+}
+
+void shareChange(struct RBTree *tree, int value) {
+    if (!tree->sharing) {
+        return;
+    }
+
+    int present = nodeSearch(tree->root, value) != NULL;
+    if (present == sharedContains(tree->shared, value)) {
+        return;
+    }
+
+    struct ShareState state = {0, 0};
+    struct SharedNode *root = present
+                              ? sharedInsert(&state, tree->shared, value, sharedPriority(value))
+                              : sharedErase(&state, tree->shared, value);
+    sharedRelease(tree->shared);
+    tree->shared = root;
+    tree->sharedNodes += state.allocated;
+
+    // without memory for the path the copy is dropped and built again by the
+    // next snapshot, while the snapshots taken keep their versions
+    if (state.failed) {
+        shareDrop(tree);
+    }
+}
+
+struct RBSnapshot *RBSnapshot(struct RBTree *tree) {
+    if (!tree || tree->btree) {
+        return NULL;
+    }
+
+    struct RBSnapshot *snapshot = malloc(sizeof(struct RBSnapshot));
+    if (!snapshot) {
+        return NULL;
+    }
+
+    // the first snapshot builds the copy, which needs the write lock although
+    // the values of the tree do not change
+    if (tree->lock) {
+        pthread_rwlock_wrlock(&tree->lock->rwlock);
+    }
+    int shared = tree->sharing || shareBuild(tree) == 0;
+    snapshot->root = sharedRetain(tree->shared);
+    snapshot->count = tree->count;
+    if (tree->lock) {
+        pthread_rwlock_unlock(&tree->lock->rwlock);
+    }
+
+    if (!shared) {
+        free(snapshot);
+        return NULL;
+    }
+
+    return snapshot;
+}
+
+int RBSnapshotSearch(struct RBSnapshot *snapshot, int value) {
+    if (!snapshot) {
+        return 0;
+    }
+
+    return sharedContains(snapshot->root, value);
+}
+
+size_t RBSnapshotSize(struct RBSnapshot *snapshot) {
+    if (!snapshot) {
+        return 0;
+    }
+
+    return snapshot->count;
+}
+
+/* Helper function: calls visit on the values of the version at node in
+ * [lo, hi) in order, returns 1 when visit stopped the walk, 0 otherwise.
+ * Recursion depth is bounded by the height of the copy. */
+int sharedRange(const struct SharedNode *node, int lo, int hi, RBVisitor visit, void *context) {
+    while (node) {
+        if (node->value < lo) {
+            node = node->right;
+        } else if (node->value >= hi) {
+            node = node->left;
+        } else {
+            if (sharedRange(node->left, lo, hi, visit, context) || visit(node->value, context)) {
+                return 1;
+            }
+            node = node->right;
+        }
+    }
+
+    return 0;
+}
+
+int RBSnapshotRange(struct RBSnapshot *snapshot, int lo, int hi,
+                    RBVisitor visit, void *context) {
+    if (!snapshot || !visit) {
+        return -1;
+    }
+
+    return sharedRange(snapshot->root, lo, hi, visit, context);
+}
+
+void RBSnapshotFree(struct RBSnapshot *snapshot) {
+    if (!snapshot) {
+        return;
+    }
+
+    sharedRelease(snapshot->root);
+    free(snapshot);
+}
+
+/* Header of a saved tree. The nodes follow it in key order, so node i holds
+ * the i-th smallest value, and refer to their children by index rather
+ * than by address, which lets a mapped file be read wherever it lands. */
+struct MappedHeader {
+    char magic[8];
+    uint64_t count;
+    uint64_t root;
+};
+
+/* Node of a saved tree. */
+struct MappedNode {
+    int32_t value;
+    uint32_t black;
+    uint64_t left;
+    uint64_t right;
+};
+
+/* Saved tree opened with RBOpenMapped. */
+struct RBMappedTree {
+    void *address;
+    size_t length;
+    const struct MappedHeader *header;
+    const struct MappedNode *nodes;
+};
+
+/* Index of a missing child or of the root of an empty tree. */
+#define MAPPED_NONE UINT64_MAX
+
+static const char mappedMagic[8] = "RBTREE\0\1";
+
+/* Helper function: writes the subtree at node to out in order, numbering
+ * its nodes from *next on, and returns the index of node. Recursion depth
+ * is bounded by the height of the tree. */
+uint64_t saveSubtree(struct RBNode *node, struct MappedNode *out, uint64_t *next) {
+    if (!node) {
+        return MAPPED_NONE;
+    }
+
+    uint64_t left = saveSubtree(node->left, out, next);
+    uint64_t index = (*next)++;
+    uint64_t right = saveSubtree(node->right, out, next);
+
+    out[index].value = node->value;
+    out[index].black = getColor(node) == BLACK;
+    out[index].left = left;
+    out[index].right = right;
+
+    return index;
+}
+
+/* Helper function: RBSave without taking the tree lock. */
+int treeSave(struct RBTree *tree, const char *path) {
+    if (!tree || tree->btree || tree->multiset || !path) {
+        return -1;
+    }
+
+    size_t length = sizeof(struct MappedHeader) + tree->count * sizeof(struct MappedNode);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    if (ftruncate(fd, (off_t)length) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    void *address = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    struct MappedHeader *header = address;
+    uint64_t next = 0;
+    memcpy(header->magic, mappedMagic, sizeof(mappedMagic));
+    header->count = tree->count;
+    header->root = saveSubtree(tree->root, (struct MappedNode *)(header + 1), &next);
+
+    int result = msync(address, length, MS_SYNC) == 0 ? 0 : -1;
+    munmap(address, length);
+    if (close(fd) == -1) {
+        result = -1;
+    }
+
+    return result;
 }
 
-/* Helper function */
-void lineCaseColorSwap(struct RBNode *parent, struct RBNode *grandparent) {
-    Color temp = parent->color;
-    parent->color = grandparent->color;
-    grandparent->color = temp;
+int RBSave(struct RBTree *tree, const char *path) {
+    readLock(tree);
+    int result = treeSave(tree, path);
+    readUnlock(tree);
+
+    return result;
 }
 
-/* Helper function: restores red-black properties after insertion. */
-void insertFixup(struct RBTree *tree, struct RBNode *node) {
-    if (catchSimpleCases(tree, node)) {
-        return;
+struct RBMappedTree *RBOpenMapped(const char *path) {
+    if (!path) {
+        return NULL;
     }
 
-    struct RBNode *parent = node->parent;
-    struct RBNode *grandparent = parent->parent;
-    struct RBNode *uncle;
-    if (grandparent->left == parent) {
-        uncle = grandparent->right;
-    } else {
-        uncle = grandparent->left;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
     }
 
-    if (uncle && uncle->color == RED) {
-        uncleRedCaseColorSwap(parent, uncle, grandparent);
-        insertFixup(tree, grandparent);
-        return;
+    struct stat status;
+    if (fstat(fd, &status) == -1 || (size_t)status.st_size < sizeof(struct MappedHeader)) {
+        close(fd);
+        return NULL;
     }
 
-    // triangle case
-    if (node == parent->left && parent == grandparent->right) {
-        rightRotate(tree, parent);
-        node = parent;
-        parent = node->parent;
-    } else if (node == parent->right && parent == grandparent->left) {
-        leftRotate(tree, parent);
-        node = parent;
-        parent = node->parent;
+    size_t length = (size_t)status.st_size;
+    void *address = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) {
+        return NULL;
     }
 
-    // line case (always follows triangle case)
-    if (node == parent->left && parent == grandparent->left) {
-        rightRotate(tree, grandparent);
-        lineCaseColorSwap(parent, grandparent);
-        insertFixup(tree, parent);
-    } else if (node == parent->right && parent == grandparent->right) {
-        leftRotate(tree, grandparent);
-        lineCaseColorSwap(parent, grandparent);
-        insertFixup(tree, parent);
+    // only the header is checked here, RBMappedCheck checks the nodes
+    const struct MappedHeader *header = address;
+    size_t nodesLength = length - sizeof(struct MappedHeader);
+    if (memcmp(header->magic, mappedMagic, sizeof(mappedMagic)) != 0
+        || nodesLength % sizeof(struct MappedNode) != 0
+        || header->count != nodesLength / sizeof(struct MappedNode)
+        || (header->count > 0 ? header->root >= header->count : header->root != MAPPED_NONE)) {
+        munmap(address, length);
+        return NULL;
     }
-}
 
-int RBInsert(struct RBTree *tree, int value) {
-    if (!tree) {
-        return -1;
+    struct RBMappedTree *mapped = malloc(sizeof(struct RBMappedTree));
+    if (!mapped) {
+        munmap(address, length);
+        return NULL;
     }
 
-    int duplicateFlag = 0;
-    struct RBNode *newNode = makeNode(value);
-    tree->root = nodeInsert(tree->root, newNode, &duplicateFlag);
-    insertFixup(tree, newNode);
+    mapped->address = address;
+    mapped->length = length;
+    mapped->header = header;
+    mapped->nodes = (const struct MappedNode *)(header + 1);
 
-    if (duplicateFlag) {
-        free(newNode);
-        return 1;
-    } else {
-        return 0;
-    }
+    return mapped;
 }
 
-/* Helper function: finds and returns the node with node->value == value. */
-struct RBNode *nodeSearch(struct RBNode *node, int value) {
-    if (!node) {
-        return NULL;
+int RBMappedSearch(struct RBMappedTree *mapped, int value) {
+    if (!mapped) {
+        return 0;
     }
 
-    if (node->value == value) {
-        return node;
-    } else if (value < node->value) {
-        return nodeSearch(node->left, value);
-    } else {
-        return nodeSearch(node->right, value);
+    // indices are bounds checked and the depth limited, so a damaged file
+    // cannot lead the descent astray
+    uint64_t index = mapped->header->root;
+    for (int depth = 0; index < mapped->header->count && depth < MAX_DEPTH; depth++) {
+        const struct MappedNode *node = &mapped->nodes[index];
+        if (value == node->value) {
+            return 1;
+        }
+        index = value < node->value ? node->left : node->right;
     }
+
+    return 0;
 }
 
-int RBSearch(struct RBTree *tree, int value) {
-    if (!tree) {
+size_t RBMappedSize(struct RBMappedTree *mapped) {
+    if (!mapped) {
         return 0;
     }
 
-    if (nodeSearch(tree->root, value)) {
+    return (size_t)mapped->header->count;
+}
+
+/* Helper function: checks the mapped subtree at index, which must be the
+ * *next node in order, and returns its black depth as subtreeCheck does,
+ * or -1 if the subtree is invalid. Recursion depth is limited to
+ * MAX_DEPTH. */
+int mappedSubtreeCheck(struct RBMappedTree *mapped, uint64_t index, int parentRed,
+                       int depth, uint64_t *next) {
+    if (index == MAPPED_NONE) {
         return 1;
-    } else {
-        return 0;
     }
+    if (index >= mapped->header->count || depth == MAX_DEPTH) {
+        return -1;
+    }
+
+    const struct MappedNode *node = &mapped->nodes[index];
+    if (node->black > 1 || (parentRed && !node->black)) {
+        return -1;
+    }
+
+    int left = mappedSubtreeCheck(mapped, node->left, !node->black, depth + 1, next);
+    if (left == -1 || index != (*next)++) {
+        return -1;
+    }
+    if (index > 0 && mapped->nodes[index - 1].value >= node->value) {
+        return -1;
+    }
+    int right = mappedSubtreeCheck(mapped, node->right, !node->black, depth + 1, next);
+    if (right == -1 || right != left) {
+        return -1;
+    }
+
+    return left + (int)node->black;
 }
 
-/* Helper function */
-void leafDelete(struct RBTree *tree, struct RBNode *node) {
-    if (!tree || !node) {
-        return;
+int RBMappedCheck(struct RBMappedTree *mapped) {
+    if (!mapped) {
+        return -1;
     }
 
-    if (!node->parent) {
-        tree->root = NULL;
-        free(node);
-        return;
+    uint64_t root = mapped->header->root;
+    if (root != MAPPED_NONE && !mapped->nodes[root].black) {
+        return -1;
     }
 
-    if (node == node->parent->left) {
-        node->parent->left = NULL;
-    } else {
-        node->parent->right = NULL;
+    uint64_t next = 0;
+    if (mappedSubtreeCheck(mapped, root, 0, 0, &next) == -1 || next != mapped->header->count) {
+        return -1;
     }
 
-    free(node);
+    return 0;
 }
 
-/* Helper function: returns the predecessor of an input node. */
-struct RBNode *findPredecessor(struct RBNode *node) {
-    if (!node) {
+struct RBTree *RBMappedLoad(struct RBMappedTree *mapped) {
+    if (!mapped) {
         return NULL;
     }
 
-    struct RBNode *predecessor = node->left;
-    while (predecessor->right) {
-        predecessor = predecessor->right;
+    size_t count = (size_t)mapped->header->count;
+    int *keys = malloc((count > 0 ? count : 1) * sizeof(int));
+    if (!keys) {
+        return NULL;
     }
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = mapped->nodes[i].value;
+    }
+
+    struct RBTree *tree = RBBuildFromSorted(keys, count);
+    free(keys);
 
-    return predecessor;
+    return tree;
 }
 
-/* Helper function: returns the successor of an input node. */
-struct RBNode *findSuccessor(struct RBNode *node) {
-    if (!node) {
-        return NULL;
+void RBMappedClose(struct RBMappedTree *mapped) {
+    if (!mapped) {
+        return;
     }
 
-    struct RBNode *successor = node->right;
-    while (successor->left) {
-        successor = successor->left;
+    munmap(mapped->address, mapped->length);
+    free(mapped);
+}
+
+/* Size of the blocks a serialized tree is written in. */
+#define SERIAL_BLOCK 4096
+
+/* Most nodes reserved for a serialized tree before its keys are read. The
+ * count in the stream is not trusted any further, the nodes grow with the
+ * keys actually read. */
+#define SERIAL_RESERVE_NODES (1 << 16)
+
+/* Longest varint encoding of a 64-bit number. */
+#define VARINT_MAX 10
+
+/* State of RBSerialize, which collects encoded keys into a block and hands
+ * every full block to the writer, preceded by its length. */
+struct SerialWriter {
+    RBWriter write;
+    void *context;
+    unsigned char block[SERIAL_BLOCK];
+    size_t used;
+};
+
+/* Helper function: stores number in buffer as a varint, seven bits per byte
+ * starting with the lowest, and returns the number of bytes used. */
+size_t encodeVarint(unsigned char *buffer, uint64_t number) {
+    size_t length = 0;
+    while (number >= 0x80) {
+        buffer[length++] = (unsigned char)(number | 0x80);
+        number >>= 7;
     }
+    buffer[length++] = (unsigned char)number;
 
-    return successor;
+    return length;
 }
 
-/* Helper function: recursively moves the to be deleted value down to a leaf
- * by moving up the values of suitable predecessors and successors.
- * Returns the to be deleted leaf node. */
-struct RBNode *recursiveDelete(struct RBNode *node) {
-    if (!node) {
-        return NULL;
+/* Helper function: decodes the varint at the start of buffer[0, size) into
+ * number, returns the number of bytes read or 0 if the varint is cut off or
+ * longer than VARINT_MAX bytes. */
+size_t decodeVarint(const unsigned char *buffer, size_t size, uint64_t *number) {
+    uint64_t result = 0;
+    for (size_t i = 0; i < size && i < VARINT_MAX; i++) {
+        result |= (uint64_t)(buffer[i] & 0x7f) << (7 * i);
+        if (!(buffer[i] & 0x80)) {
+            *number = result;
+            return i + 1;
+        }
     }
 
-    if (!node->left && !node->right) {
-        return node;
-    } else if (!node->right) {
-        struct RBNode *predecessor = findPredecessor(node);
-        node->value = predecessor->value;
-        return recursiveDelete(predecessor);
-    } else {
-        struct RBNode *successor = findSuccessor(node);
-        node->value = successor->value;
-        return recursiveDelete(successor);
+    return 0;
+}
+
+/* Helper function: writes number as a varint on its own, returns 0 on
+ * success, -1 on failure. */
+int writeVarint(RBWriter write, void *context, uint64_t number) {
+    unsigned char buffer[VARINT_MAX];
+    return write(buffer, encodeVarint(buffer, number), context);
+}
+
+/* Helper function: reads a varint written by writeVarint one byte at a
+ * time, returns 0 on success, -1 on failure. */
+int readVarint(RBReader read, void *context, uint64_t *number) {
+    unsigned char buffer[VARINT_MAX];
+    for (size_t i = 0; i < VARINT_MAX; i++) {
+        if (read(&buffer[i], 1, context) == -1) {
+            return -1;
+        }
+        if (!(buffer[i] & 0x80)) {
+            return decodeVarint(buffer, i + 1, number) ? 0 : -1;
+        }
     }
+
+    return -1;
 }
 
-/* Helper function: returns the sibling of the input node. */
-struct RBNode *findSibling(struct RBNode *node) {
-    if (!node || !node->parent) {
-        return NULL;
+/* Helper function: hands the collected block to the writer, returns 0 on
+ * success, -1 on failure. */
+int flushBlock(struct SerialWriter *writer) {
+    if (writer->used == 0) {
+        return 0;
     }
 
-    if (node == node->parent->left) {
-        return node->parent->right;
-    } else {
-        return node->parent->left;
+    if (writeVarint(writer->write, writer->context, writer->used) == -1
+        || writer->write(writer->block, writer->used, writer->context) == -1) {
+        return -1;
     }
+    writer->used = 0;
+
+    return 0;
 }
 
-/* Helper function: returns the case code of the relevant case in deleteFixup.
- * Format of the case code is
- * R for red sibling,
- * RB for near child being red and far child being black,
- * BR for far child being red,
- * BB for two black children. */
-typedef enum {R, BB, RB, BR} CaseCode;
-CaseCode findCaseCode(struct RBNode *sibling) {
-    int isSiblingLeftChild;
-    if (sibling == sibling->parent->left) {
-        isSiblingLeftChild = 1;
-    } else {
-        isSiblingLeftChild = 0;
+/* Helper function: RBSerialize without taking the tree lock. */
+int treeSerialize(struct RBTree *tree, RBWriter write, void *context) {
+    if (!tree || tree->btree || tree->multiset || !write) {
+        return -1;
     }
 
-    if (sibling->color == RED) {
-        return R;
+    struct SerialWriter *writer = malloc(sizeof(struct SerialWriter));
+    if (!writer) {
+        return -1;
     }
+    writer->write = write;
+    writer->context = context;
+    writer->used = 0;
 
-    struct RBNode *nearChild = isSiblingLeftChild ? sibling->right : sibling->left;
-    struct RBNode *farChild = isSiblingLeftChild ? sibling->left : sibling->right;
-    if (nearChild && nearChild->color == RED) {
-        return RB;
+    int result = writeVarint(write, context, tree->count);
+
+    // the first key is zigzag encoded to keep small negative keys short,
+    // every later one is stored as its distance to the previous key minus
+    // one, which the ordering makes nonnegative
+    struct RBNode *previous = NULL;
+    for (struct RBNode *node = nodeFirst(tree->root); node && result == 0;
+         node = nodeNext(node)) {
+        uint64_t code;
+        if (previous) {
+            code = (unsigned int)node->value - (unsigned int)previous->value - 1u;
+        } else {
+            code = ((unsigned int)node->value << 1) ^ (node->value < 0 ? UINT_MAX : 0u);
+        }
+        previous = node;
+
+        if (SERIAL_BLOCK - writer->used < VARINT_MAX) {
+            result = flushBlock(writer);
+        }
+        writer->used += encodeVarint(&writer->block[writer->used], code);
     }
-    if (farChild && farChild->color == RED) {
-        return BR;
+    if (result == 0) {
+        result = flushBlock(writer);
     }
 
-    return BB;
+    free(writer);
+    return result;
 }
 
-/* Helper function */
-void siblingRedCase(struct RBTree *tree, struct RBNode *node, struct RBNode *sibling) {
-    sibling->color = BLACK;
-    node->parent->color = RED;
-    if (node == node->parent->left) {
-        leftRotate(tree, node->parent);
-    } else {
-        rightRotate(tree, node->parent);
-    }
-}
+int RBSerialize(struct RBTree *tree, RBWriter write, void *context) {
+    readLock(tree);
+    int result = treeSerialize(tree, write, context);
+    readUnlock(tree);
 
-/* Helper function */
-Color siblingBlackBlackChildrenCase(struct RBNode *node, struct RBNode *sibling) {
-    Color originalColor = node->parent->color;
-    node->parent->color = BLACK;
-    sibling->color = RED;
-    return originalColor;
+    return result;
 }
 
-/* Helper function */
-void siblingBlackNearChildRedCase(struct RBTree *tree, struct RBNode *node,
-                                  struct RBNode *sibling) {
-    if (node == node->parent->left) {
-        sibling->left->color = BLACK;
-        sibling->color = RED;
-        rightRotate(tree, sibling);
-    } else {
-        sibling->right->color = BLACK;
-        sibling->color = RED;
-        leftRotate(tree, sibling);
+/* Helper function: doubles the capacity of the only chunk of the pool, up to
+ * limit nodes, while its nodes hold values but no links yet. Returns 0 on
+ * success, -1 on failure. */
+int poolExtend(struct RBPool *pool, size_t limit) {
+    struct RBPoolChunk *chunk = pool->chunks;
+    size_t capacity = chunk->capacity > limit / 2 ? limit : 2 * chunk->capacity;
+    chunk = realloc(chunk, sizeof(struct RBPoolChunk) + capacity * sizeof(struct RBNode));
+    if (!chunk) {
+        return -1;
     }
-}
 
-/* Helper function */
-void siblingBlackFarChildRedCase(struct RBTree *tree, struct RBNode *node,
-                                 struct RBNode *sibling) {
-    sibling->color = node->parent->color;
-    node->parent->color = BLACK;
-    if (node == node->parent->left) {
-        sibling->right->color = BLACK;
-        leftRotate(tree, node->parent);
-    } else {
-        sibling->left->color = BLACK;
-        rightRotate(tree, node->parent);
-    }
+    chunk->capacity = capacity;
+    pool->chunks = chunk;
+
+    return 0;
 }
 
-/* Helper function: restores red-black properties after deletion. */
-void deleteFixup(struct RBTree *tree, struct RBNode *node) {
-    if (!tree || !node) {
-        return;
+/* Helper function: decodes the keys of a serialized tree into the values of
+ * the nodes of the only chunk of the pool, block by block, extending the
+ * chunk as it fills up to n nodes. Returns 0 on success, -1 on failure or
+ * when the keys are not strictly increasing. */
+int readKeys(RBReader read, void *context, struct RBPool *pool, size_t n) {
+    unsigned char *block = malloc(SERIAL_BLOCK);
+    if (!block) {
+        return -1;
     }
 
-    if (node->color == RED) {
-        return;
-    }
+    size_t i = 0;
+    while (i < n) {
+        uint64_t size;
+        if (readVarint(read, context, &size) == -1 || size == 0 || size > SERIAL_BLOCK
+            || read(block, (size_t)size, context) == -1) {
+            break;
+        }
 
-    struct RBNode *sibling = findSibling(node);
-    if (!sibling) {
-        return;
-    }
+        // keys never straddle blocks, so a block ends with a whole key
+        size_t position = 0;
+        while (position < size && i < n) {
+            uint64_t code;
+            size_t length = decodeVarint(&block[position], (size_t)size - position, &code);
+            if (length == 0 || code > UINT_MAX) {
+                break;
+            }
+            position += length;
 
-    CaseCode caseCode = findCaseCode(sibling);
-    switch (caseCode) {
-        case R:
-            siblingRedCase(tree, node, sibling);
-            deleteFixup(tree, node);
-            break;
-        case BB:
-            if (siblingBlackBlackChildrenCase(node, sibling) == BLACK) {
-                deleteFixup(tree, node->parent);
+            int64_t value;
+            if (i == 0) {
+                value = (int64_t)(code >> 1) ^ -(int64_t)(code & 1);
+            } else {
+                value = (int64_t)pool->chunks->nodes[i - 1].value + (int64_t)code + 1;
             }
+            if (value > INT_MAX || (i == pool->chunks->capacity && poolExtend(pool, n) == -1)) {
+                break;
+            }
+            pool->chunks->nodes[i++].value = (int)value;
+        }
+        if (position != size) {
             break;
-        case RB:
-            siblingBlackNearChildRedCase(tree, node, sibling);
-            deleteFixup(tree, node);
-            break;
-        case BR:
-            siblingBlackFarChildRedCase(tree, node, sibling);
-            break;
+        }
     }
+
+    free(block);
+    return i == n ? 0 : -1;
 }
 
-int RBDelete(struct RBTree *tree, int value) {
-    if (!tree) {
-        return -1;
+struct RBTree *RBDeserialize(RBReader read, void *context) {
+    if (!read) {
+        return NULL;
     }
 
-    struct RBNode *toRemoveNode = nodeSearch(tree->root, value);
-    if (!toRemoveNode) {
-        return 1;
+    uint64_t count;
+    if (readVarint(read, context, &count) == -1
+        || count > (SIZE_MAX - sizeof(struct RBPoolChunk)) / sizeof(struct RBNode)) {
+        return NULL;
+    }
+#ifdef RB_COMPACT_NODES
+    if (count > UINT_MAX) {
+        return NULL;
+    }
+#endif
+
+    size_t n = (size_t)count;
+    struct RBTree *tree = RBCreateWithCapacity(n < SERIAL_RESERVE_NODES ? n : SERIAL_RESERVE_NODES);
+    if (!tree) {
+        return NULL;
+    }
+    if (n > 0 && readKeys(read, context, tree->pool, n) == -1) {
+        RBFree(tree);
+        return NULL;
     }
 
-    toRemoveNode = recursiveDelete(toRemoveNode);
-    deleteFixup(tree, toRemoveNode);
-    leafDelete(tree, toRemoveNode);
+    buildTree(tree, NULL, n, 1);
 
-    return 0;
+    return tree;
 }
 
-/* Helper function */
-void nodePrint(struct RBNode *node) {
-    if (!node) {
+/* Read-only copy of the values of a tree in Eytzinger order: keys[1] is
+ * the root and keys[2k] and keys[2k + 1] are the children of keys[k], so
+ * a search follows computed indices instead of pointers. keys[0] is unused
+ * and the array is aligned to a cache line, which puts the 16 descendants
+ * four levels below keys[k] in one line starting at keys[16k]. */
+struct RBFrozen {
+    int *keys;
+    size_t count;
+};
+
+/* Number of ints in a cache line. */
+#define FROZEN_LINE_KEYS 16
+
+/* Helper function: stores the values of the in-order walk starting at
+ * *next in the implicit subtree at index k of keys[1, n], in order, and
+ * advances *next past them. Recursion depth is bounded by log2(n). */
+void frozenFill(int *keys, size_t n, size_t k, struct RBNode **next) {
+    if (k > n) {
         return;
     }
 
-    nodePrint(node->left);
-    printf("%d\n", node->value);
-    nodePrint(node->right);
+    frozenFill(keys, n, 2 * k, next);
+    keys[k] = (*next)->value;
+    *next = nodeNext(*next);
+    frozenFill(keys, n, 2 * k + 1, next);
 }
 
-void RBPrint(struct RBTree *tree) {
-    if (!tree) {
-        return;
+/* Helper function: returns the index of the first key of the frozen tree
+ * not smaller than value, or 0 when all keys are smaller. The descent has
+ * no branches on the keys: it records every comparison in the bits of k,
+ * and the last step to the right ends in the trailing ones of k. */
+size_t frozenBound(const struct RBFrozen *frozen, int value) {
+    const int *keys = frozen->keys;
+    size_t n = frozen->count;
+    size_t k = 1;
+    while (k <= n) {
+        PREFETCH(keys + FROZEN_LINE_KEYS * k);
+        k = 2 * k + (keys[k] < value);
     }
 
-    nodePrint(tree->root);
+    // the trailing ones of k are the steps to the right taken after the
+    // last step to the left, which left the bound
+    while (k & 1) {
+        k >>= 1;
+    }
 
-    return;
+    return k >> 1;
 }
 
-/* Helper function */
-int isBST(struct RBNode *root, struct RBNode *minNode, struct RBNode *maxNode) {
-    if (!root) {
-        return 1;
+struct RBFrozen *RBFreeze(struct RBTree *tree) {
+    if (!tree || tree->btree) {
+        return NULL;
     }
 
-    if (minNode && root->value < minNode->value) {
-        return 0;
+    struct RBFrozen *frozen = malloc(sizeof(struct RBFrozen));
+    if (!frozen) {
+        return NULL;
     }
-    if (maxNode && root->value > maxNode->value) {
-        return 0;
+
+    readLock(tree);
+    size_t n = tree->count;
+    size_t bytes = (n + 1) * sizeof(int);
+    bytes = (bytes + 63) / 64 * 64;
+    frozen->keys = aligned_alloc(64, bytes);
+    frozen->count = n;
+    if (frozen->keys) {
+        struct RBNode *next = nodeFirst(tree->root);
+        frozenFill(frozen->keys, n, 1, &next);
     }
+    readUnlock(tree);
 
-    return isBST(root->left, minNode, root) && isBST(root->right, root, maxNode);
+    if (!frozen->keys) {
+        free(frozen);
+        return NULL;
+    }
+
+    return frozen;
 }
 
-/* Helper function: returns -1 if double red property is violated,
- * 0 otherwise. */
-int doubleRedCheck(struct RBNode *node) {
-    if (!node) {
+int RBFrozenSearch(struct RBFrozen *frozen, int value) {
+    if (!frozen) {
         return 0;
     }
 
-    if (node->color == RED && node->parent && node->parent->color == RED) {
-        return -1;
-    }
-
-    return doubleRedCheck(node->left) && doubleRedCheck(node->right);
+    size_t k = frozenBound(frozen, value);
+    return k != 0 && frozen->keys[k] == value;
 }
 
-/* Helper function: returns black depth of subtree rooted at node
- * or -1 if red-black property is violated. */
-int blackDepthCheck(struct RBNode *node) {
-    if (!node) {
-        return 1;
+int RBFrozenLowerBound(struct RBFrozen *frozen, int value, int *result) {
+    if (!frozen) {
+        return 0;
     }
 
-    int left = blackDepthCheck(node->left);
-    int right = blackDepthCheck(node->right);
+    size_t k = frozenBound(frozen, value);
+    if (k == 0) {
+        return 0;
+    }
 
-    if (left == -1 || right == -1) {
-        return -1;
+    if (result) {
+        *result = frozen->keys[k];
     }
+    return 1;
+}
 
-    if (left != right) {
-        return -1;
+#ifdef __AVX2__
+/* Helper function: searches eight keys at once, one per AVX2 lane, with
+ * the branch-free descent of frozenBound. Lanes whose index has left the
+ * tree keep it while the others finish the last level. The frozen tree
+ * must hold fewer than 2^30 values for the indices to fit in 32 bits. */
+void frozenSearch8(const struct RBFrozen *frozen, const int *keys, unsigned char *found) {
+    __m256i needles = _mm256_loadu_si256((const __m256i *)keys);
+    __m256i end = _mm256_set1_epi32((int)frozen->count + 1);
+    __m256i k = _mm256_set1_epi32(1);
+
+    for (size_t level = frozen->count; level > 0; level >>= 1) {
+        __m256i active = _mm256_cmpgt_epi32(end, k);
+        __m256i values = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), frozen->keys,
+                                                     k, active, 4);
+        __m256i smaller = _mm256_cmpgt_epi32(needles, values);
+        __m256i next = _mm256_sub_epi32(_mm256_add_epi32(k, k), smaller);
+        k = _mm256_blendv_epi8(k, next, active);
     }
 
-    if (node->color == BLACK) {
-        return ++left;
-    } else {
-        return left;
+    int indices[8];
+    _mm256_storeu_si256((__m256i *)indices, k);
+    for (int lane = 0; lane < 8; lane++) {
+        size_t index = (size_t)indices[lane];
+        while (index & 1) {
+            index >>= 1;
+        }
+        index >>= 1;
+        found[lane] = (unsigned char)(index != 0 && frozen->keys[index] == keys[lane]);
     }
 }
+#endif
 
-int RBCheck(struct RBTree *tree) {
-    if (!tree) {
+int RBFrozenSearchBatch(struct RBFrozen *frozen, const int *keys, size_t n,
+                        unsigned char *found) {
+    if (!frozen || ((!keys || !found) && n > 0)) {
         return -1;
     }
 
-    if (!tree->root) {
-        return 0;
+    size_t i = 0;
+#ifdef __AVX2__
+    if (frozen->count < ((size_t)1 << 30)) {
+        for (; i + 8 <= n; i += 8) {
+            frozenSearch8(frozen, &keys[i], &found[i]);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        found[i] = (unsigned char)RBFrozenSearch(frozen, keys[i]);
     }
 
-    if (!isBST(tree->root, NULL, NULL)) {
-        return -1;
+    return 0;
+}
+
+size_t RBFrozenSize(struct RBFrozen *frozen) {
+    if (!frozen) {
+        return 0;
     }
 
-    if (tree->root->color != BLACK) {
-        return -1;
+    return frozen->count;
+}
+
+void RBFrozenFree(struct RBFrozen *frozen) {
+    if (!frozen) {
+        return;
     }
-    if (doubleRedCheck(tree->root) == -1) {
-        return -1;
+
+    free(frozen->keys);
+    free(frozen);
+}
+
+/* Helper function: returns the bytes of the chunks of pool and of the pools
+ * it links. The caller holds poolLinkMutex. */
+size_t poolBytes(struct RBPool *pool) {
+    size_t bytes = sizeof(struct RBPool);
+    int locked = poolLock(pool);
+    for (struct RBPoolChunk *chunk = pool->chunks; chunk; chunk = chunk->next) {
+        bytes += sizeof(struct RBPoolChunk) + chunk->capacity * sizeof(struct RBNode);
     }
-    if (blackDepthCheck(tree->root) == -1) {
-        return -1;
+    poolUnlock(pool, locked);
+
+    for (struct RBPoolLink *link = pool->links; link; link = link->next) {
+        bytes += sizeof(struct RBPoolLink) + poolBytes(link->pool);
     }
 
-    return 0;
+    return bytes;
 }
 
-/* Helper function: calls itself on all subsequent nodes recursively
- * and frees node. */
-void nodeFree(struct RBNode *node) {
-    if (!node) {
-        return;
+int RBGetStats(struct RBTree *tree, struct RBStats *stats) {
+    if (!tree || !stats) {
+        return -1;
     }
 
-    nodeFree(node->left);
-    nodeFree(node->right);
+    memset(stats, 0, sizeof(struct RBStats));
+    readLock(tree);
+#ifdef RB_STATS
+    const struct TreeStats *counters = &tree->stats;
+    stats->inserts = counters->inserts;
+    stats->duplicates = counters->duplicates;
+    stats->deletes = counters->deletes;
+    stats->deleteMisses = counters->deleteMisses;
+    stats->rotations = counters->rotations;
+    stats->recolorings = counters->recolorings;
+    stats->insertUncleRed = counters->insertUncleRed;
+    stats->insertTriangle = counters->insertTriangle;
+    stats->insertLine = counters->insertLine;
+    stats->deleteSiblingRed = counters->deleteSiblingRed;
+    stats->deleteBlackChildren = counters->deleteBlackChildren;
+    stats->deleteNearChildRed = counters->deleteNearChildRed;
+    stats->deleteFarChildRed = counters->deleteFarChildRed;
+    stats->searches = atomic_load_explicit(&counters->searches, memory_order_relaxed);
+    stats->searchMisses = atomic_load_explicit(&counters->searchMisses, memory_order_relaxed);
+    size_t depth = atomic_load_explicit(&counters->searchDepth, memory_order_relaxed);
+    stats->averageSearchDepth = stats->searches ? (double)depth / (double)stats->searches : 0;
+    stats->maxSearchDepth = atomic_load_explicit(&counters->maxSearchDepth,
+                                                 memory_order_relaxed);
+#endif
+
+    stats->nodes = tree->btree ? BTreeSize(tree->btree) : tree->count;
+    stats->sharedNodes = tree->sharedNodes;
+    pthread_mutex_lock(&poolLinkMutex);
+    stats->bytes = sizeof(struct RBTree) + poolBytes(tree->pool);
+    pthread_mutex_unlock(&poolLinkMutex);
+    if (tree->lock) {
+        stats->bytes += sizeof(struct RBLock);
+    }
+    if (tree->btree) {
+        stats->bytes += BTreeBytes(tree->btree);
+    }
+    readUnlock(tree);
 
-    free(node);
+    return 0;
 }
 
 void RBFree(struct RBTree *tree) {
@@ -578,6 +4650,5 @@ void RBFree(struct RBTree *tree) {
         return;
     }
 
-    nodeFree(tree->root);
-    free(tree);
+    treeDiscard(tree);
 }
@@ -2,17 +2,109 @@
  * Date of Creation: 23/12/2023
  * Header file for a red-black binary search tree datastructure.
  * Structure is naturally ordered, i.e. min to max order.
- * Structure can only contain unique values of type int. */
+ * Structure contains values of type int, each at most once, except in
+ * multisets created with RBCreateMultiset, which count repeated values. */
 
 #ifndef RBTREE_H
 #define RBTREE_H
 
+#include <stddef.h>
+
 struct RBTree;
+struct RBNode;
+struct RBSnapshot;
+struct RBMappedTree;
+struct RBFrozen;
+
+/* Cursor over the values of a tree in order. An iterator either points at
+ * a value or is past the end of the tree. It stays valid across
+ * insertions and deletions of other values, but not across a deletion of
+ * the value it points at. */
+struct RBIter {
+    struct RBTree *tree;
+    struct RBNode *node;
+    /* Position in a tree created with RBCreateBTree, which has no nodes to
+     * point at: the value and whether the iterator points at it. */
+    int value;
+    int atValue;
+};
+
+/* Callback invoked on values in order, return 0 to continue the walk or
+ * nonzero to stop it. */
+typedef int (*RBVisitor)(int value, void *context);
+
+/* Callback invoked on values in order together with the number of times
+ * they are in the tree, return 0 to continue the walk or nonzero to stop
+ * it. */
+typedef int (*RBCountVisitor)(int value, size_t count, void *context);
 
 /* Create a new red-black tree, return a pointer to the tree
  * on success, NULL on failure. */
 struct RBTree *RBCreate(void);
 
+/* Create a new red-black tree with room for capacity nodes allocated
+ * up front, so the first capacity insertions do not allocate.
+ * Return a pointer to the tree on success, NULL on failure. */
+struct RBTree *RBCreateWithCapacity(size_t capacity);
+
+/* Create a new tree that keeps its values in a B-tree of wide sorted nodes
+ * instead of a red-black tree, which suits large read-mostly sets. Return
+ * a pointer to the tree on success, NULL on failure. The tree supports
+ * RBInsert, RBSearch, RBDelete, the batched and prefetching searches,
+ * RBSize, RBCheck, RBMakeConcurrent, RBFree, iterators, ranges, RBPrint,
+ * RBRank and RBSelect, the last two in linear time as the nodes keep no
+ * subtree sizes. RBRangeCount walks its range instead, in time logarithmic
+ * plus the number of values counted. Other modifications, as well as snapshots, freezing,
+ * saving and serializing, fail on it. */
+struct RBTree *RBCreateBTree(void);
+
+/* Create a new red-black tree that counts how many times each value was
+ * inserted instead of discarding duplicates, keeping one node per distinct
+ * value. Return a pointer to the tree on success, NULL on failure or when
+ * RB_MULTISET (`make multiset`) is not defined. Inserting a present value
+ * increments its count and returns 1, deleting a value decrements its
+ * count and only unlinks its node at zero. RBSize, RBRank, RBSelect,
+ * RBRangeCount, snapshots and frozen copies count each distinct value
+ * once, while RBCount, RBIterCount and RBRangeCounts report the counts.
+ * Set operations, RBJoin with a regular tree, saving and serializing fail
+ * on it. */
+struct RBTree *RBCreateMultiset(void);
+
+/* Create a new red-black tree that may be used from several threads at
+ * once, return a pointer to the tree on success, NULL on failure.
+ * Modifications take an internal write lock and queries take its read
+ * lock, except RBSearch, which first tries to complete without any lock and
+ * only retries under the read lock when a modification overlapped it.
+ * Iterators and RBRangeFill are not covered, hold RBReadLock around them. */
+struct RBTree *RBCreateConcurrent(void);
+
+/* Make an existing tree, e.g. one made by RBBuildFromSorted, concurrent as
+ * if it was created by RBCreateConcurrent. This must happen before the tree
+ * is shared between threads. Return 0 on success, -1 on failure. */
+int RBMakeConcurrent(struct RBTree *tree);
+
+/* Take the read lock of a concurrent tree, so that iterators can be used
+ * while other threads modify it. Does nothing for other trees. */
+void RBReadLock(struct RBTree *tree);
+
+/* Release the read lock taken by RBReadLock. */
+void RBReadUnlock(struct RBTree *tree);
+
+/* Create a balanced red-black tree holding the n values of keys, which must
+ * be strictly increasing, in O(n) without rotations. All nodes are allocated
+ * in one block. Return a pointer to the tree on success, NULL on failure or
+ * when keys is not strictly increasing. */
+struct RBTree *RBBuildFromSorted(const int *keys, size_t n);
+
+/* RBBuildFromSorted, building the subtrees of large inputs on up to threads
+ * threads in total. */
+struct RBTree *RBBuildFromSortedParallel(const int *keys, size_t n, unsigned threads);
+
+/* Create a balanced red-black tree holding the distinct values among the n
+ * values of keys, which may be in any order and contain duplicates.
+ * Return a pointer to the tree on success, NULL on failure. */
+struct RBTree *RBBuildFromUnsorted(const int *keys, size_t n);
+
 /* Insert a value into the tree, return 0 on success, -1 on failure.
  * If the data is already present in the tree, leave the tree unchanged
  * and return 1. */
@@ -22,19 +114,346 @@ int RBInsert(struct RBTree *tree, int value);
  * or 0 when the value is not found. */
 int RBSearch(struct RBTree *tree, int value);
 
+/* Search like RBSearch, but prefetch both children of every visited node
+ * while comparing it. Meant for trees that do not fit in cache. */
+int RBSearchPrefetch(struct RBTree *tree, int value);
+
 /* Delete a value from the tree, return 0 on success, -1 on failure.
  * If the data is not present in the tree, leave the tree unchanged
  * and return 1. */
 int RBDelete(struct RBTree *tree, int value);
 
+/* RBInsert and RBDelete in a single pass from the root down: nodes are
+ * recolored and rotated on the way to the value, so that the insertion or
+ * deletion at the end needs at most a rotation there instead of a fixup
+ * back up the path. A duplicate or absent value leaves the values of the
+ * tree unchanged, but may rebalance its path, and walks back up to restore
+ * the subtree sizes. Both mix freely with their bottom-up counterparts. */
+int RBInsertTopDown(struct RBTree *tree, int value);
+int RBDeleteTopDown(struct RBTree *tree, int value);
+
+/* Insert like RBInsert and store a handle to the node holding value in
+ * node, also when value was already present. Nodes are never moved or
+ * reused while they hold their value, so a handle stays valid until its
+ * value is deleted or the tree is freed. RBJoin and RBSplit keep nodes
+ * in place, handing them to the tree that ends up holding their value.
+ * Return 0, 1 or -1 as RBInsert, storing NULL on failure. Fail on trees
+ * created with RBCreateBTree. */
+int RBInsertGetNode(struct RBTree *tree, int value, struct RBNode **node);
+
+/* Return a handle to the node holding value, NULL when the value is not
+ * present or the tree was created with RBCreateBTree. */
+struct RBNode *RBFind(struct RBTree *tree, int value);
+
+/* Return the value held by a node handle. */
+int RBNodeValue(const struct RBNode *node);
+
+/* Delete the node behind a handle from the tree without searching for its
+ * value, return 0 on success, -1 on failure. The handle must belong to
+ * tree and is invalid afterwards, unless the tree is a multiset and the
+ * value was counted more than once, which only decrements the count. */
+int RBDeleteNode(struct RBTree *tree, struct RBNode *node);
+
+/* Return the number of times value is in the tree: its count in a
+ * multiset, 1 or 0 in other trees. */
+size_t RBCount(struct RBTree *tree, int value);
+
+/* Insert the n values of keys into the tree. The batch is sorted first so
+ * that each insertion resumes from the previous one instead of descending
+ * from the root. Duplicates, whether already in the tree or repeated in the
+ * batch, are skipped, except in a multiset, where each of them increments
+ * the count of its value as RBInsert does. Store the number of values that
+ * were new to the tree in inserted when it is not NULL, which in a multiset
+ * counts each newly added distinct value once and none of the increments.
+ * Return 0 on success, -1 on failure, in which case the values counted in
+ * inserted are in the tree. */
+int RBInsertBatch(struct RBTree *tree, const int *keys, size_t n, size_t *inserted);
+
+/* Search for the n values of keys and set found[i] to 1 when keys[i] is
+ * present or to 0 when it is not. The batch is sorted and searched as
+ * several interleaved lookups that each resume from their previous key.
+ * Return 0 on success, -1 on failure. */
+int RBSearchBatch(struct RBTree *tree, const int *keys, size_t n, unsigned char *found);
+
+/* Search for the n values of keys in the given order and set found[i] to 1
+ * when keys[i] is present or to 0 when it is not. Several independent
+ * lookups advance in lock-step with prefetching, so that their cache misses
+ * overlap. Return 0 on success, -1 on failure. */
+int RBSearchMulti(struct RBTree *tree, const int *keys, size_t n, unsigned char *found);
+
+/* Delete the n values of keys from the tree, skipping values that are not
+ * present. In a multiset each key decrements the count of its value as
+ * RBDelete does. Store the number of keys that deleted a value or
+ * decremented its count in deleted when it is not NULL. Return 0 on
+ * success, -1 on failure. */
+int RBDeleteBatch(struct RBTree *tree, const int *keys, size_t n, size_t *deleted);
+
 /* Print the tree in order, return 0 on success, -1 on failure. */
 void RBPrint(struct RBTree *tree);
 
-/* Check if the tree is a valid red-black tree, return 0 on success,
+/* Position the iterator at the smallest value in the tree, return 1 when
+ * the iterator points at a value or 0 when the tree is empty. */
+int RBIterFirst(struct RBTree *tree, struct RBIter *iter);
+
+/* Position the iterator at the largest value in the tree, return 1 when
+ * the iterator points at a value or 0 when the tree is empty. */
+int RBIterLast(struct RBTree *tree, struct RBIter *iter);
+
+/* Advance the iterator to the next larger value, return 1 when the iterator
+ * points at a value or 0 when it moved past the end. */
+int RBIterNext(struct RBIter *iter);
+
+/* Move the iterator to the next smaller value, return 1 when the iterator
+ * points at a value or 0 when there is none. An iterator that is past the
+ * end moves to the largest value. */
+int RBIterPrev(struct RBIter *iter);
+
+/* Return the value the iterator points at. The iterator must point at
+ * a value. */
+int RBIterValue(const struct RBIter *iter);
+
+/* Return the number of times the value the iterator points at is in the
+ * tree, which is 1 outside multisets. The iterator must point at a
+ * value. */
+size_t RBIterCount(const struct RBIter *iter);
+
+/* Position the iterator at the smallest value greater than or equal to
+ * value, return 1 when the iterator points at a value or 0 when there is
+ * none. */
+int RBLowerBound(struct RBTree *tree, int value, struct RBIter *iter);
+
+/* Position the iterator at the smallest value strictly greater than value,
+ * return 1 when the iterator points at a value or 0 when there is none. */
+int RBUpperBound(struct RBTree *tree, int value, struct RBIter *iter);
+
+/* Call visit with context on every value in [lo, hi) in order.
+ * Return 0 when the whole range was visited, 1 when visit stopped the walk
+ * early and -1 on failure. */
+int RBRange(struct RBTree *tree, int lo, int hi, RBVisitor visit, void *context);
+
+/* RBRange calling visit with the count of every value as well. */
+int RBRangeCounts(struct RBTree *tree, int lo, int hi, RBCountVisitor visit, void *context);
+
+/* Copy up to capacity values that are smaller than hi into buffer, starting
+ * at the value the iterator points at, and return the number of values
+ * copied. The iterator is left at the first value not copied, so positioning
+ * it with RBLowerBound(tree, lo, iter) and calling this until it returns
+ * less than capacity delivers [lo, hi) in batches. */
+size_t RBRangeFill(struct RBIter *iter, int hi, int *buffer, size_t capacity);
+
+/* Return the number of values in [lo, hi). */
+size_t RBRangeCount(struct RBTree *tree, int lo, int hi);
+
+/* Return the number of values in the tree. */
+size_t RBSize(struct RBTree *tree);
+
+/* Return the number of values in the tree that are smaller than value,
+ * which is the position value has or would have in sorted order. */
+size_t RBRank(struct RBTree *tree, int value);
+
+/* Store the k-th smallest value, counting from 0, in value.
+ * Return 0 on success, -1 on failure or when the tree holds no more
+ * than k values. */
+int RBSelect(struct RBTree *tree, size_t k, int *value);
+
+/* Join t1, the value pivot and t2 into one tree, where every value of t1
+ * must be smaller than pivot and every value of t2 greater. Both trees are
+ * consumed without copying their nodes: t1 is returned holding all values
+ * and t2 is freed. Runs in O(log n). Return NULL on failure or when the
+ * values are out of order, leaving both trees unchanged. */
+struct RBTree *RBJoin(struct RBTree *t1, int pivot, struct RBTree *t2);
+
+/* Split the tree into *lo, holding the values smaller than key, and *hi,
+ * holding key and the greater values, in O(log n), or O(n) without order
+ * statistics. The tree itself becomes *lo. Return 0 on success, -1 on
+ * failure, in which case the tree is unchanged. */
+int RBSplit(struct RBTree *tree, int key, struct RBTree **lo, struct RBTree **hi);
+
+/* Set operations on t1 and t2 in O(m log(n/m + 1)) for sizes m <= n. Both
+ * trees are consumed: their nodes are reused for the result, which is
+ * returned in t1, while t2 is freed. Return NULL on failure, leaving both
+ * trees unchanged. RBUnion keeps the values of either tree, RBIntersect
+ * those of both and RBDifference those of t1 missing from t2. */
+struct RBTree *RBUnion(struct RBTree *t1, struct RBTree *t2);
+struct RBTree *RBIntersect(struct RBTree *t1, struct RBTree *t2);
+struct RBTree *RBDifference(struct RBTree *t1, struct RBTree *t2);
+
+/* Set operations as above, forking the independent halves of large inputs
+ * to up to threads threads in total. */
+struct RBTree *RBUnionParallel(struct RBTree *t1, struct RBTree *t2, unsigned threads);
+struct RBTree *RBIntersectParallel(struct RBTree *t1, struct RBTree *t2, unsigned threads);
+struct RBTree *RBDifferenceParallel(struct RBTree *t1, struct RBTree *t2, unsigned threads);
+
+/* Take a read-only snapshot of the values currently in the tree, return a
+ * pointer to the snapshot on success, NULL on failure. The first snapshot
+ * builds a persistent copy of the values in O(n), later ones are O(1). From
+ * then on every insertion or deletion copies only the O(log n) path it
+ * changes, sharing the other nodes with the snapshots, while joins, splits
+ * and set operations drop the copy for the next snapshot to build again.
+ * Snapshots stay valid after the tree is freed. */
+struct RBSnapshot *RBSnapshot(struct RBTree *tree);
+
+/* Search for a value in the snapshot, return 1 when the value is present
+ * or 0 when the value is not found. */
+int RBSnapshotSearch(struct RBSnapshot *snapshot, int value);
+
+/* Return the number of values in the snapshot. */
+size_t RBSnapshotSize(struct RBSnapshot *snapshot);
+
+/* Call visit with context on every value of the snapshot in [lo, hi) in
+ * order. Return 0 when the whole range was visited, 1 when visit stopped
+ * the walk early and -1 on failure. */
+int RBSnapshotRange(struct RBSnapshot *snapshot, int lo, int hi,
+                    RBVisitor visit, void *context);
+
+/* Free the snapshot. */
+void RBSnapshotFree(struct RBSnapshot *snapshot);
+
+/* Save the tree to the file at path, return 0 on success, -1 on failure.
+ * Nodes are stored in key order and link to their children by index, so
+ * the file can be mapped and searched as is. The file uses the byte order
+ * of the machine that saved it. */
+int RBSave(struct RBTree *tree, const char *path);
+
+/* Map a tree saved with RBSave into memory without reading its nodes, so
+ * opening takes O(1) regardless of size. Return a pointer to the mapped
+ * tree on success, NULL on failure or when the file is not a saved tree.
+ * Only the header is verified, RBMappedCheck verifies the nodes. */
+struct RBMappedTree *RBOpenMapped(const char *path);
+
+/* Search for a value in the mapped tree, return 1 when the value is
+ * present or 0 when the value is not found. */
+int RBMappedSearch(struct RBMappedTree *mapped, int value);
+
+/* Return the number of values in the mapped tree. */
+size_t RBMappedSize(struct RBMappedTree *mapped);
+
+/* Check if the mapped tree is a valid red-black tree stored in key order,
+ * return 0 on success, -1 on failure. */
+int RBMappedCheck(struct RBMappedTree *mapped);
+
+/* Create a regular tree holding the values of the mapped tree in O(n),
+ * which can then be modified. Return a pointer to the tree on success,
+ * NULL on failure or when the mapped values are out of order. */
+struct RBTree *RBMappedLoad(struct RBMappedTree *mapped);
+
+/* Unmap and free the mapped tree. */
+void RBMappedClose(struct RBMappedTree *mapped);
+
+/* Make a read-only copy of the values of the tree in Eytzinger order, the
+ * breadth-first order of a complete binary tree, in O(n). Searching the
+ * copy follows computed indices without branching on the values and
+ * prefetches four levels ahead. Return a pointer to the frozen tree on
+ * success, NULL on failure. The copy is independent of the tree. */
+struct RBFrozen *RBFreeze(struct RBTree *tree);
+
+/* Search for a value in the frozen tree, return 1 when the value is
+ * present or 0 when the value is not found. */
+int RBFrozenSearch(struct RBFrozen *frozen, int value);
+
+/* Store the smallest value of the frozen tree not smaller than value in
+ * result, return 1 when there is one or 0 when all values are smaller. */
+int RBFrozenLowerBound(struct RBFrozen *frozen, int value, int *result);
+
+/* Search for each of the n keys in the frozen tree and set found[i] to 1
+ * or 0 like RBFrozenSearch. With AVX2 eight keys descend at once. Return 0
+ * on success, -1 on failure. */
+int RBFrozenSearchBatch(struct RBFrozen *frozen, const int *keys, size_t n,
+                        unsigned char *found);
+
+/* Return the number of values in the frozen tree. */
+size_t RBFrozenSize(struct RBFrozen *frozen);
+
+/* Free the frozen tree. */
+void RBFrozenFree(struct RBFrozen *frozen);
+
+/* Callback receiving the next size bytes of a serialized tree, return 0 on
+ * success or -1 on failure. */
+typedef int (*RBWriter)(const void *data, size_t size, void *context);
+
+/* Callback storing the next size bytes of a serialized tree in data, return
+ * 0 on success or -1 on failure, including when fewer bytes are left. */
+typedef int (*RBReader)(void *data, size_t size, void *context);
+
+/* Serialize the values of the tree through write, called with context, and
+ * return 0 on success, -1 on failure. Values are written in order as
+ * varints of the distances between them, in blocks of a few kilobytes, so
+ * dense trees take little more than a byte per value. */
+int RBSerialize(struct RBTree *tree, RBWriter write, void *context);
+
+/* Create a tree from values serialized with RBSerialize, reading them
+ * through read, called with context, directly into the nodes of a sorted
+ * build. The nodes grow with the values read, so a corrupt count cannot
+ * reserve more than a bounded amount of memory up front. Exactly the
+ * serialized bytes are read. Return a pointer to the tree on success, NULL
+ * on failure or when the data is corrupt. */
+struct RBTree *RBDeserialize(RBReader read, void *context);
+
+/* Counters and metrics of a tree, filled in by RBGetStats. Only nodes,
+ * bytes and sharedNodes are kept by default; the other fields are counted when RBTree.c is
+ * compiled with RB_STATS and read zero otherwise. */
+struct RBStats {
+    /* Successful insertions and deletions, and those that found the value
+     * already present or missing, including batches. */
+    size_t inserts;
+    size_t duplicates;
+    size_t deletes;
+    size_t deleteMisses;
+    /* Single-value searches, i.e. calls of RBSearch, RBSearchPrefetch,
+     * RBFind and RBCount, and those that did not find their value. The
+     * batched RBSearchBatch and RBSearchMulti are not counted, nor are
+     * the descents of modifications. */
+    size_t searches;
+    size_t searchMisses;
+    /* Rebalancing work: rotations, color changes and the steps of the
+     * insert fixup (red uncle, triangle and line case) and of the delete
+     * fixup (red sibling, black sibling with black children, with a red
+     * near child and with a red far child). */
+    size_t rotations;
+    size_t recolorings;
+    size_t insertUncleRed;
+    size_t insertTriangle;
+    size_t insertLine;
+    size_t deleteSiblingRed;
+    size_t deleteBlackChildren;
+    size_t deleteNearChildRed;
+    size_t deleteFarChildRed;
+    /* Nodes visited per counted search, which B-tree trees leave at
+     * zero. */
+    double averageSearchDepth;
+    size_t maxSearchDepth;
+    /* Number of values and bytes allocated for the tree, including the
+     * pool it may share with trees split from or joined into it. */
+    size_t nodes;
+    size_t bytes;
+    /* Nodes allocated for the persistent copy that snapshots share with
+     * the tree: all of them when a snapshot builds it, then the path each
+     * later modification copies. */
+    size_t sharedNodes;
+};
+
+/* Store the counters and metrics of the tree in stats, return 0 on success,
  * -1 on failure. */
+int RBGetStats(struct RBTree *tree, struct RBStats *stats);
+
+/* Check if the tree is a valid red-black tree, visiting every node once,
+ * return 0 on success, -1 on failure. */
 int RBCheck(struct RBTree *tree);
 
-/* Free the tree and all of its nodes. */
+/* RBCheck, checking the subtrees of large trees on up to threads threads in
+ * total. */
+int RBCheckParallel(struct RBTree *tree, unsigned threads);
+
+/* Check the tree around the value inserted or deleted last: the nodes on
+ * the path from that node, or the parent of the deleted node, up to the
+ * root, and their children. Return 0 on success, -1 on failure. This takes
+ * O(log^2 n), so it can run after every modification where RBCheck cannot,
+ * but only catches damage near that path. After other modifications only
+ * the root is checked, and B-tree trees are not checked at all. */
+int RBCheckLocal(struct RBTree *tree);
+
+/* Free the tree and all of its nodes. Nodes are released per pool chunk,
+ * not per node, once no tree split or joined from this one uses them. */
 void RBFree(struct RBTree *tree);
 
 #endif /* RBTREE_H */
@@ -0,0 +1,1113 @@
+/* Benchmark suite for the tree, built apart from the tests by `make bench`
+ * with optimizations and without sanitizers. Every workload runs on every
+ * key distribution, tree size and hit ratio in a child process of its own,
+ * and reports one row of throughput, latency percentiles and peak resident
+ * memory as CSV or JSON on stdout. With -c it instead runs the feature
+ * benchmarks, which compare search modes, backends, insertion and deletion
+ * strategies, concurrency and bulk operations in readable lines.
+ *
+ * Usage: bench [-f csv|json] [-n max size] [-b rbtree|btree] [-c] */
+
+#define _DEFAULT_SOURCE
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "RBTree.h"
+
+/* Fewest timed operations per row, small trees repeat their workload until
+ * they reach it so that the 99.9th percentile rests on enough samples. */
+#define MIN_OPS 100000
+
+/* Exponent of the Zipfian distribution, the one YCSB uses. */
+#define ZIPF_EXPONENT 0.99
+
+enum Workload { INSERT, SEARCH, DELETE, MIXED };
+enum Distribution { SEQUENTIAL, REVERSE, UNIFORM, ZIPFIAN };
+
+static const char *workloadNames[] = {"insert", "search", "delete", "mixed"};
+static const char *distributionNames[] = {"sequential", "reverse", "uniform", "zipfian"};
+
+struct Case {
+    enum Workload workload;
+    enum Distribution distribution;
+    size_t size;
+    /* Percentage of searches asking for a value in the tree. */
+    int hitRatio;
+    int btree;
+    int json;
+};
+
+/* Source of the indices of the keys a workload touches, out of size keys. */
+struct KeyStream {
+    enum Distribution distribution;
+    size_t size;
+    size_t next;
+    uint64_t random;
+    /* Cumulative probabilities of the Zipfian ranks, NULL otherwise. */
+    double *zipf;
+};
+
+/* Helper function: returns the next value of a xorshift64* generator. */
+uint64_t nextRandom(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+/* Helper function: returns the monotonic time in nanoseconds. */
+uint64_t nowNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+/* Helper function: prepares stream to draw indices below size in the order
+ * of distribution, return 0 on success, -1 on failure. */
+int streamInit(struct KeyStream *stream, enum Distribution distribution, size_t size,
+               uint64_t seed) {
+    stream->distribution = distribution;
+    stream->size = size;
+    stream->next = 0;
+    stream->random = seed;
+    stream->zipf = NULL;
+    if (distribution != ZIPFIAN) {
+        return 0;
+    }
+
+    stream->zipf = malloc(sizeof(double) * size);
+    if (!stream->zipf) {
+        return -1;
+    }
+
+    double sum = 0;
+    for (size_t rank = 0; rank < size; rank++) {
+        sum += 1 / pow((double)(rank + 1), ZIPF_EXPONENT);
+        stream->zipf[rank] = sum;
+    }
+    for (size_t rank = 0; rank < size; rank++) {
+        stream->zipf[rank] /= sum;
+    }
+
+    return 0;
+}
+
+/* Helper function: returns the next index of stream. */
+size_t streamNext(struct KeyStream *stream) {
+    size_t size = stream->size;
+    switch (stream->distribution) {
+    case SEQUENTIAL:
+        return stream->next++ % size;
+    case REVERSE:
+        return size - 1 - stream->next++ % size;
+    case UNIFORM:
+        return nextRandom(&stream->random) % size;
+    case ZIPFIAN: {
+        double draw = (double)(nextRandom(&stream->random) >> 11) / (double)(1ULL << 53);
+        size_t low = 0;
+        size_t high = size - 1;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (stream->zipf[middle] < draw) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+
+        // scatter the ranks over the keys, or the hot keys would all share
+        // the leftmost path of the tree
+        return (size_t)((low * 2654435761ULL) % size);
+    }
+    }
+
+    return 0;
+}
+
+/* Helper function: fills tree with the even keys 0 to 2 * (size - 1), return
+ * the tree on success, NULL on failure. Values are even so that odd keys
+ * always miss. */
+struct RBTree *benchTree(const struct Case *c) {
+    if (!c->btree) {
+        int *keys = malloc(sizeof(int) * c->size);
+        if (!keys) {
+            return NULL;
+        }
+        for (size_t i = 0; i < c->size; i++) {
+            keys[i] = (int)(2 * i);
+        }
+
+        struct RBTree *tree = RBBuildFromSorted(keys, c->size);
+        free(keys);
+        return tree;
+    }
+
+    struct RBTree *tree = RBCreateBTree();
+    for (size_t i = 0; tree && i < c->size; i++) {
+        if (RBInsert(tree, (int)(2 * i)) == -1) {
+            RBFree(tree);
+            return NULL;
+        }
+    }
+
+    return tree;
+}
+
+/* Helper function: returns the key of index for a search, odd for the
+ * requested share of misses. */
+int searchKey(struct KeyStream *stream, size_t index, int hitRatio) {
+    int miss = (int)(nextRandom(&stream->random) % 100) >= hitRatio;
+    return (int)(2 * index) + miss;
+}
+
+/* Helper function: draws the keys of one pass of c over a tree from stream
+ * into keys and returns their number. */
+size_t drawKeys(const struct Case *c, struct KeyStream *stream, int *keys) {
+    // sequential and reverse streams restart with every tree
+    stream->next = 0;
+    size_t rounds = c->workload == INSERT || c->workload == DELETE ? c->size : MIN_OPS;
+    for (size_t i = 0; i < rounds; i++) {
+        size_t index = streamNext(stream);
+        keys[i] = c->workload == SEARCH || c->workload == MIXED
+                      ? searchKey(stream, index, c->hitRatio)
+                      : (int)(2 * index);
+    }
+
+    return rounds;
+}
+
+/* Helper function: returns a tree for a pass of c, empty for insertions and
+ * filled otherwise, NULL on failure. */
+struct RBTree *passTree(const struct Case *c) {
+    if (c->workload == INSERT) {
+        return c->btree ? RBCreateBTree() : RBCreate();
+    }
+
+    return benchTree(c);
+}
+
+/* Helper function: runs operation i of a pass of c on key, returns 1 when
+ * it found, added or removed key, 0 otherwise. */
+int runOperation(const struct Case *c, struct RBTree *tree, size_t i, int key) {
+    switch (c->workload) {
+    case INSERT:
+        return RBInsert(tree, key) == 0;
+    case SEARCH:
+        return RBSearch(tree, key);
+    case DELETE:
+        return RBDelete(tree, key) == 0;
+    case MIXED:
+        // four searches between updates, which alternate between inserting
+        // and deleting
+        if (i % 10 == 0) {
+            return RBInsert(tree, key) == 0;
+        } else if (i % 10 == 5) {
+            return RBDelete(tree, key) == 0;
+        }
+        return RBSearch(tree, key);
+    }
+
+    return 0;
+}
+
+/* Helper function: runs the operations of c on keys drawn from stream,
+ * each pass twice on a fresh tree: once timing every operation, storing
+ * its latency in latencies, and once timing the pass as a whole, adding
+ * its time to *totalNs. The share of operations that found their key is
+ * stored in *hits. Return the number of operations per run on success, 0
+ * on failure. */
+size_t runCase(const struct Case *c, struct KeyStream *stream, int *keys,
+               uint64_t *latencies, size_t capacity, uint64_t *totalNs, double *hits) {
+    size_t ops = 0;
+    size_t found = 0;
+    *totalNs = 0;
+    while (ops < MIN_OPS && ops + c->size <= capacity) {
+        size_t rounds = drawKeys(c, stream, keys);
+
+        struct RBTree *tree = passTree(c);
+        if (!tree) {
+            return 0;
+        }
+        size_t timedFound = 0;
+        for (size_t i = 0; i < rounds; i++) {
+            uint64_t before = nowNs();
+            int result = runOperation(c, tree, i, keys[i]);
+            latencies[ops + i] = nowNs() - before;
+            timedFound += (size_t)result;
+        }
+        RBFree(tree);
+
+        // the throughput pass reads no clock per operation, and repeats the
+        // same operations on the same tree, so it must find the same keys
+        tree = passTree(c);
+        if (!tree) {
+            return 0;
+        }
+        size_t passFound = 0;
+        uint64_t start = nowNs();
+        for (size_t i = 0; i < rounds; i++) {
+            passFound += (size_t)runOperation(c, tree, i, keys[i]);
+        }
+        *totalNs += nowNs() - start;
+        RBFree(tree);
+        if (passFound != timedFound) {
+            return 0;
+        }
+
+        found += timedFound;
+        ops += rounds;
+        if (c->workload == SEARCH || c->workload == MIXED) {
+            break;
+        }
+    }
+
+    *hits = ops ? (double)found / (double)ops : 0;
+    return ops;
+}
+
+/* Helper function: comparator for sorting latencies. */
+int compareLatencies(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Helper function: returns the peak resident memory of the process so far
+ * in kilobytes. */
+long peakRssKb(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/* Helper function: runs c and prints its row, return 0 on success, -1 on
+ * failure. Meant to run in a child process, so that the peak resident
+ * memory is that of this case alone. The key stream and the buffers of
+ * keys and latencies are resident before the trees are built and their
+ * memory is left out of the peak. */
+int benchCase(const struct Case *c, int first) {
+    long baseRss = peakRssKb();
+    size_t capacity = c->size > MIN_OPS ? 2 * c->size : 2 * (size_t)MIN_OPS;
+    struct KeyStream stream;
+    if (streamInit(&stream, c->distribution, c->size, 42) == -1) {
+        fprintf(stderr, "Failed to prepare keys.\n");
+        return -1;
+    }
+    uint64_t *latencies = malloc(sizeof(uint64_t) * capacity);
+    int *keys = malloc(sizeof(int) * capacity);
+    if (!latencies || !keys) {
+        fprintf(stderr, "Failed to allocate latencies.\n");
+        free(stream.zipf);
+        free(latencies);
+        free(keys);
+        return -1;
+    }
+    memset(latencies, 0, sizeof(uint64_t) * capacity);
+    memset(keys, 0, sizeof(int) * capacity);
+    long buffersRss = peakRssKb() - baseRss;
+
+    uint64_t totalNs;
+    double hits;
+    size_t ops = runCase(c, &stream, keys, latencies, capacity, &totalNs, &hits);
+    long peakRss = peakRssKb() - buffersRss;
+    free(stream.zipf);
+    free(keys);
+    if (ops == 0) {
+        fprintf(stderr, "Failed to run %s %s %zu.\n", workloadNames[c->workload],
+                distributionNames[c->distribution], c->size);
+        free(latencies);
+        return -1;
+    }
+
+    qsort(latencies, ops, sizeof(uint64_t), compareLatencies);
+    uint64_t p50 = latencies[ops / 2];
+    uint64_t p99 = latencies[ops * 99 / 100];
+    uint64_t p999 = latencies[ops * 999 / 1000];
+    double opsPerSecond = (double)ops * 1e9 / (double)totalNs;
+    free(latencies);
+
+    const char *backend = c->btree ? "btree" : "rbtree";
+    if (c->json) {
+        printf("%s  {\"backend\": \"%s\", \"workload\": \"%s\", \"distribution\": \"%s\", "
+               "\"size\": %zu, \"hit_ratio\": %d, \"hits\": %.3f, \"ops\": %zu, "
+               "\"ops_per_sec\": %.0f, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+               "\"p999_ns\": %llu, \"peak_rss_kb\": %ld}",
+               first ? "" : ",\n", backend, workloadNames[c->workload],
+               distributionNames[c->distribution], c->size, c->hitRatio, hits, ops,
+               opsPerSecond, (unsigned long long)p50, (unsigned long long)p99,
+               (unsigned long long)p999, peakRss);
+    } else {
+        printf("%s,%s,%s,%zu,%d,%.3f,%zu,%.0f,%llu,%llu,%llu,%ld\n", backend,
+               workloadNames[c->workload], distributionNames[c->distribution], c->size,
+               c->hitRatio, hits, ops, opsPerSecond, (unsigned long long)p50,
+               (unsigned long long)p99, (unsigned long long)p999, peakRss);
+    }
+
+    return 0;
+}
+
+/* Values in most feature benchmarks, which compare the ways the tree offers
+ * to do the same work rather than sweep workloads like the cases above. */
+#define FEATURE_VALUES 1000000
+
+/* Number of even values that stay in the tree of the concurrency tests. */
+#define STABLE_VALUES 20000
+
+/* Number of reader threads in the concurrency stress test. */
+#define READERS 4
+
+/* State shared by the threads of the concurrency tests. The tree holds the
+ * even values below 2 * STABLE_VALUES throughout, while the writer inserts
+ * and deletes odd values. */
+struct SharedTree {
+    struct RBTree *tree;
+    int readers;
+    int lookups;
+    atomic_uint nextSeed;
+    atomic_int readersDone;
+    atomic_int failed;
+    atomic_long writes;
+};
+
+/* Helper function: reader thread, searches stable and changing values and
+ * records a failure when a stable value is not found. */
+void *readerThread(void *argument) {
+    struct SharedTree *shared = argument;
+    unsigned int seed = atomic_fetch_add(&shared->nextSeed, 1);
+
+    for (int i = 0; i < shared->lookups; i++) {
+        seed = seed * 1103515245u + 12345u;
+        int value = (int)((seed >> 8) % (2 * STABLE_VALUES));
+        int found = RBSearch(shared->tree, value);
+        if (value % 2 == 0 && found != 1) {
+            atomic_store(&shared->failed, 1);
+        }
+
+        if (i % 4096 == 0) {
+            size_t evens = RBRangeCount(shared->tree, 0, 2 * STABLE_VALUES);
+            if (evens < STABLE_VALUES) {
+                atomic_store(&shared->failed, 1);
+            }
+        }
+    }
+
+    atomic_fetch_add(&shared->readersDone, 1);
+    return NULL;
+}
+
+/* Helper function: writer thread, inserts and deletes odd values until all
+ * readers are done. */
+void *writerThread(void *argument) {
+    struct SharedTree *shared = argument;
+    int batch[64];
+    for (int round = 0; atomic_load(&shared->readersDone) < shared->readers; round++) {
+        for (int i = 0; i < 64; i++) {
+            batch[i] = 2 * ((round * 64 + i) % STABLE_VALUES) + 1;
+        }
+
+        if (round % 2 == 0) {
+            for (int i = 0; i < 64; i++) {
+                RBInsert(shared->tree, batch[i]);
+            }
+            for (int i = 0; i < 64; i++) {
+                RBDelete(shared->tree, batch[i]);
+            }
+        } else {
+            RBInsertBatch(shared->tree, batch, 64, NULL);
+            RBDeleteBatch(shared->tree, batch, 64, NULL);
+        }
+        atomic_fetch_add(&shared->writes, 128);
+    }
+
+    return NULL;
+}
+
+/* Measures the rate of duplicate insertions into a populated tree.
+ * Returns 0 on success, a printed error and -1 on failure. */
+int duplicateInsertBenchmark(void) {
+    printf("Benchmarking %d duplicate insertions: ", FEATURE_VALUES);
+
+    struct RBTree *tree = RBCreate();
+    if (!tree) {
+        printf("Failed to create tree.\n");
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < FEATURE_VALUES / 10; i++) {
+        if (RBInsert(tree, i) == -1) {
+            printf("Failed to insert value %d.\n", i);
+            RBFree(tree);
+            return -1;
+        }
+    }
+
+    uint64_t start = nowNs();
+    for (i = 0; i < FEATURE_VALUES; i++) {
+        if (RBInsert(tree, i % (FEATURE_VALUES / 10)) != 1) {
+            printf("Failed to detect duplicate %d.\n", i % (FEATURE_VALUES / 10));
+            RBFree(tree);
+            return -1;
+        }
+    }
+    double seconds = (double)(nowNs() - start) * 1e-9;
+
+    RBFree(tree);
+    printf("%.0f inserts/s.\n", seconds > 0 ? FEATURE_VALUES / seconds : 0.0);
+    return 0;
+}
+
+/* Helper function: returns the nanoseconds per operation of count
+ * operations that started at start. */
+double nsPerOp(uint64_t start, int count) {
+    return (double)(nowNs() - start) / count;
+}
+
+/* Measures the average latency of insert, search and delete on FEATURE_VALUES random
+ * values. Returns 0 on success, a printed error and -1 on failure. */
+int latencyBenchmark(void) {
+    printf("Benchmarking per-operation latency on %d random values: ", FEATURE_VALUES);
+
+    struct RBTree *tree = RBCreate();
+    if (!tree) {
+        printf("Failed to create tree.\n");
+        return -1;
+    }
+
+    int i;
+    int *values = malloc(sizeof(int) * FEATURE_VALUES);
+    if (!values) {
+        printf("Failed to allocate values.\n");
+        RBFree(tree);
+        return -1;
+    }
+    for (i = 0; i < FEATURE_VALUES; i++) {
+        values[i] = rand();
+    }
+
+    uint64_t start = nowNs();
+    for (i = 0; i < FEATURE_VALUES; i++) {
+        if (RBInsert(tree, values[i]) == -1) {
+            printf("Failed to insert value %d.\n", values[i]);
+            RBFree(tree);
+            free(values);
+            return -1;
+        }
+    }
+    double insertNs = nsPerOp(start, FEATURE_VALUES);
+
+    start = nowNs();
+    for (i = 0; i < FEATURE_VALUES; i++) {
+        if (RBSearch(tree, values[i]) == 0) {
+            printf("Failed to find value %d.\n", values[i]);
+            RBFree(tree);
+            free(values);
+            return -1;
+        }
+    }
+    double searchNs = nsPerOp(start, FEATURE_VALUES);
+
+    start = nowNs();
+    for (i = 0; i < FEATURE_VALUES; i++) {
+        if (RBDelete(tree, values[i]) == -1) {
+            printf("Failed to delete value %d.\n", values[i]);
+            RBFree(tree);
+            free(values);
+            return -1;
+        }
+    }
+    double deleteNs = nsPerOp(start, FEATURE_VALUES);
+
+    RBFree(tree);
+    free(values);
+    printf("insert %.1f ns, search %.1f ns, delete %.1f ns.\n",
+           insertNs, searchNs, deleteNs);
+    return 0;
+}
+
+/* Measures bottom-up against top-down insertion and deletion on the
+ * workload of manyRandomValuesTest in test.c: FEATURE_VALUES random values below FEATURE_VALUES inserted,
+ * then the first half of them deleted. Returns 0 on success, a printed
+ * error and -1 on failure. */
+int topDownBenchmark(void) {
+    printf("Benchmarking bottom-up against top-down on %d random values:\n", FEATURE_VALUES);
+
+    int *values = malloc(sizeof(int) * FEATURE_VALUES);
+    if (!values) {
+        printf("Failed to allocate values.\n");
+        return -1;
+    }
+    for (int i = 0; i < FEATURE_VALUES; i++) {
+        values[i] = rand() % FEATURE_VALUES;
+    }
+
+    for (int topDown = 0; topDown < 2; topDown++) {
+        struct RBTree *tree = RBCreate();
+        if (!tree) {
+            printf("Failed to create tree.\n");
+            free(values);
+            return -1;
+        }
+
+        uint64_t start = nowNs();
+        for (int i = 0; i < FEATURE_VALUES; i++) {
+            int result = topDown ? RBInsertTopDown(tree, values[i]) : RBInsert(tree, values[i]);
+            if (result == -1) {
+                printf("Failed to insert value %d.\n", values[i]);
+                RBFree(tree);
+                free(values);
+                return -1;
+            }
+        }
+        double insertNs = nsPerOp(start, FEATURE_VALUES);
+
+        start = nowNs();
+        for (int i = 0; i < FEATURE_VALUES / 2; i++) {
+            int result = topDown ? RBDeleteTopDown(tree, values[i]) : RBDelete(tree, values[i]);
+            if (result == -1) {
+                printf("Failed to delete value %d.\n", values[i]);
+                RBFree(tree);
+                free(values);
+                return -1;
+            }
+        }
+        double deleteNs = nsPerOp(start, FEATURE_VALUES / 2);
+
+        if (RBCheck(tree) != 0) {
+            printf("Tree is not a valid red-black tree.\n");
+            RBFree(tree);
+            free(values);
+            return -1;
+        }
+        RBFree(tree);
+        printf("  %s: insert %.1f ns, delete %.1f ns.\n", topDown ? "top-down " : "bottom-up",
+               insertNs, deleteNs);
+    }
+
+    free(values);
+    return 0;
+}
+
+/* Measures insert, search and delete latency of FEATURE_VALUES values in ordered and
+ * in random order for one backend, created by create. */
+int backendLatency(struct RBTree *(*create)(void), const int *values, const char *name) {
+    struct RBTree *tree = create();
+    if (!tree) {
+        printf("Failed to create tree.\n");
+        return -1;
+    }
+
+    uint64_t start = nowNs();
+    for (int i = 0; i < FEATURE_VALUES; i++) {
+        RBInsert(tree, values[i]);
+    }
+    double insertNs = nsPerOp(start, FEATURE_VALUES);
+
+    start = nowNs();
+    for (int i = 0; i < FEATURE_VALUES; i++) {
+        if (RBSearch(tree, values[i]) == 0) {
+            printf("Failed to find value %d.\n", values[i]);
+            RBFree(tree);
+            return -1;
+        }
+    }
+    double searchNs = nsPerOp(start, FEATURE_VALUES);
+
+    start = nowNs();
+    for (int i = 0; i < FEATURE_VALUES; i++) {
+        RBDelete(tree, values[i]);
+    }
+    double deleteNs = nsPerOp(start, FEATURE_VALUES);
+
+    RBFree(tree);
+    printf("    %s: insert %.1f ns, search %.1f ns, delete %.1f ns.\n", name,
+           insertNs, searchNs, deleteNs);
+    return 0;
+}
+
+/* Compares the red-black and B-tree backends on the ordered and random
+ * value patterns of the tests above. */
+int backendBenchmark(void) {
+    printf("Benchmarking backends on %d values:\n", FEATURE_VALUES);
+
+    int *values = malloc(sizeof(int) * FEATURE_VALUES);
+    if (!values) {
+        printf("Failed to allocate values.\n");
+        return -1;
+    }
+
+    for (int pattern = 0; pattern < 2; pattern++) {
+        for (int i = 0; i < FEATURE_VALUES; i++) {
+            values[i] = pattern == 0 ? i : rand();
+        }
+        printf("  %s values:\n", pattern == 0 ? "ordered" : "random");
+        if (backendLatency(RBCreate, values, "red-black") == -1
+            || backendLatency(RBCreateBTree, values, "B-tree   ") == -1) {
+            free(values);
+            return -1;
+        }
+    }
+
+    free(values);
+    return 0;
+}
+
+/* Measures searching FEATURE_VALUES random values one call at a time against a single
+ * batch search. Returns 0 on success, a printed error and -1 on failure. */
+int searchBatchBenchmark(void) {
+    printf("Benchmarking %d searches, single against batched: ", FEATURE_VALUES);
+
+    int i;
+    int *values = malloc(sizeof(int) * FEATURE_VALUES);
+    unsigned char *found = malloc(FEATURE_VALUES);
+    if (!values || !found) {
+        printf("Failed to allocate values.\n");
+        free(values);
+        free(found);
+        return -1;
+    }
+    for (i = 0; i < FEATURE_VALUES; i++) {
+        values[i] = rand();
+    }
+
+    struct RBTree *tree = RBBuildFromUnsorted(values, FEATURE_VALUES);
+    if (!tree) {
+        printf("Failed to build tree.\n");
+        free(values);
+        free(found);
+        return -1;
+    }
+
+    // search in a different random order than the tree was built from
+    for (i = FEATURE_VALUES - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        int temp = values[i];
+        values[i] = values[j];
+        values[j] = temp;
+    }
+
+    uint64_t start = nowNs();
+    for (i = 0; i < FEATURE_VALUES; i++) {
+        if (RBSearch(tree, values[i]) == 0) {
+            printf("Failed to find value %d.\n", values[i]);
+            RBFree(tree);
+            free(values);
+            free(found);
+            return -1;
+        }
+    }
+    double singleNs = nsPerOp(start, FEATURE_VALUES);
+
+    start = nowNs();
+    if (RBSearchBatch(tree, values, FEATURE_VALUES, found) != 0) {
+        printf("Failed to search batch.\n");
+        RBFree(tree);
+        free(values);
+        free(found);
+        return -1;
+    }
+    double batchNs = nsPerOp(start, FEATURE_VALUES);
+
+    RBFree(tree);
+    free(values);
+    free(found);
+    printf("single %.1f ns, batched %.1f ns.\n", singleNs, batchNs);
+    return 0;
+}
+
+/* Measures searching FEATURE_VALUES random values in a tree against its frozen copy,
+ * one call at a time and batched. Returns 0 on success, a printed error and
+ * -1 on failure. */
+int frozenBenchmark(void) {
+    printf("Benchmarking %d searches, tree against frozen: ", FEATURE_VALUES);
+
+    int i;
+    int *values = malloc(sizeof(int) * FEATURE_VALUES);
+    unsigned char *found = malloc(FEATURE_VALUES);
+    if (!values || !found) {
+        printf("Failed to allocate values.\n");
+        free(values);
+        free(found);
+        return -1;
+    }
+    for (i = 0; i < FEATURE_VALUES; i++) {
+        values[i] = rand();
+    }
+
+    struct RBTree *tree = RBBuildFromUnsorted(values, FEATURE_VALUES);
+    uint64_t start = nowNs();
+    struct RBFrozen *frozen = tree ? RBFreeze(tree) : NULL;
+    double freezeNs = nsPerOp(start, FEATURE_VALUES);
+    if (!frozen) {
+        printf("Failed to build frozen tree.\n");
+        RBFree(tree);
+        free(values);
+        free(found);
+        return -1;
+    }
+
+    for (i = FEATURE_VALUES - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        int temp = values[i];
+        values[i] = values[j];
+        values[j] = temp;
+    }
+
+    start = nowNs();
+    int hits = 0;
+    for (i = 0; i < FEATURE_VALUES; i++) {
+        hits += RBSearch(tree, values[i]);
+    }
+    double treeNs = nsPerOp(start, FEATURE_VALUES);
+
+    start = nowNs();
+    for (i = 0; i < FEATURE_VALUES; i++) {
+        hits -= RBFrozenSearch(frozen, values[i]);
+    }
+    double frozenNs = nsPerOp(start, FEATURE_VALUES);
+
+    start = nowNs();
+    RBFrozenSearchBatch(frozen, values, FEATURE_VALUES, found);
+    double batchNs = nsPerOp(start, FEATURE_VALUES);
+
+    int missing = 0;
+    for (i = 0; i < FEATURE_VALUES; i++) {
+        missing += !found[i];
+    }
+
+    RBFrozenFree(frozen);
+    RBFree(tree);
+    free(values);
+    free(found);
+    if (hits != 0 || missing != 0) {
+        printf("Frozen tree disagrees with tree.\n");
+        return -1;
+    }
+
+    printf("freeze %.1f ns, tree %.1f ns, frozen %.1f ns, batched %.1f ns.\n",
+           freezeNs, treeNs, frozenNs, batchNs);
+    return 0;
+}
+
+/* Measures plain, prefetching and interleaved searches on trees from 1K to
+ * 16M values, half of the searches missing. Returns 0 on success, a printed
+ * error and -1 on failure. */
+int prefetchBenchmark(void) {
+    printf("Benchmarking prefetching searches by tree size:\n");
+
+    int i;
+    int *keys = malloc(sizeof(int) * FEATURE_VALUES);
+    unsigned char *found = malloc(FEATURE_VALUES);
+    if (!keys || !found) {
+        printf("Failed to allocate keys.\n");
+        free(keys);
+        free(found);
+        return -1;
+    }
+
+    for (int size = 1 << 10; size <= 1 << 24; size <<= 2) {
+        int *values = malloc(sizeof(int) * (size_t)size);
+        if (!values) {
+            printf("Failed to allocate values.\n");
+            free(keys);
+            free(found);
+            return -1;
+        }
+        for (i = 0; i < size; i++) {
+            values[i] = 2 * i;
+        }
+
+        struct RBTree *tree = RBBuildFromSorted(values, (size_t)size);
+        free(values);
+        if (!tree) {
+            printf("Failed to build tree.\n");
+            free(keys);
+            free(found);
+            return -1;
+        }
+
+        for (i = 0; i < FEATURE_VALUES; i++) {
+            keys[i] = (int)((unsigned int)rand() % (2u * (unsigned int)size));
+        }
+
+        int hits = 0;
+        uint64_t start = nowNs();
+        for (i = 0; i < FEATURE_VALUES; i++) {
+            hits += RBSearch(tree, keys[i]);
+        }
+        double plainNs = nsPerOp(start, FEATURE_VALUES);
+
+        start = nowNs();
+        for (i = 0; i < FEATURE_VALUES; i++) {
+            hits -= RBSearchPrefetch(tree, keys[i]);
+        }
+        double prefetchNs = nsPerOp(start, FEATURE_VALUES);
+
+        start = nowNs();
+        RBSearchMulti(tree, keys, FEATURE_VALUES, found);
+        double multiNs = nsPerOp(start, FEATURE_VALUES);
+
+        RBFree(tree);
+        if (hits != 0) {
+            printf("Prefetching search disagrees with plain search.\n");
+            free(keys);
+            free(found);
+            return -1;
+        }
+
+        printf("    %8d values: plain %.1f ns, prefetch %.1f ns, multi %.1f ns.\n",
+               size, plainNs, prefetchNs, multiNs);
+    }
+
+    free(keys);
+    free(found);
+    return 0;
+}
+
+/* Helper function: returns the wall clock time in seconds. */
+double wallSeconds(void) {
+    return (double)nowNs() * 1e-9;
+}
+
+/* Measures the lookup throughput of a concurrent tree for 1 to READERS
+ * reader threads while one writer keeps modifying it. Returns 0 on success,
+ * a printed error and -1 on failure. */
+int concurrencyBenchmark(void) {
+    printf("Benchmarking concurrent lookups with one writer:\n");
+
+    for (int readerCount = 1; readerCount <= READERS; readerCount *= 2) {
+        struct RBTree *tree = RBCreateConcurrent();
+        if (!tree) {
+            printf("Failed to create tree.\n");
+            return -1;
+        }
+        for (int i = 0; i < STABLE_VALUES; i++) {
+            RBInsert(tree, 2 * i);
+        }
+
+        struct SharedTree shared = {.tree = tree, .readers = readerCount, .lookups = FEATURE_VALUES / 2};
+        atomic_init(&shared.nextSeed, 1);
+        atomic_init(&shared.readersDone, 0);
+        atomic_init(&shared.failed, 0);
+        atomic_init(&shared.writes, 0);
+
+        pthread_t writer;
+        pthread_t readers[READERS];
+        double start = wallSeconds();
+        pthread_create(&writer, NULL, writerThread, &shared);
+        for (int i = 0; i < readerCount; i++) {
+            pthread_create(&readers[i], NULL, readerThread, &shared);
+        }
+        for (int i = 0; i < readerCount; i++) {
+            pthread_join(readers[i], NULL);
+        }
+        double seconds = wallSeconds() - start;
+        pthread_join(writer, NULL);
+        RBFree(tree);
+
+        if (atomic_load(&shared.failed)) {
+            printf("A reader missed a value that was never deleted.\n");
+            return -1;
+        }
+
+        printf("    %d readers: %.0f lookups/s, %.0f writes/s.\n", readerCount,
+               readerCount * (double)shared.lookups / seconds,
+               (double)atomic_load(&shared.writes) / seconds);
+    }
+
+    return 0;
+}
+
+/* Benchmarks getting a saved tree ready for searches against rebuilding
+ * it with insertions. */
+int mappedStartupBenchmark(void) {
+    printf("Benchmarking startup with %d values: ", FEATURE_VALUES);
+
+    const char *path = "bench_mapped.rbt";
+    struct RBTree *tree = RBCreate();
+    if (!tree) {
+        printf("Failed to create tree.\n");
+        return -1;
+    }
+    srand(11);
+    int first = rand();
+    RBInsert(tree, first);
+    for (int i = 1; i < FEATURE_VALUES; i++) {
+        RBInsert(tree, rand());
+    }
+    int saved = RBSave(tree, path);
+    RBFree(tree);
+    if (saved != 0) {
+        printf("Failed to save tree.\n");
+        return -1;
+    }
+
+    srand(11);
+    double start = wallSeconds();
+    tree = RBCreate();
+    for (int i = 0; tree && i < FEATURE_VALUES; i++) {
+        RBInsert(tree, rand());
+    }
+    double rebuildSeconds = wallSeconds() - start;
+    RBFree(tree);
+
+    start = wallSeconds();
+    struct RBMappedTree *mapped = RBOpenMapped(path);
+    int found = RBMappedSearch(mapped, first);
+    double mapSeconds = wallSeconds() - start;
+
+    start = wallSeconds();
+    struct RBTree *loaded = RBMappedLoad(mapped);
+    double loadSeconds = wallSeconds() - start;
+
+    RBFree(loaded);
+    RBMappedClose(mapped);
+    remove(path);
+    if (!found || !loaded) {
+        printf("Failed to open saved tree.\n");
+        return -1;
+    }
+
+    printf("insert %.1f ms, map and search %.3f ms, load %.1f ms.\n",
+           rebuildSeconds * 1e3, mapSeconds * 1e3, loadSeconds * 1e3);
+
+    return 0;
+}
+
+/* Benchmarks bulk building, checking and freeing of a large tree with a
+ * growing number of threads. */
+int parallelBulkBenchmark(void) {
+    printf("Benchmarking bulk operations on %d values by thread count:\n", 4 * FEATURE_VALUES);
+
+    int *keys = malloc(4 * FEATURE_VALUES * sizeof(int));
+    if (!keys) {
+        printf("Failed to allocate keys.\n");
+        return -1;
+    }
+    for (int i = 0; i < 4 * FEATURE_VALUES; i++) {
+        keys[i] = i;
+    }
+
+    for (unsigned threads = 1; threads <= 8; threads *= 2) {
+        double start = wallSeconds();
+        struct RBTree *tree = RBBuildFromSortedParallel(keys, 4 * FEATURE_VALUES, threads);
+        double built = wallSeconds();
+        if (!tree) {
+            printf("Failed to build tree.\n");
+            free(keys);
+            return -1;
+        }
+        int result = RBCheckParallel(tree, threads);
+        double checked = wallSeconds();
+        RBFree(tree);
+        double freed = wallSeconds();
+
+        if (result == -1) {
+            printf("Tree built with %u threads is not valid.\n", threads);
+            free(keys);
+            return -1;
+        }
+        printf("    %u threads: build %.1f ms, check %.1f ms, free %.1f ms.\n", threads,
+               (built - start) * 1e3, (checked - built) * 1e3, (freed - checked) * 1e3);
+    }
+
+    free(keys);
+    return 0;
+}
+
+/* Helper function: runs the feature benchmarks, return 0 on success, -1
+ * on failure. */
+int featureBenchmarks(void) {
+    if (duplicateInsertBenchmark() || latencyBenchmark() || topDownBenchmark()
+        || backendBenchmark() || searchBatchBenchmark() || frozenBenchmark()
+        || prefetchBenchmark() || concurrencyBenchmark() || parallelBulkBenchmark()
+        || mappedStartupBenchmark()) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct Case c = {0};
+    size_t maxSize = 1000000;
+    int features = 0;
+    int option;
+    while ((option = getopt(argc, argv, "f:n:b:c")) != -1) {
+        if (option == 'f' && (!strcmp(optarg, "csv") || !strcmp(optarg, "json"))) {
+            c.json = !strcmp(optarg, "json");
+        } else if (option == 'n' && atol(optarg) > 0) {
+            maxSize = (size_t)atol(optarg);
+        } else if (option == 'b' && (!strcmp(optarg, "rbtree") || !strcmp(optarg, "btree"))) {
+            c.btree = !strcmp(optarg, "btree");
+        } else if (option == 'c') {
+            features = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [-f csv|json] [-n max size] [-b rbtree|btree] [-c]\n",
+                    argv[0]);
+            return -1;
+        }
+    }
+
+    if (features) {
+        return featureBenchmarks();
+    }
+
+    if (c.json) {
+        printf("[\n");
+    } else {
+        printf("backend,workload,distribution,size,hit_ratio,hits,ops,ops_per_sec,"
+               "p50_ns,p99_ns,p999_ns,peak_rss_kb\n");
+    }
+
+    static const int hitRatios[] = {100, 50, 0};
+    int first = 1;
+    for (size_t size = 1000; size <= maxSize; size *= 10) {
+        for (int workload = INSERT; workload <= MIXED; workload++) {
+            for (int distribution = SEQUENTIAL; distribution <= ZIPFIAN; distribution++) {
+                int ratios = workload == SEARCH || workload == MIXED ? 3 : 1;
+                for (int ratio = 0; ratio < ratios; ratio++) {
+                    c.workload = (enum Workload)workload;
+                    c.distribution = (enum Distribution)distribution;
+                    c.size = size;
+                    c.hitRatio = hitRatios[ratio];
+
+                    fflush(stdout);
+                    pid_t child = fork();
+                    if (child == -1) {
+                        fprintf(stderr, "Failed to fork.\n");
+                        return -1;
+                    }
+                    if (child == 0) {
+                        int result = benchCase(&c, first);
+                        fflush(stdout);
+                        _exit(result == 0 ? 0 : 1);
+                    }
+
+                    int status;
+                    if (waitpid(child, &status, 0) == -1 || !WIFEXITED(status)
+                        || WEXITSTATUS(status) != 0) {
+                        return -1;
+                    }
+                    first = 0;
+                }
+            }
+        }
+    }
+
+    if (c.json) {
+        printf("\n]\n");
+    }
+
+    return 0;
+}
@@ -2,14 +2,54 @@
  * Date of Creation: 23/12/2023
  * Code to test the validity of the red-black tree properties. */
 
+#define _POSIX_C_SOURCE 200809L
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "RBMap.h"
 #include "RBTree.h"
 
 #define MAX 1000000
 
+/* Helper function: orders int64_t keys for Int64Map. */
+int compareInt64(int64_t a, int64_t b) {
+    return (a > b) - (a < b);
+}
+
+RBMAP_DEFINE(Int64Map, int64_t, int, compareInt64)
+RBMAP_DEFINE(StringMap, const char *, size_t, strcmp)
+
+/* Key of the runtime map test. */
+struct Point {
+    int x;
+    int y;
+};
+
+/* Value of the runtime map test. */
+struct Label {
+    char name[12];
+    double weight;
+};
+
+/* Helper function: orders points by x, then by y. */
+int comparePoints(const void *a, const void *b) {
+    const struct Point *p = a;
+    const struct Point *q = b;
+    if (p->x != q->x) {
+        return (p->x > q->x) - (p->x < q->x);
+    }
+
+    return (p->y > q->y) - (p->y < q->y);
+}
+
 /* Tests initialization and freeing of the red-black tree. */
 int initializationTest(void) {
     printf("Testing initialization and freeing of red-black tree: ");
@@ -211,10 +251,9 @@ int deleteNonPresentTest(void) {
     return 0;
 }
 
-/* Tests the red-black tree structure with many ordered values.
- * Returns 0 on success, a printed error and -1 on failure. */
-int manyOrderedValuesTest(void) {
-    printf("Testing red-black tree with %d ordered values: ", MAX);
+/* Tests forward and backward iteration and the lower and upper bounds. */
+int iteratorTest(void) {
+    printf("Testing ordered iteration: ");
 
     struct RBTree *tree = RBCreate();
     if (!tree) {
@@ -222,43 +261,188 @@ int manyOrderedValuesTest(void) {
         return -1;
     }
 
-    int i;
-    for (i = 0; i < MAX; i++) {
-        if (RBInsert(tree, i) == -1) {
-            printf("Failed to insert value %d.\n", i);
+    struct RBIter iter;
+    if (RBIterFirst(tree, &iter) != 0 || RBIterPrev(&iter) != 0) {
+        printf("Iterated over an empty tree.\n");
+        RBFree(tree);
+        return -1;
+    }
+
+    for (int i = 0; i < 100; i += 2) {
+        if (RBInsert(tree, 98 - i) == -1) {
+            printf("Failed to insert value %d.\n", 98 - i);
             RBFree(tree);
             return -1;
         }
     }
 
-    if (RBCheck(tree) == -1) {
-        printf("Tree is not a valid red-black tree.\n");
+    int expected = 0;
+    for (int valid = RBIterFirst(tree, &iter); valid; valid = RBIterNext(&iter)) {
+        if (RBIterValue(&iter) != expected) {
+            printf("Expected %d but iterated to %d.\n", expected, RBIterValue(&iter));
+            RBFree(tree);
+            return -1;
+        }
+        expected += 2;
+    }
+    if (expected != 100) {
+        printf("Forward iteration stopped at %d.\n", expected);
         RBFree(tree);
         return -1;
     }
 
-    for (i = 0; i < MAX; i++) {
-        if (RBSearch(tree, i) == 0) {
-            printf("Failed to find value %d.\n", i);
+    // stepping back from past the end lands on the largest value
+    if (!RBIterPrev(&iter) || RBIterValue(&iter) != 98) {
+        printf("Failed to step back from the end.\n");
+        RBFree(tree);
+        return -1;
+    }
+
+    expected = 98;
+    for (int valid = RBIterLast(tree, &iter); valid; valid = RBIterPrev(&iter)) {
+        if (RBIterValue(&iter) != expected) {
+            printf("Expected %d but iterated to %d.\n", expected, RBIterValue(&iter));
             RBFree(tree);
             return -1;
         }
+        expected -= 2;
+    }
+    if (expected != -2) {
+        printf("Backward iteration stopped at %d.\n", expected);
+        RBFree(tree);
+        return -1;
     }
 
-    for (i = 0; i < 0.5*MAX; i++) {
-        int deleteErrorCode = RBDelete(tree, i);
-        if (deleteErrorCode == -1) {
-            printf("Failed to delete value %d.\n", i);
-            RBFree(tree);
-            return -1;
-        } else if (deleteErrorCode == 1) {
-            printf("Value %d could not be found in the tree.\n", i);
+    if (!RBLowerBound(tree, 10, &iter) || RBIterValue(&iter) != 10
+        || !RBLowerBound(tree, 11, &iter) || RBIterValue(&iter) != 12
+        || !RBUpperBound(tree, 10, &iter) || RBIterValue(&iter) != 12
+        || !RBLowerBound(tree, -5, &iter) || RBIterValue(&iter) != 0
+        || RBLowerBound(tree, 99, &iter) || RBUpperBound(tree, 98, &iter)) {
+        printf("Bounds returned the wrong position.\n");
+        RBFree(tree);
+        return -1;
+    }
+
+    RBFree(tree);
+    printf("Success.\n");
+    return 0;
+}
+
+/* Number of even values that stay in the tree of the concurrency tests. */
+#define STABLE_VALUES 20000
+
+/* Number of reader threads in the concurrency stress test. */
+#define READERS 4
+
+/* State shared by the threads of the concurrency tests. The tree holds the
+ * even values below 2 * STABLE_VALUES throughout, while the writer inserts
+ * and deletes odd values. */
+struct SharedTree {
+    struct RBTree *tree;
+    int readers;
+    int lookups;
+    atomic_uint nextSeed;
+    atomic_int readersDone;
+    atomic_int failed;
+    atomic_long writes;
+};
+
+/* Helper function: reader thread, searches stable and changing values and
+ * records a failure when a stable value is not found. */
+void *readerThread(void *argument) {
+    struct SharedTree *shared = argument;
+    unsigned int seed = atomic_fetch_add(&shared->nextSeed, 1);
+
+    for (int i = 0; i < shared->lookups; i++) {
+        seed = seed * 1103515245u + 12345u;
+        int value = (int)((seed >> 8) % (2 * STABLE_VALUES));
+        int found = RBSearch(shared->tree, value);
+        if (value % 2 == 0 && found != 1) {
+            atomic_store(&shared->failed, 1);
+        }
+
+        if (i % 4096 == 0) {
+            size_t evens = RBRangeCount(shared->tree, 0, 2 * STABLE_VALUES);
+            if (evens < STABLE_VALUES) {
+                atomic_store(&shared->failed, 1);
+            }
+        }
+    }
+
+    atomic_fetch_add(&shared->readersDone, 1);
+    return NULL;
+}
+
+/* Helper function: writer thread, inserts and deletes odd values until all
+ * readers are done. */
+void *writerThread(void *argument) {
+    struct SharedTree *shared = argument;
+    int batch[64];
+    for (int round = 0; atomic_load(&shared->readersDone) < shared->readers; round++) {
+        for (int i = 0; i < 64; i++) {
+            batch[i] = 2 * ((round * 64 + i) % STABLE_VALUES) + 1;
+        }
+
+        if (round % 2 == 0) {
+            for (int i = 0; i < 64; i++) {
+                RBInsert(shared->tree, batch[i]);
+            }
+            for (int i = 0; i < 64; i++) {
+                RBDelete(shared->tree, batch[i]);
+            }
+        } else {
+            RBInsertBatch(shared->tree, batch, 64, NULL);
+            RBDeleteBatch(shared->tree, batch, 64, NULL);
+        }
+        atomic_fetch_add(&shared->writes, 128);
+    }
+
+    return NULL;
+}
+
+/* Tests a concurrent tree with several reader threads and one writer
+ * thread, then checks the tree. */
+int concurrentTest(void) {
+    printf("Testing concurrent readers and writer: ");
+
+    struct RBTree *tree = RBCreateConcurrent();
+    if (!tree) {
+        printf("Failed to create tree.\n");
+        return -1;
+    }
+
+    for (int i = 0; i < STABLE_VALUES; i++) {
+        if (RBInsert(tree, 2 * i) == -1) {
+            printf("Failed to insert value %d.\n", 2 * i);
             RBFree(tree);
             return -1;
         }
     }
 
-    if (RBCheck(tree) == -1) {
+    struct SharedTree shared = {.tree = tree, .readers = READERS, .lookups = 200000};
+    atomic_init(&shared.nextSeed, 1);
+    atomic_init(&shared.readersDone, 0);
+    atomic_init(&shared.failed, 0);
+    atomic_init(&shared.writes, 0);
+
+    pthread_t writer;
+    pthread_t readers[READERS];
+    pthread_create(&writer, NULL, writerThread, &shared);
+    for (int i = 0; i < READERS; i++) {
+        pthread_create(&readers[i], NULL, readerThread, &shared);
+    }
+    for (int i = 0; i < READERS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    pthread_join(writer, NULL);
+
+    if (atomic_load(&shared.failed)) {
+        printf("A reader missed a value that was never deleted.\n");
+        RBFree(tree);
+        return -1;
+    }
+
+    if (RBCheck(tree) == -1 || RBSize(tree) != STABLE_VALUES) {
         printf("Tree is not a valid red-black tree.\n");
         RBFree(tree);
         return -1;
@@ -269,10 +453,19 @@ int manyOrderedValuesTest(void) {
     return 0;
 }
 
-/* Tests the red-black tree structure with many random values.
- * Returns 0 on success, a printed error and -1 on failure. */
-int manyRandomValuesTest(void) {
-    printf("Testing red-black tree with %d random values: ", MAX);
+/* Helper function: sums visited values into context, stops above 50. */
+int sumUpToFifty(int value, void *context) {
+    if (value > 50) {
+        return 1;
+    }
+
+    *(int *)context += value;
+    return 0;
+}
+
+/* Tests range visits, batched range copies and range counts. */
+int rangeTest(void) {
+    printf("Testing range queries: ");
 
     struct RBTree *tree = RBCreate();
     if (!tree) {
@@ -280,79 +473,2112 @@ int manyRandomValuesTest(void) {
         return -1;
     }
 
-    srand((unsigned int)time(NULL));
+    for (int i = 0; i < 100; i++) {
+        if (RBInsert(tree, i * 3) == -1) {
+            printf("Failed to insert value %d.\n", i * 3);
+            RBFree(tree);
+            return -1;
+        }
+    }
 
-    int i;
-    int *values = malloc(sizeof(int) * MAX);
-    for (i = 0; i < MAX; i++) {
-        int value = rand() % MAX;
-        values[i] = value;
+    int sum = 0;
+    if (RBRange(tree, 10, 31, sumUpToFifty, &sum) != 0 || sum != 12 + 15 + 18 + 21 + 24 + 27 + 30) {
+        printf("Visited the wrong range.\n");
+        RBFree(tree);
+        return -1;
     }
 
-    for (i = 0; i < MAX; i++) {
-        if (RBInsert(tree, values[i]) == -1) {
-            printf("Failed to insert value %d.\n", values[i]);
+    sum = 0;
+    if (RBRange(tree, 40, 100, sumUpToFifty, &sum) != 1 || sum != 42 + 45 + 48) {
+        printf("Failed to stop the range visit early.\n");
+        RBFree(tree);
+        return -1;
+    }
+
+    struct RBIter iter;
+    int buffer[4];
+    int expected = 3;
+    size_t copied = 4;
+    RBLowerBound(tree, 1, &iter);
+    while (copied == 4) {
+        copied = RBRangeFill(&iter, 60, buffer, 4);
+        for (size_t i = 0; i < copied; i++) {
+            if (buffer[i] != expected) {
+                printf("Expected %d but copied %d.\n", expected, buffer[i]);
+                RBFree(tree);
+                return -1;
+            }
+            expected += 3;
+        }
+    }
+    if (expected != 60) {
+        printf("Batched copy stopped at %d.\n", expected);
+        RBFree(tree);
+        return -1;
+    }
+
+    if (RBRangeCount(tree, 0, 300) != 100 || RBRangeCount(tree, 1, 3) != 0
+        || RBRangeCount(tree, 3, 9) != 2 || RBRangeCount(tree, 10, 5) != 0) {
+        printf("Counted the wrong number of values.\n");
+        RBFree(tree);
+        return -1;
+    }
+
+    RBFree(tree);
+    printf("Success.\n");
+    return 0;
+}
+
+/* Tests size, rank and select while values are inserted and deleted. */
+int orderStatisticsTest(void) {
+    printf("Testing size, rank and select: ");
+
+    struct RBTree *tree = RBCreate();
+    if (!tree) {
+        printf("Failed to create tree.\n");
+        return -1;
+    }
+
+    for (int i = 0; i < 1000; i++) {
+        if (RBInsert(tree, (i * 7919) % 1000) == -1) {
+            printf("Failed to insert value %d.\n", (i * 7919) % 1000);
+            RBFree(tree);
+            return -1;
+        }
+    }
+    for (int i = 0; i < 1000; i += 2) {
+        if (RBDelete(tree, i) != 0) {
+            printf("Failed to delete value %d.\n", i);
             RBFree(tree);
-            free(values);
             return -1;
         }
     }
 
-    if (RBCheck(tree) == -1) {
-        printf("Tree is not a valid red-black tree.\n");
+    if (RBSize(tree) != 500 || RBCheck(tree) == -1) {
+        printf("Tree has the wrong size or is not a valid red-black tree.\n");
         RBFree(tree);
-        free(values);
         return -1;
     }
 
-    for (i = 0; i < MAX; i++) {
-        if (RBSearch(tree, values[i]) == 0) {
-            printf("Failed to find value %d.\n", values[i]);
+    for (size_t k = 0; k < 500; k++) {
+        int value;
+        if (RBSelect(tree, k, &value) != 0 || value != (int)(2 * k + 1)
+            || RBRank(tree, value) != k) {
+            printf("Rank and select disagree at position %zu.\n", k);
             RBFree(tree);
-            free(values);
             return -1;
         }
     }
 
-    for (i = 0; i < 0.5*MAX; i++) {
-        int deleteErrorCode = RBDelete(tree, values[i]);
-        if (deleteErrorCode == -1) {
-            printf("Failed to delete value %d.\n", values[i]);
+    int value;
+    if (RBSelect(tree, 500, &value) != -1 || RBRank(tree, 2000) != 500
+        || RBRank(tree, -1) != 0) {
+        printf("Rank or select accepted an out of range position.\n");
+        RBFree(tree);
+        return -1;
+    }
+
+    RBFree(tree);
+    printf("Success.\n");
+    return 0;
+}
+
+/* Tests building trees of every size up to 300 from sorted values and
+ * building from unsorted values with duplicates. */
+int buildTest(void) {
+    printf("Testing bulk building from arrays: ");
+
+    int keys[300];
+    for (int i = 0; i < 300; i++) {
+        keys[i] = 2 * i;
+    }
+
+    for (size_t n = 0; n <= 300; n++) {
+        struct RBTree *tree = RBBuildFromSorted(keys, n);
+        if (!tree) {
+            printf("Failed to build tree of size %zu.\n", n);
+            return -1;
+        }
+
+        if (RBCheck(tree) == -1 || RBSize(tree) != n) {
+            printf("Built tree of size %zu is not a valid red-black tree.\n", n);
+            RBFree(tree);
+            return -1;
+        }
+
+        for (int i = 0; i < (int)n; i++) {
+            if (RBSearch(tree, 2 * i) == 0 || RBSearch(tree, 2 * i + 1) == 1) {
+                printf("Built tree of size %zu has the wrong values.\n", n);
+                RBFree(tree);
+                return -1;
+            }
+        }
+
+        // the built tree must keep working with regular updates
+        if (RBInsert(tree, -1) != 0 || RBDelete(tree, 0) == -1 || RBCheck(tree) == -1) {
+            printf("Failed to update built tree of size %zu.\n", n);
             RBFree(tree);
             return -1;
         }
+
+        RBFree(tree);
     }
 
-    if (RBCheck(tree) == -1) {
-        printf("Tree is not a valid red-black tree.\n");
+    int descending[] = {3, 2, 1};
+    if (RBBuildFromSorted(descending, 3)) {
+        printf("Built a tree from unsorted values.\n");
+        return -1;
+    }
+
+    // large enough for the parallel build and check to fork
+    int *many = malloc(MAX * sizeof(int));
+    if (!many) {
+        printf("Failed to allocate keys.\n");
+        return -1;
+    }
+    for (int i = 0; i < MAX; i++) {
+        many[i] = 3 * i;
+    }
+    struct RBTree *parallel = RBBuildFromSortedParallel(many, MAX, 4);
+    free(many);
+    if (!parallel || RBSize(parallel) != MAX || RBCheckParallel(parallel, 4) == -1
+        || RBCheck(parallel) == -1 || RBSearch(parallel, 3 * (MAX - 1)) != 1
+        || RBSearch(parallel, 3 * (MAX / 2) + 1) != 0) {
+        printf("Tree built in parallel is wrong.\n");
+        RBFree(parallel);
+        return -1;
+    }
+    RBFree(parallel);
+
+    int unsorted[] = {5, 3, 9, 3, 1, 9, 9, 7, 5};
+    struct RBTree *tree = RBBuildFromUnsorted(unsorted, 9);
+    if (!tree) {
+        printf("Failed to build tree from unsorted values.\n");
+        return -1;
+    }
+
+    int expected = 1;
+    struct RBIter iter;
+    for (int valid = RBIterFirst(tree, &iter); valid; valid = RBIterNext(&iter)) {
+        if (RBIterValue(&iter) != expected) {
+            printf("Expected %d but iterated to %d.\n", expected, RBIterValue(&iter));
+            RBFree(tree);
+            return -1;
+        }
+        expected += 2;
+    }
+    if (expected != 11 || RBCheck(tree) == -1) {
+        printf("Tree built from unsorted values is wrong.\n");
         RBFree(tree);
-        free(values);
         return -1;
     }
 
     RBFree(tree);
-    free(values);
     printf("Success.\n");
     return 0;
 }
 
-int main(void) {
-    if (initializationTest()) {
+/* Tests batched insertions, searches and deletions against their
+ * single-value counterparts. */
+int batchTest(void) {
+    printf("Testing batch operations: ");
+
+    struct RBTree *tree = RBCreate();
+    if (!tree) {
+        printf("Failed to create tree.\n");
         return -1;
     }
-    if (insertTest()) {
+
+    int keys[2000];
+    unsigned char found[2000];
+    for (int i = 0; i < 2000; i++) {
+        keys[i] = rand() % 3000;
+    }
+
+    size_t inserted;
+    if (RBInsertBatch(tree, keys, 1000, &inserted) != 0
+        || inserted != RBSize(tree) || RBCheck(tree) == -1) {
+        printf("Failed to insert batch.\n");
+        RBFree(tree);
         return -1;
     }
-    if (duplicateTest()) {
+
+    if (RBSearchBatch(tree, keys, 2000, found) != 0) {
+        printf("Failed to search batch.\n");
+        RBFree(tree);
         return -1;
     }
-    if (searchTest()) {
+    for (int i = 0; i < 2000; i++) {
+        if (found[i] != RBSearch(tree, keys[i])) {
+            printf("Batch search disagrees on value %d.\n", keys[i]);
+            RBFree(tree);
+            return -1;
+        }
+    }
+
+    if (RBSearchMulti(tree, keys, 2000, found) != 0) {
+        printf("Failed to search multiple values.\n");
+        RBFree(tree);
         return -1;
     }
-    if (deleteTest()) {
+    for (int i = 0; i < 2000; i++) {
+        if (found[i] != RBSearch(tree, keys[i])
+            || RBSearchPrefetch(tree, keys[i]) != RBSearch(tree, keys[i])) {
+            printf("Prefetching search disagrees on value %d.\n", keys[i]);
+            RBFree(tree);
+            return -1;
+        }
+    }
+
+    size_t deleted;
+    if (RBDeleteBatch(tree, keys + 500, 1500, &deleted) != 0 || RBCheck(tree) == -1) {
+        printf("Failed to delete batch.\n");
+        RBFree(tree);
         return -1;
     }
-    if (deleteNonPresentTest()) {
+    for (int i = 500; i < 2000; i++) {
+        if (RBSearch(tree, keys[i]) == 1) {
+            printf("Batch delete left value %d.\n", keys[i]);
+            RBFree(tree);
+            return -1;
+        }
+    }
+    if (inserted - deleted != RBSize(tree)) {
+        printf("Batch delete reported the wrong count.\n");
+        RBFree(tree);
+        return -1;
+    }
+
+    RBFree(tree);
+    printf("Success.\n");
+    return 0;
+}
+
+/* Tests typed maps with int64_t and string keys and a runtime map with
+ * struct keys and values. */
+int mapTest(void) {
+    printf("Testing key/value maps: ");
+
+    struct Int64Map *numbers = Int64MapCreate();
+    if (!numbers) {
+        printf("Failed to create map.\n");
+        return -1;
+    }
+
+    for (int i = 0; i < 1000; i++) {
+        int64_t key = ((int64_t)(i * 7919 % 1000) << 33) - 5;
+        if (Int64MapPut(numbers, key, i) != 0) {
+            printf("Failed to put key %d.\n", i);
+            Int64MapFree(numbers);
+            return -1;
+        }
+    }
+    for (int i = 0; i < 1000; i += 2) {
+        int64_t key = ((int64_t)(i * 7919 % 1000) << 33) - 5;
+        if (Int64MapRemove(numbers, key) != 0 || Int64MapRemove(numbers, key) != 1) {
+            printf("Failed to remove key %d.\n", i);
+            Int64MapFree(numbers);
+            return -1;
+        }
+    }
+    for (int i = 1; i < 1000; i += 2) {
+        int64_t key = ((int64_t)(i * 7919 % 1000) << 33) - 5;
+        int *value = Int64MapGet(numbers, key);
+        if (!value || *value != i) {
+            printf("Failed to get key %d.\n", i);
+            Int64MapFree(numbers);
+            return -1;
+        }
+    }
+
+    int64_t previous = INT64_MIN;
+    for (struct Int64MapNode *node = Int64MapFirst(numbers); node; node = Int64MapNext(node)) {
+        if (node->key <= previous) {
+            printf("Map iterated out of order.\n");
+            Int64MapFree(numbers);
+            return -1;
+        }
+        previous = node->key;
+    }
+    if (Int64MapSize(numbers) != 500 || RBLinkCheck(numbers->root) == -1) {
+        printf("Map is not a valid red-black tree.\n");
+        Int64MapFree(numbers);
+        return -1;
+    }
+    Int64MapFree(numbers);
+
+    struct StringMap *words = StringMapCreate();
+    if (!words) {
+        printf("Failed to create map.\n");
+        return -1;
+    }
+    const char *text[] = {"pear", "apple", "fig", "apple", "kiwi", "fig", "apple"};
+    for (size_t i = 0; i < 7; i++) {
+        size_t *count = StringMapGet(words, text[i]);
+        if (count) {
+            (*count)++;
+        } else if (StringMapPut(words, text[i], 1) != 0) {
+            printf("Failed to put word %s.\n", text[i]);
+            StringMapFree(words);
+            return -1;
+        }
+    }
+    size_t *apples = StringMapGet(words, "apple");
+    struct StringMapNode *first = StringMapFirst(words);
+    if (StringMapSize(words) != 4 || !apples || *apples != 3 || !first
+        || strcmp(first->key, "apple") != 0 || StringMapGet(words, "plum")) {
+        printf("String map holds the wrong counts.\n");
+        StringMapFree(words);
+        return -1;
+    }
+    StringMapFree(words);
+
+    struct RBMap *labels = RBMapCreate(comparePoints, sizeof(struct Point),
+                                       sizeof(struct Label));
+    if (!labels) {
+        printf("Failed to create map.\n");
+        return -1;
+    }
+    for (int i = 0; i < 2000; i++) {
+        struct Point point = {rand() % 40, rand() % 40};
+        struct Label label = {"point", point.x * 0.5};
+        int expected = RBMapGet(labels, &point) ? 1 : 0;
+        if (RBMapPut(labels, &point, &label) != expected) {
+            printf("Failed to put point (%d, %d).\n", point.x, point.y);
+            RBMapFree(labels);
+            return -1;
+        }
+        if (i % 3 == 0) {
+            point.y = (point.y + 1) % 40;
+            expected = RBMapGet(labels, &point) ? 0 : 1;
+            if (RBMapRemove(labels, &point) != expected) {
+                printf("Failed to remove point (%d, %d).\n", point.x, point.y);
+                RBMapFree(labels);
+                return -1;
+            }
+        }
+    }
+    struct Point origin = {0, 0};
+    struct Label label = {"origin", -1.0};
+    RBMapPut(labels, &origin, &label);
+    struct Label *stored = RBMapGet(labels, &origin);
+    if (RBMapCheck(labels) == -1 || !stored || strcmp(stored->name, "origin") != 0) {
+        printf("Runtime map is not a valid red-black tree.\n");
+        RBMapFree(labels);
+        return -1;
+    }
+    RBMapFree(labels);
+
+    // a map without values is a set, whose puts take no value
+    struct RBMap *points = RBMapCreate(comparePoints, sizeof(struct Point), 0);
+    if (!points || RBMapPut(points, &origin, NULL) != 0 || RBMapPut(points, &origin, NULL) != 1
+        || RBMapSize(points) != 1 || RBMapCheck(points) == -1) {
+        printf("Map without values failed to put a key twice.\n");
+        RBMapFree(points);
+        return -1;
+    }
+    RBMapFree(points);
+
+    printf("Success.\n");
+    return 0;
+}
+
+/* Helper function: counts visited values in context. */
+int countValues(int value, void *context) {
+    (*(size_t *)context)++;
+    return 0;
+}
+
+/* Helper function: inserts the values 0 to 19999 in order into the
+ * concurrent tree passed in. */
+void *orderedWriterThread(void *arg) {
+    struct RBTree *tree = arg;
+    for (int i = 0; i < 20000; i++) {
+        RBInsert(tree, i);
+    }
+
+    return NULL;
+}
+
+/* Helper function: checks that the snapshot holds exactly the values from 0
+ * up to its size, returns 0 when it does, -1 otherwise. */
+int checkPrefixSnapshot(struct RBSnapshot *snapshot) {
+    size_t size = RBSnapshotSize(snapshot);
+    size_t visited = 0;
+    if (RBSnapshotRange(snapshot, INT_MIN, INT_MAX, countValues, &visited) != 0
+        || visited != size || RBSnapshotSearch(snapshot, (int)size) != 0
+        || (size > 0 && RBSnapshotSearch(snapshot, (int)size - 1) != 1)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Tests that snapshots keep their values while the tree changes and after
+ * it is freed. */
+int snapshotTest(void) {
+    printf("Testing snapshots: ");
+
+    struct RBTree *tree = RBCreate();
+    if (!tree) {
+        printf("Failed to create tree.\n");
+        return -1;
+    }
+
+    for (int i = 0; i < 100; i++) {
+        RBInsert(tree, i);
+    }
+
+    struct RBSnapshot *first = RBSnapshot(tree);
+    struct RBSnapshot *second = RBSnapshot(tree);
+    struct RBSnapshot *unused = RBSnapshot(tree);
+    if (!first || !second || !unused) {
+        printf("Failed to take snapshots.\n");
+        RBSnapshotFree(first);
+        RBSnapshotFree(second);
+        RBSnapshotFree(unused);
+        RBFree(tree);
+        return -1;
+    }
+    RBSnapshotFree(unused);
+
+    if (RBSnapshotSize(first) != 100 || RBSnapshotSearch(first, 99) != 1) {
+        printf("Snapshot does not match the tree.\n");
+        RBSnapshotFree(first);
+        RBSnapshotFree(second);
+        RBFree(tree);
+        return -1;
+    }
+
+    for (int i = 0; i < 50; i++) {
+        RBDelete(tree, i);
+    }
+    struct RBSnapshot *third = RBSnapshot(tree);
+    RBInsert(tree, 1000);
+    RBFree(tree);
+
+    size_t visited = 0;
+    if (RBSnapshotSize(first) != 100 || RBSnapshotSize(second) != 100
+        || !third || RBSnapshotSize(third) != 50
+        || RBSnapshotSearch(first, 10) != 1 || RBSnapshotSearch(third, 10) != 0
+        || RBSnapshotSearch(third, 1000) != 0
+        || RBSnapshotRange(second, 20, 30, countValues, &visited) != 0 || visited != 10) {
+        printf("Snapshot does not match the tree it was taken of.\n");
+        RBSnapshotFree(first);
+        RBSnapshotFree(second);
+        RBSnapshotFree(third);
+        return -1;
+    }
+
+    RBSnapshotFree(first);
+    RBSnapshotFree(second);
+    RBSnapshotFree(third);
+
+    // snapshots of a concurrent tree taken while a writer inserts values in
+    // order each hold the values inserted before them
+    tree = RBCreateConcurrent();
+    pthread_t writer;
+    if (!tree || pthread_create(&writer, NULL, orderedWriterThread, tree) != 0) {
+        printf("Failed to start writer.\n");
+        RBFree(tree);
+        return -1;
+    }
+    int failed = 0;
+    struct RBSnapshot *held = NULL;
+    for (int round = 0; round < 2000 && !failed; round++) {
+        struct RBSnapshot *snapshot = RBSnapshot(tree);
+        failed = !snapshot || checkPrefixSnapshot(snapshot) != 0
+                 || (held && (checkPrefixSnapshot(held) != 0
+                              || RBSnapshotSize(held) > RBSnapshotSize(snapshot)));
+        RBSnapshotFree(held);
+        held = snapshot;
+    }
+    RBSnapshotFree(held);
+    pthread_join(writer, NULL);
+    RBFree(tree);
+    if (failed) {
+        printf("Snapshot of concurrent tree holds values of another time.\n");
+        return -1;
+    }
+
+    printf("Success.\n");
+    return 0;
+}
+
+/* Helper function: checks that the snapshot holds the same values as the
+ * tree, returns 0 when it does, -1 otherwise. */
+int checkTreeSnapshot(struct RBTree *tree, struct RBSnapshot *snapshot) {
+    size_t visited = 0;
+    if (!snapshot || RBSnapshotSize(snapshot) != RBSize(tree)
+        || RBSnapshotRange(snapshot, INT_MIN, INT_MAX, countValues, &visited) != 0
+        || visited != RBSize(tree)) {
+        return -1;
+    }
+    struct RBIter iter;
+    for (int valid = RBIterFirst(tree, &iter); valid; valid = RBIterNext(&iter)) {
+        if (RBSnapshotSearch(snapshot, RBIterValue(&iter)) != 1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Tests that a write after a snapshot copies only the path it changes and
+ * shares the other nodes with the snapshots. */
+int snapshotSharingTest(void) {
+    printf("Testing snapshot sharing: ");
+
+    int n = 100000;
+    struct RBTree *tree = RBCreate();
+    for (int i = 0; tree && i < n; i++) {
+        RBInsert(tree, 2 * i);
+    }
+    struct RBSnapshot *first = tree ? RBSnapshot(tree) : NULL;
+    struct RBStats stats;
+    if (!first || RBGetStats(tree, &stats) != 0 || stats.sharedNodes != (size_t)n) {
+        printf("First snapshot did not copy each value once.\n");
+        RBSnapshotFree(first);
+        RBFree(tree);
+        return -1;
+    }
+
+    // the treap paths are O(log n) in expectation; the bound leaves room for
+    // the deepest of the writes and the spines a deletion merges
+    size_t bound = 4 * 17 + 8;
+    size_t largest = 0;
+    size_t previous = stats.sharedNodes;
+    srand(11);
+    for (int round = 0; round < 20000; round++) {
+        int value = rand() % (2 * n);
+        if (round % 2) {
+            RBDelete(tree, value);
+        } else {
+            RBInsert(tree, value);
+        }
+        struct RBSnapshot *snapshot = RBSnapshot(tree);
+        RBGetStats(tree, &stats);
+        if (stats.sharedNodes - previous > largest) {
+            largest = stats.sharedNodes - previous;
+        }
+        previous = stats.sharedNodes;
+        RBSnapshotFree(snapshot);
+    }
+    if (largest > bound) {
+        printf("Write copied %zu nodes.\n", largest);
+        RBSnapshotFree(first);
+        RBFree(tree);
+        return -1;
+    }
+
+    // batches change the copy value by value, and a split drops it for the
+    // next snapshot to build again
+    int keys[1000];
+    for (int i = 0; i < 1000; i++) {
+        keys[i] = -1 - i;
+    }
+    struct RBSnapshot *middle = RBSnapshot(tree);
+    RBInsertBatch(tree, keys, 1000, NULL);
+    struct RBSnapshot *batched = RBSnapshot(tree);
+    int failed = checkTreeSnapshot(tree, batched) != 0;
+    RBDeleteBatch(tree, keys, 500, NULL);
+    RBDeleteNode(tree, RBFind(tree, keys[700]));
+    struct RBSnapshot *deleted = RBSnapshot(tree);
+    failed = failed || checkTreeSnapshot(tree, deleted) != 0
+             || RBSnapshotSize(batched) != RBSnapshotSize(middle) + 1000
+             || RBSnapshotSearch(middle, keys[0]) != 0 || RBSnapshotSearch(batched, keys[0]) != 1;
+    struct RBTree *lo;
+    struct RBTree *hi;
+    failed = failed || RBSplit(tree, n, &lo, &hi) != 0;
+    struct RBSnapshot *split = failed ? NULL : RBSnapshot(lo);
+    failed = failed || checkTreeSnapshot(lo, split) != 0;
+    if (!failed) {
+        RBFree(hi);
+    }
+    RBFree(tree);
+
+    size_t visited = 0;
+    failed = failed || RBSnapshotSize(first) != (size_t)n
+             || RBSnapshotRange(first, INT_MIN, INT_MAX, countValues, &visited) != 0
+             || visited != (size_t)n || RBSnapshotSearch(first, 2 * n - 2) != 1
+             || RBSnapshotSearch(first, 1) != 0;
+    RBSnapshotFree(first);
+    RBSnapshotFree(middle);
+    RBSnapshotFree(batched);
+    RBSnapshotFree(deleted);
+    RBSnapshotFree(split);
+    if (failed) {
+        printf("Snapshot does not match the tree it was taken of.\n");
+        return -1;
+    }
+
+    printf("Success.\n");
+    return 0;
+}
+
+/* Helper function: returns a tree of the multiples of step below limit. */
+struct RBTree *multiplesTree(int step, int limit) {
+    struct RBTree *tree = RBCreate();
+    for (int i = 0; tree && i < limit; i += step) {
+        RBInsert(tree, i);
+    }
+
+    return tree;
+}
+
+/* Helper function: checks that the tree is valid and holds exactly the
+ * values below limit for which expected returns 1. */
+int matchesSet(struct RBTree *tree, int limit, int (*expected)(int value)) {
+    if (RBCheck(tree) == -1) {
+        return -1;
+    }
+
+    size_t count = 0;
+    for (int i = 0; i < limit; i++) {
+        if (RBSearch(tree, i) != expected(i)) {
+            return -1;
+        }
+        count += (size_t)expected(i);
+    }
+
+    return RBSize(tree) == count ? 0 : -1;
+}
+
+int inUnion(int value) {
+    return value % 2 == 0 || value % 3 == 0;
+}
+
+int inIntersection(int value) {
+    return value % 6 == 0;
+}
+
+int inDifference(int value) {
+    return value % 2 == 0 && value % 3 != 0;
+}
+
+/* Tests joining and splitting trees and the set operations built on them,
+ * serially and with several threads. */
+int setOperationsTest(void) {
+    printf("Testing join, split and set operations: ");
+
+    struct RBTree *small = multiplesTree(1, 100);
+    struct RBTree *large = RBCreate();
+    for (int i = 200; large && i < 10000; i++) {
+        RBInsert(large, i);
+    }
+    if (!small || !large) {
+        printf("Failed to create trees.\n");
+        RBFree(small);
+        RBFree(large);
+        return -1;
+    }
+
+    if (RBJoin(small, 500, large) != NULL) {
+        printf("Joined trees around a pivot out of order.\n");
+        RBFree(small);
+        RBFree(large);
+        return -1;
+    }
+
+    struct RBTree *joined = RBJoin(small, 150, large);
+    if (!joined || RBCheck(joined) == -1 || RBSize(joined) != 9901
+        || RBSearch(joined, 150) != 1 || RBSearch(joined, 199) != 0) {
+        printf("Joined tree does not hold both trees and the pivot.\n");
+        RBFree(joined);
+        return -1;
+    }
+
+    struct RBTree *lo;
+    struct RBTree *hi;
+    if (RBSplit(joined, 5000, &lo, &hi) != 0) {
+        printf("Failed to split tree.\n");
+        RBFree(joined);
+        return -1;
+    }
+
+    // the halves share their nodes' pool but change independently
+    RBInsert(lo, 150000);
+    RBDelete(lo, 150);
+    RBInsert(hi, -1);
+    RBDelete(hi, 5000);
+    if (RBCheck(lo) == -1 || RBCheck(hi) == -1 || RBSize(lo) != 4901 || RBSize(hi) != 5000
+        || RBSearch(lo, 4999) != 1 || RBSearch(hi, 5001) != 1 || RBSearch(hi, 4999) != 0) {
+        printf("Split halves do not hold the values around the key.\n");
+        RBFree(lo);
+        RBFree(hi);
+        return -1;
+    }
+    RBFree(lo);
+    if (RBSearch(hi, 9999) != 1 || RBCheck(hi) == -1) {
+        printf("Split half did not survive freeing the other half.\n");
+        RBFree(hi);
+        return -1;
+    }
+    RBFree(hi);
+
+    struct RBTree *(*operations[])(struct RBTree *, struct RBTree *, unsigned) = {
+        RBUnionParallel, RBIntersectParallel, RBDifferenceParallel
+    };
+    int (*expected[])(int) = {inUnion, inIntersection, inDifference};
+    int limit = 300000;
+    for (unsigned threads = 1; threads <= 4; threads += 3) {
+        for (int i = 0; i < 3; i++) {
+            struct RBTree *evens = multiplesTree(2, limit);
+            struct RBTree *triples = multiplesTree(3, limit);
+            if (!evens || !triples) {
+                printf("Failed to create trees.\n");
+                RBFree(evens);
+                RBFree(triples);
+                return -1;
+            }
+
+            struct RBTree *result = operations[i](evens, triples, threads);
+            if (!result || matchesSet(result, limit, expected[i]) == -1) {
+                printf("Set operation %d with %u threads is wrong.\n", i, threads);
+                RBFree(result);
+                return -1;
+            }
+            RBFree(result);
+        }
+    }
+
+    struct RBTree *tree = multiplesTree(1, 1000);
+    if (!tree || RBSplit(tree, 300, &lo, &hi) != 0) {
+        printf("Failed to split tree.\n");
+        RBFree(tree);
+        return -1;
+    }
+    tree = RBUnion(hi, lo);
+    if (!tree || RBCheck(tree) == -1 || RBSize(tree) != 1000 || RBSearch(tree, 299) != 1) {
+        printf("Union of split halves does not restore the tree.\n");
+        RBFree(tree);
+        return -1;
+    }
+
+    RBFree(tree);
+    printf("Success.\n");
+    return 0;
+}
+
+/* Tests saving trees to files and searching them mapped into memory. */
+int mappedTest(void) {
+    printf("Testing saved and mapped trees: ");
+
+    const char *path = "test_mapped.rbt";
+    for (int n = 0; n <= 10000; n += 10000) {
+        struct RBTree *tree = RBCreate();
+        if (!tree) {
+            printf("Failed to create tree.\n");
+            return -1;
+        }
+        srand(7);
+        for (int i = 0; i < n; i++) {
+            RBInsert(tree, rand() % (4 * n));
+        }
+
+        if (RBSave(tree, path) != 0) {
+            printf("Failed to save tree.\n");
+            RBFree(tree);
+            return -1;
+        }
+
+        struct RBMappedTree *mapped = RBOpenMapped(path);
+        if (!mapped || RBMappedCheck(mapped) != 0 || RBMappedSize(mapped) != RBSize(tree)) {
+            printf("Mapped tree of %d insertions does not match the saved tree.\n", n);
+            RBMappedClose(mapped);
+            RBFree(tree);
+            remove(path);
+            return -1;
+        }
+        for (int i = -1; i <= 4 * n; i++) {
+            if (RBMappedSearch(mapped, i) != RBSearch(tree, i)) {
+                printf("Mapped tree disagrees with the saved tree on %d.\n", i);
+                RBMappedClose(mapped);
+                RBFree(tree);
+                remove(path);
+                return -1;
+            }
+        }
+
+        // a loaded tree is a regular tree again
+        struct RBTree *loaded = RBMappedLoad(mapped);
+        RBMappedClose(mapped);
+        if (!loaded || RBCheck(loaded) != 0 || RBSize(loaded) != RBSize(tree)
+            || RBInsert(loaded, -5) != 0 || RBCheck(loaded) != 0) {
+            printf("Loaded tree of %d insertions is not valid.\n", n);
+            RBFree(loaded);
+            RBFree(tree);
+            remove(path);
+            return -1;
+        }
+        RBFree(loaded);
+        RBFree(tree);
+    }
+
+    // a truncated file is rejected when it is opened
+    FILE *file = fopen(path, "wb");
+    if (file) {
+        fputs("RBTREE", file);
+        fclose(file);
+    }
+    struct RBMappedTree *truncated = RBOpenMapped(path);
+    remove(path);
+    if (truncated) {
+        printf("Opened a truncated file.\n");
+        RBMappedClose(truncated);
+        return -1;
+    }
+
+    printf("Success.\n");
+    return 0;
+}
+
+/* Growable byte buffer that serialized trees are written to and read
+ * back from. */
+struct ByteStream {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    size_t position;
+    size_t writes;
+};
+
+int streamWrite(const void *data, size_t size, void *context) {
+    struct ByteStream *stream = context;
+    if (stream->size + size > stream->capacity) {
+        size_t capacity = 2 * (stream->size + size);
+        unsigned char *grown = realloc(stream->data, capacity);
+        if (!grown) {
+            return -1;
+        }
+        stream->data = grown;
+        stream->capacity = capacity;
+    }
+
+    memcpy(stream->data + stream->size, data, size);
+    stream->size += size;
+    stream->writes++;
+    return 0;
+}
+
+int streamRead(void *data, size_t size, void *context) {
+    struct ByteStream *stream = context;
+    if (stream->size - stream->position < size) {
+        return -1;
+    }
+
+    memcpy(data, stream->data + stream->position, size);
+    stream->position += size;
+    return 0;
+}
+
+/* Tests serializing trees to a byte stream and deserializing them. */
+int serializeTest(void) {
+    printf("Testing serialization: ");
+
+    struct ByteStream stream = {0};
+    for (int round = 0; round < 3; round++) {
+        struct RBTree *tree = RBCreate();
+        if (!tree) {
+            printf("Failed to create tree.\n");
+            free(stream.data);
+            return -1;
+        }
+        if (round == 1) {
+            for (int i = 0; i < 100000; i++) {
+                RBInsert(tree, i - 50000);
+            }
+        } else if (round == 2) {
+            srand(5);
+            for (int i = 0; i < 10000; i++) {
+                RBInsert(tree, rand() - RAND_MAX / 2);
+            }
+            RBInsert(tree, INT_MIN);
+            RBInsert(tree, INT_MAX);
+        }
+
+        stream.size = 0;
+        stream.position = 0;
+        stream.writes = 0;
+        if (RBSerialize(tree, streamWrite, &stream) != 0) {
+            printf("Failed to serialize tree.\n");
+            RBFree(tree);
+            free(stream.data);
+            return -1;
+        }
+
+        // consecutive values take a byte each, written in a few blocks
+        if (round == 1 && (stream.size > 100100 || stream.writes > 100)) {
+            printf("Serialized %zu bytes in %zu writes for consecutive values.\n",
+                   stream.size, stream.writes);
+            RBFree(tree);
+            free(stream.data);
+            return -1;
+        }
+
+        struct RBTree *copy = RBDeserialize(streamRead, &stream);
+        if (!copy || stream.position != stream.size || RBCheck(copy) != 0
+            || RBSize(copy) != RBSize(tree)) {
+            printf("Deserialized tree does not match round %d.\n", round);
+            RBFree(copy);
+            RBFree(tree);
+            free(stream.data);
+            return -1;
+        }
+
+        struct RBIter original;
+        struct RBIter copied;
+        int valid = RBIterFirst(tree, &original);
+        RBIterFirst(copy, &copied);
+        for (; valid; valid = RBIterNext(&original)) {
+            if (RBIterValue(&original) != RBIterValue(&copied)) {
+                printf("Deserialized %d instead of %d.\n", RBIterValue(&copied),
+                       RBIterValue(&original));
+                RBFree(copy);
+                RBFree(tree);
+                free(stream.data);
+                return -1;
+            }
+            RBIterNext(&copied);
+        }
+
+        RBFree(copy);
+        RBFree(tree);
+    }
+
+    // a cut off stream is rejected
+    stream.size -= 1;
+    stream.position = 0;
+    struct RBTree *truncated = RBDeserialize(streamRead, &stream);
+    free(stream.data);
+    if (truncated) {
+        printf("Deserialized a truncated stream.\n");
+        RBFree(truncated);
+        return -1;
+    }
+
+    // streams claiming 2^34 and 2^50 values but holding at most one are
+    // rejected without reserving memory for the claimed count
+    unsigned char header[] = {0x80, 0x80, 0x80, 0x80, 0x40};
+    unsigned char oneKey[] = {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x02, 0x01, 0x00};
+    struct ByteStream claims[] = {
+        {.data = header, .size = sizeof(header)},
+        {.data = oneKey, .size = sizeof(oneKey)},
+    };
+    for (size_t i = 0; i < sizeof(claims) / sizeof(claims[0]); i++) {
+        truncated = RBDeserialize(streamRead, &claims[i]);
+        if (truncated) {
+            printf("Deserialized a stream claiming more values than it holds.\n");
+            RBFree(truncated);
+            return -1;
+        }
+    }
+
+    printf("Success.\n");
+    return 0;
+}
+
+/* Tests the B-tree backend against a red-black tree holding the same
+ * values, through enough insertions and deletions to split and merge nodes
+ * on several levels. */
+int btreeTest(void) {
+    printf("Testing B-tree backend: ");
+
+    struct RBTree *btree = RBCreateBTree();
+    struct RBTree *reference = RBCreate();
+    if (!btree || !reference) {
+        printf("Failed to create trees.\n");
+        RBFree(btree);
+        RBFree(reference);
+        return -1;
+    }
+
+    srand(3);
+    for (int round = 0; round < 200000; round++) {
+        int value = rand() % 50000;
+        int result;
+        int expected;
+        if (round < 100000 || rand() % 2) {
+            result = RBInsert(btree, value);
+            expected = RBInsert(reference, value);
+        } else {
+            result = RBDelete(btree, value);
+            expected = RBDelete(reference, value);
+        }
+
+        if (result != expected || (round % 10000 == 0 && RBCheck(btree) != 0)) {
+            printf("B-tree diverged from red-black tree at round %d.\n", round);
+            RBFree(btree);
+            RBFree(reference);
+            return -1;
+        }
+    }
+
+    for (int value = -1; value <= 50000; value++) {
+        if (RBSearch(btree, value) != RBSearch(reference, value)) {
+            printf("B-tree disagrees with red-black tree on %d.\n", value);
+            RBFree(btree);
+            RBFree(reference);
+            return -1;
+        }
+    }
+    if (RBSize(btree) != RBSize(reference) || RBCheck(btree) != 0) {
+        printf("B-tree does not hold the values of the red-black tree.\n");
+        RBFree(btree);
+        RBFree(reference);
+        return -1;
+    }
+
+    // operations without a B-tree counterpart fail instead of reaching
+    // into the empty red-black part of the tree
+    int keys[] = {1, 2, 3};
+    if (RBInsertBatch(btree, keys, 3, NULL) != -1 || RBSnapshot(btree) != NULL) {
+        printf("Unsupported operation succeeded on B-tree.\n");
+        RBFree(btree);
+        RBFree(reference);
+        return -1;
+    }
+
+    for (int value = 0; value < 50000; value++) {
+        if (RBDelete(btree, value) != RBDelete(reference, value)) {
+            printf("Failed to delete value %d from B-tree.\n", value);
+            RBFree(btree);
+            RBFree(reference);
+            return -1;
+        }
+    }
+    if (RBSize(btree) != 0 || RBCheck(btree) != 0) {
+        printf("Emptied B-tree is not valid.\n");
+        RBFree(btree);
+        RBFree(reference);
+        return -1;
+    }
+
+    RBFree(btree);
+    RBFree(reference);
+    printf("Success.\n");
+    return 0;
+}
+
+/* Helper function: sums the counts of visited values in context. */
+int sumCounts(int value, size_t count, void *context) {
+    *(size_t *)context += count;
+    return 0;
+}
+
+/* Helper function: folds visited values into the hash in context, in
+ * order. */
+int hashValues(int value, void *context) {
+    uint64_t *hash = context;
+    *hash = *hash * 1000003u + (uint32_t)value;
+    return 0;
+}
+
+/* Helper function: stores in *hash the hash of the values RBPrint writes
+ * for tree, captured through a temporary file in place of stdout. Returns
+ * 0 on success, -1 on failure. */
+int printedHash(struct RBTree *tree, uint64_t *hash) {
+    FILE *file = tmpfile();
+    if (!file) {
+        return -1;
+    }
+
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    if (saved == -1 || dup2(fileno(file), STDOUT_FILENO) == -1) {
+        if (saved != -1) {
+            close(saved);
+        }
+        fclose(file);
+        return -1;
+    }
+    RBPrint(tree);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    rewind(file);
+    *hash = 0;
+    int value;
+    while (fscanf(file, "%d", &value) == 1) {
+        hashValues(value, hash);
+    }
+    fclose(file);
+
+    return 0;
+}
+
+/* Helper function: compares the order queries of a B-tree with those of a
+ * red-black tree holding the same values. Returns 0 when they agree, -1
+ * otherwise. */
+int compareOrderQueries(struct RBTree *btree, struct RBTree *reference) {
+    struct RBIter a;
+    struct RBIter b;
+    int more = RBIterFirst(btree, &a);
+    if (more != RBIterFirst(reference, &b)) {
+        printf("RBIterFirst disagrees.\n");
+        return -1;
+    }
+    while (more) {
+        if (RBIterValue(&a) != RBIterValue(&b) || RBIterCount(&a) != 1) {
+            printf("Forward iteration disagrees at %d.\n", RBIterValue(&b));
+            return -1;
+        }
+        more = RBIterNext(&a);
+        if (more != RBIterNext(&b)) {
+            printf("RBIterNext disagrees.\n");
+            return -1;
+        }
+    }
+
+    // stepping back from past the end starts at the last value
+    more = RBIterPrev(&a);
+    if (more != RBIterPrev(&b)) {
+        printf("RBIterPrev disagrees past the end.\n");
+        return -1;
+    }
+    while (more) {
+        if (RBIterValue(&a) != RBIterValue(&b)) {
+            printf("Backward iteration disagrees at %d.\n", RBIterValue(&b));
+            return -1;
+        }
+        more = RBIterPrev(&a);
+        if (more != RBIterPrev(&b)) {
+            printf("RBIterPrev disagrees.\n");
+            return -1;
+        }
+    }
+
+    if (RBIterLast(btree, &a) != RBIterLast(reference, &b)
+        || (RBSize(reference) > 0 && RBIterValue(&a) != RBIterValue(&b))) {
+        printf("RBIterLast disagrees.\n");
+        return -1;
+    }
+
+    for (int probe = 0; probe < 500; probe++) {
+        int lo = rand() % 220000 - 110000;
+        int hi = lo + rand() % 5000;
+
+        for (int strict = 0; strict <= 1; strict++) {
+            int foundA = strict ? RBUpperBound(btree, lo, &a) : RBLowerBound(btree, lo, &a);
+            int foundB = strict ? RBUpperBound(reference, lo, &b)
+                                : RBLowerBound(reference, lo, &b);
+            if (foundA != foundB || (foundB && RBIterValue(&a) != RBIterValue(&b))) {
+                printf("Bound of %d disagrees.\n", lo);
+                return -1;
+            }
+        }
+
+        if (RBRank(btree, lo) != RBRank(reference, lo)
+            || RBRangeCount(btree, lo, hi) != RBRangeCount(reference, lo, hi)) {
+            printf("Rank or range count of [%d, %d) disagrees.\n", lo, hi);
+            return -1;
+        }
+
+        uint64_t hashA = 0;
+        uint64_t hashB = 0;
+        size_t counted = 0;
+        if (RBRange(btree, lo, hi, hashValues, &hashA) != 0
+            || RBRange(reference, lo, hi, hashValues, &hashB) != 0 || hashA != hashB
+            || RBRangeCounts(btree, lo, hi, sumCounts, &counted) != 0
+            || counted != RBRangeCount(reference, lo, hi)) {
+            printf("Range [%d, %d) disagrees.\n", lo, hi);
+            return -1;
+        }
+
+        int bufferA[64];
+        int bufferB[64];
+        size_t filledA;
+        RBLowerBound(btree, lo, &a);
+        RBLowerBound(reference, lo, &b);
+        do {
+            filledA = RBRangeFill(&a, hi, bufferA, 64);
+            size_t filledB = RBRangeFill(&b, hi, bufferB, 64);
+            if (filledA != filledB || memcmp(bufferA, bufferB, filledA * sizeof(int)) != 0) {
+                printf("RBRangeFill of [%d, %d) disagrees.\n", lo, hi);
+                return -1;
+            }
+        } while (filledA == 64);
+
+        size_t k = (size_t)rand() % (RBSize(reference) + 1);
+        int valueA = 0;
+        int valueB = 0;
+        if (RBSelect(btree, k, &valueA) != RBSelect(reference, k, &valueB)
+            || valueA != valueB) {
+            printf("RBSelect of %zu disagrees.\n", k);
+            return -1;
+        }
+    }
+
+    // a visitor stopping the walk is reported
+    int sumA = 0;
+    int sumB = 0;
+    if (RBRange(btree, 0, 60, sumUpToFifty, &sumA)
+        != RBRange(reference, 0, 60, sumUpToFifty, &sumB) || sumA != sumB) {
+        printf("Stopped range disagrees.\n");
+        return -1;
+    }
+
+    uint64_t printedA;
+    uint64_t printedB;
+    if (printedHash(btree, &printedA) != 0 || printedHash(reference, &printedB) != 0
+        || printedA != printedB) {
+        printf("RBPrint output disagrees.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Tests iterators, bounds, ranges, ranks, selection and printing of a
+ * B-tree against a red-black tree holding the same values, both empty and
+ * filled. */
+int btreeOrderTest(void) {
+    printf("Testing B-tree order queries: ");
+
+    struct RBTree *btree = RBCreateBTree();
+    struct RBTree *reference = RBCreate();
+    if (!btree || !reference) {
+        printf("Failed to create trees.\n");
+        RBFree(btree);
+        RBFree(reference);
+        return -1;
+    }
+
+    if (compareOrderQueries(btree, reference)) {
+        RBFree(btree);
+        RBFree(reference);
+        return -1;
+    }
+
+    srand(7);
+    RBInsert(btree, INT_MIN);
+    RBInsert(reference, INT_MIN);
+    RBInsert(btree, INT_MAX);
+    RBInsert(reference, INT_MAX);
+    for (int round = 0; round < 30000; round++) {
+        int value = rand() % 200000 - 100000;
+        if (RBInsert(btree, value) != RBInsert(reference, value)) {
+            printf("Failed to insert %d.\n", value);
+            RBFree(btree);
+            RBFree(reference);
+            return -1;
+        }
+        if (round % 3 == 0) {
+            value = rand() % 200000 - 100000;
+            RBDelete(btree, value);
+            RBDelete(reference, value);
+        }
+    }
+
+    if (compareOrderQueries(btree, reference)) {
+        RBFree(btree);
+        RBFree(reference);
+        return -1;
+    }
+
+    RBFree(btree);
+    RBFree(reference);
+    printf("Success.\n");
+    return 0;
+}
+
+/* Checks frozen copies of trees of every size up to 300 and of random
+ * values against the searches of the trees they were frozen from. */
+int frozenTest(void) {
+    printf("Testing frozen trees: ");
+
+    for (int n = 0; n <= 300; n++) {
+        struct RBTree *tree = RBCreate();
+        if (!tree) {
+            printf("Failed to create tree.\n");
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            RBInsert(tree, 2 * i);
+        }
+
+        struct RBFrozen *frozen = RBFreeze(tree);
+        if (!frozen || RBFrozenSize(frozen) != (size_t)n) {
+            printf("Failed to freeze tree of %d values.\n", n);
+            RBFrozenFree(frozen);
+            RBFree(tree);
+            return -1;
+        }
+
+        for (int value = -1; value <= 2 * n + 1; value++) {
+            struct RBIter iter;
+            int bound;
+            int expected = RBLowerBound(tree, value, &iter);
+            int result = RBFrozenLowerBound(frozen, value, &bound);
+            if (RBFrozenSearch(frozen, value) != RBSearch(tree, value) || result != expected
+                || (expected && bound != RBIterValue(&iter))) {
+                printf("Frozen tree of %d values disagrees on %d.\n", n, value);
+                RBFrozenFree(frozen);
+                RBFree(tree);
+                return -1;
+            }
+        }
+
+        RBFrozenFree(frozen);
+        RBFree(tree);
+    }
+
+    int *keys = malloc(sizeof(int) * 200000);
+    unsigned char *found = malloc(200000);
+    struct RBTree *tree = RBCreate();
+    if (!keys || !found || !tree) {
+        printf("Failed to allocate keys.\n");
+        free(keys);
+        free(found);
+        RBFree(tree);
+        return -1;
+    }
+
+    srand(4);
+    for (int i = 0; i < 100000; i++) {
+        RBInsert(tree, rand() - RAND_MAX / 2);
+    }
+    struct RBFrozen *frozen = RBFreeze(tree);
+    if (!frozen) {
+        printf("Failed to freeze tree.\n");
+        free(keys);
+        free(found);
+        RBFree(tree);
+        return -1;
+    }
+
+    // every other key is taken from the tree, the rest mostly miss
+    struct RBIter iter;
+    RBIterFirst(tree, &iter);
+    for (int i = 0; i < 200000; i++) {
+        if (i % 2 == 0) {
+            keys[i] = RBIterValue(&iter);
+            if (!RBIterNext(&iter)) {
+                RBIterFirst(tree, &iter);
+            }
+        } else {
+            keys[i] = rand() - RAND_MAX / 2;
+        }
+    }
+
+    // an odd count leaves a tail for the scalar search
+    if (RBFrozenSearchBatch(frozen, keys, 199999, found) != 0) {
+        printf("Failed to search batch.\n");
+        RBFrozenFree(frozen);
+        free(keys);
+        free(found);
+        RBFree(tree);
+        return -1;
+    }
+    for (int i = 0; i < 199999; i++) {
+        if (found[i] != RBSearch(tree, keys[i])) {
+            printf("Batch search disagrees on %d.\n", keys[i]);
+            RBFrozenFree(frozen);
+            free(keys);
+            free(found);
+            RBFree(tree);
+            return -1;
+        }
+    }
+
+    RBFrozenFree(frozen);
+    free(keys);
+    free(found);
+    RBFree(tree);
+
+    struct RBTree *btree = RBCreateBTree();
+    if (!btree || RBFreeze(btree) != NULL) {
+        printf("Froze a B-tree.\n");
+        RBFree(btree);
+        return -1;
+    }
+    RBFree(btree);
+
+    printf("Success.\n");
+    return 0;
+}
+
+/* Checks the metrics RBGetStats always reports and, in builds with
+ * RB_STATS, the operation counters. */
+int statsTest(void) {
+    printf("Testing stats: ");
+
+    struct RBStats stats;
+    struct RBTree *tree = RBCreate();
+    if (!tree || RBGetStats(NULL, &stats) != -1 || RBGetStats(tree, NULL) != -1) {
+        printf("Failed to reject missing arguments.\n");
+        RBFree(tree);
+        return -1;
+    }
+
+    for (int i = 0; i < 1000; i++) {
+        RBInsert(tree, i);
+    }
+    RBInsert(tree, 0);
+    RBSearch(tree, 500);
+    RBSearch(tree, 1000);
+    for (int i = 0; i <= 500; i++) {
+        RBDelete(tree, 2 * i);
+    }
+
+    if (RBGetStats(tree, &stats) != 0 || stats.nodes != 500 || stats.bytes < 500 * 32) {
+        printf("Wrong size or memory in stats.\n");
+        RBFree(tree);
+        return -1;
+    }
+
+#ifdef RB_STATS
+    size_t insertCases = stats.insertUncleRed + stats.insertTriangle + stats.insertLine;
+    size_t deleteCases = stats.deleteSiblingRed + stats.deleteBlackChildren
+                         + stats.deleteNearChildRed + stats.deleteFarChildRed;
+    if (stats.inserts != 1000 || stats.duplicates != 1 || stats.deletes != 500
+        || stats.deleteMisses != 1 || stats.searches != 2 || stats.searchMisses != 1) {
+        printf("Wrong operation counts in stats.\n");
+        RBFree(tree);
+        return -1;
+    }
+    // ordered inserts only ever take the line case
+    if (stats.insertLine == 0 || stats.insertTriangle != 0 || insertCases == 0
+        || deleteCases == 0 || stats.rotations < stats.insertLine
+        || stats.recolorings == 0) {
+        printf("Wrong rebalancing counts in stats.\n");
+        RBFree(tree);
+        return -1;
+    }
+    if (stats.maxSearchDepth < 1 || stats.maxSearchDepth > 20
+        || stats.averageSearchDepth > (double)stats.maxSearchDepth) {
+        printf("Wrong search depth in stats.\n");
+        RBFree(tree);
+        return -1;
+    }
+
+    // the optimistic search of a concurrent tree and handle lookups count too
+    size_t searches = stats.searches;
+    if (RBMakeConcurrent(tree) != 0 || RBSearch(tree, 501) != 1 || !RBFind(tree, 501)
+        || RBGetStats(tree, &stats) != 0 || stats.searches != searches + 2
+        || stats.searchMisses != 1) {
+        printf("Searches of a concurrent tree were not counted.\n");
+        RBFree(tree);
+        return -1;
+    }
+
+    // joins rebalance like ordered insertions when appending single values
+    size_t rebalanced = stats.rotations + stats.recolorings;
+    for (int i = 0; i < 100; i++) {
+        struct RBTree *empty = RBCreate();
+        if (!empty || RBJoin(tree, 2000 + i, empty) != tree) {
+            printf("Failed to join value %d.\n", 2000 + i);
+            RBFree(empty);
+            RBFree(tree);
+            return -1;
+        }
+    }
+    if (RBGetStats(tree, &stats) != 0 || stats.rotations + stats.recolorings <= rebalanced) {
+        printf("Rebalancing of joins was not counted.\n");
+        RBFree(tree);
+        return -1;
+    }
+#endif
+
+    RBFree(tree);
+
+    struct RBTree *btree = RBCreateBTree();
+    for (int i = 0; btree && i < 1000; i++) {
+        RBInsert(btree, i);
+    }
+    if (!btree || RBGetStats(btree, &stats) != 0 || stats.nodes != 1000
+        || stats.bytes < 1000 * sizeof(int)) {
+        printf("Wrong stats of B-tree.\n");
+        RBFree(btree);
+        return -1;
+    }
+    RBFree(btree);
+
+    printf("Success.\n");
+    return 0;
+}
+
+/* Checks the tree around every modification of a random workload, which
+ * the full check confirms every so often. */
+int localCheckTest(void) {
+    printf("Testing local checks: ");
+
+    struct RBTree *tree = RBCreate();
+    if (!tree || RBCheckLocal(tree) != 0 || RBCheckLocal(NULL) != -1) {
+        printf("Failed to check empty tree.\n");
+        RBFree(tree);
+        return -1;
+    }
+
+    srand(5);
+    for (int round = 0; round < 100000; round++) {
+        int value = rand() % 20000;
+        if (rand() % 3) {
+            RBInsert(tree, value);
+        } else {
+            RBDelete(tree, value);
+        }
+
+        if (RBCheckLocal(tree) != 0 || (round % 10000 == 0 && RBCheck(tree) != 0)) {
+            printf("Check failed after round %d.\n", round);
+            RBFree(tree);
+            return -1;
+        }
+    }
+
+    int keys[] = {-3, -2, -1};
+    struct RBTree *lo = NULL;
+    struct RBTree *hi = NULL;
+    if (RBInsertBatch(tree, keys, 3, NULL) != 0 || RBCheckLocal(tree) != 0
+        || RBDeleteBatch(tree, keys, 2, NULL) != 0 || RBCheckLocal(tree) != 0
+        || RBSplit(tree, 10000, &lo, &hi) != 0 || RBCheckLocal(lo) != 0
+        || RBCheckLocal(hi) != 0) {
+        printf("Check failed after batch or split.\n");
+        RBFree(tree);
+        return -1;
+    }
+
+    RBFree(lo);
+    RBFree(hi);
+    printf("Success.\n");
+    return 0;
+}
+
+/* Checks top-down insertion and deletion, mixed with the bottom-up ones,
+ * against a tree using only the latter. */
+int topDownTest(void) {
+    printf("Testing top-down insert and delete: ");
+
+    struct RBTree *tree = RBCreate();
+    struct RBTree *reference = RBCreate();
+    if (!tree || !reference) {
+        printf("Failed to create trees.\n");
+        RBFree(tree);
+        RBFree(reference);
+        return -1;
+    }
+
+    srand(6);
+    for (int round = 0; round < 200000; round++) {
+        int value = rand() % 30000;
+        int topDown = rand() % 4 != 0;
+        int result;
+        int expected;
+        if (round < 50000 || rand() % 2) {
+            result = topDown ? RBInsertTopDown(tree, value) : RBInsert(tree, value);
+            expected = RBInsert(reference, value);
+        } else {
+            result = topDown ? RBDeleteTopDown(tree, value) : RBDelete(tree, value);
+            expected = RBDelete(reference, value);
+        }
+
+        if (result != expected || RBCheckLocal(tree) != 0
+            || (round % 10000 == 0 && RBCheck(tree) != 0)) {
+            printf("Top-down tree diverged at round %d.\n", round);
+            RBFree(tree);
+            RBFree(reference);
+            return -1;
+        }
+    }
+
+    for (int value = 0; value < 30000; value++) {
+        if (RBRank(tree, value) != RBRank(reference, value)
+            || RBDeleteTopDown(tree, value) != RBDelete(reference, value)) {
+            printf("Top-down tree disagrees on %d.\n", value);
+            RBFree(tree);
+            RBFree(reference);
+            return -1;
+        }
+    }
+    if (RBSize(tree) != 0 || RBCheck(tree) != 0) {
+        printf("Emptied top-down tree is not valid.\n");
+        RBFree(tree);
+        RBFree(reference);
+        return -1;
+    }
+
+    RBFree(tree);
+    RBFree(reference);
+    printf("Success.\n");
+    return 0;
+}
+
+/* Tests node handles: they survive insertions and deletions of other
+ * values, and deleting through them keeps the tree valid, also while an
+ * iterator walks past the deleted nodes. */
+int handleTest(void) {
+    printf("Testing node handles: ");
+
+    struct RBTree *tree = RBCreate();
+    struct RBNode **handles = malloc(20000 * sizeof(struct RBNode *));
+    if (!tree || !handles) {
+        printf("Failed to create tree.\n");
+        RBFree(tree);
+        free(handles);
+        return -1;
+    }
+
+    for (int value = 0; value < 20000; value++) {
+        int key = value * 7919 % 20000;
+        if (RBInsertGetNode(tree, key, &handles[key]) != 0 || !handles[key]) {
+            printf("Failed to insert %d.\n", key);
+            RBFree(tree);
+            free(handles);
+            return -1;
+        }
+    }
+
+    struct RBNode *duplicate;
+    if (RBInsertGetNode(tree, 5, &duplicate) != 1 || duplicate != handles[5]
+        || RBFind(tree, 5) != handles[5] || RBFind(tree, 20000) != NULL) {
+        printf("Handles of present values differ.\n");
+        RBFree(tree);
+        free(handles);
+        return -1;
+    }
+
+    // deleting the odd values by value moves no even node
+    for (int value = 1; value < 20000; value += 2) {
+        if (RBDelete(tree, value) != 0) {
+            printf("Failed to delete %d.\n", value);
+            RBFree(tree);
+            free(handles);
+            return -1;
+        }
+    }
+    for (int value = 0; value < 20000; value += 2) {
+        if (RBFind(tree, value) != handles[value] || RBNodeValue(handles[value]) != value) {
+            printf("Handle of %d moved.\n", value);
+            RBFree(tree);
+            free(handles);
+            return -1;
+        }
+    }
+
+    // delete every other remaining value through its handle while iterating
+    struct RBIter iter;
+    int more = RBIterFirst(tree, &iter);
+    int index = 0;
+    while (more) {
+        int value = RBIterValue(&iter);
+        more = RBIterNext(&iter);
+        if (index++ % 2 == 0 && RBDeleteNode(tree, handles[value]) != 0) {
+            printf("Failed to delete the node of %d.\n", value);
+            RBFree(tree);
+            free(handles);
+            return -1;
+        }
+    }
+    if (RBSize(tree) != 5000 || RBCheck(tree) != 0 || RBSearch(tree, 0) != 0
+        || RBFind(tree, 2) != handles[2] || RBDeleteNode(tree, NULL) != -1) {
+        printf("Tree is not valid after deleting through handles.\n");
+        RBFree(tree);
+        free(handles);
+        return -1;
+    }
+    RBFree(tree);
+    free(handles);
+
+    struct RBTree *btree = RBCreateBTree();
+    struct RBNode *node;
+    if (!btree || RBInsertGetNode(btree, 1, &node) != -1 || node
+        || RBFind(btree, 1) != NULL) {
+        printf("B-tree accepted node handles.\n");
+        RBFree(btree);
+        return -1;
+    }
+
+    RBFree(btree);
+    printf("Success.\n");
+    return 0;
+}
+
+/* Tests multisets against an array of counts under random insertions and
+ * deletions. Builds without RB_MULTISET only check that multisets are
+ * refused and report the test as skipped. */
+int multisetTest(void) {
+    printf("Testing multisets: ");
+
+    struct RBTree *tree = RBCreateMultiset();
+#ifndef RB_MULTISET
+    if (tree) {
+        printf("Created a multiset without RB_MULTISET.\n");
+        RBFree(tree);
+        return -1;
+    }
+    printf("Skipped, build with make multiset to run.\n");
+    return 0;
+#else
+    size_t counts[1000] = {0};
+    size_t distinct = 0;
+    size_t total = 0;
+    if (!tree) {
+        printf("Failed to create multiset.\n");
+        return -1;
+    }
+
+    srand(7);
+    for (int round = 0; round < 100000; round++) {
+        int value = rand() % 1000;
+        int result;
+        int expected = counts[value] > 0;
+        if (round < 20000 || rand() % 2) {
+            result = rand() % 2 ? RBInsert(tree, value) : RBInsertTopDown(tree, value);
+            distinct += counts[value]++ == 0;
+            total++;
+        } else {
+            result = rand() % 2 ? RBDelete(tree, value) : RBDeleteTopDown(tree, value);
+            expected = !expected;
+            if (counts[value] > 0) {
+                distinct -= --counts[value] == 0;
+                total--;
+            }
+        }
+
+        if (result != expected || RBCount(tree, value) != counts[value]
+            || RBSize(tree) != distinct || RBCheckLocal(tree) != 0
+            || (round % 10000 == 0 && RBCheck(tree) != 0)) {
+            printf("Multiset diverged at round %d.\n", round);
+            RBFree(tree);
+            return -1;
+        }
+    }
+
+    // batches count every occurrence of a key, but report distinct values
+    int batch[] = {1000, 1000, 1001, 1000};
+    size_t inserted;
+    size_t deleted;
+    if (RBInsertBatch(tree, batch, 4, &inserted) != 0 || inserted != 2
+        || RBCount(tree, 1000) != 3 || RBDeleteBatch(tree, batch, 3, &deleted) != 0
+        || deleted != 3 || RBCount(tree, 1000) != 1 || RBCount(tree, 1001) != 0) {
+        printf("Batches did not count occurrences.\n");
+        RBFree(tree);
+        return -1;
+    }
+    RBDelete(tree, 1000);
+
+    struct RBIter iter;
+    size_t iterated = 0;
+    for (int more = RBIterFirst(tree, &iter); more; more = RBIterNext(&iter)) {
+        if (RBIterCount(&iter) != counts[RBIterValue(&iter)]) {
+            printf("Iterator reports a wrong count for %d.\n", RBIterValue(&iter));
+            RBFree(tree);
+            return -1;
+        }
+        iterated += RBIterCount(&iter);
+    }
+    size_t ranged = 0;
+    if (iterated != total || RBRangeCounts(tree, 0, 1000, sumCounts, &ranged) != 0
+        || ranged != total || RBCheck(tree) != 0) {
+        printf("Counts do not add up to %zu.\n", total);
+        RBFree(tree);
+        return -1;
+    }
+
+    // deleting through a handle also only removes one occurrence
+    struct RBNode *node;
+    RBInsert(tree, 2000);
+    if (RBInsertGetNode(tree, 2000, &node) != 1 || RBDeleteNode(tree, node) != 0
+        || RBFind(tree, 2000) != node || RBDeleteNode(tree, node) != 0
+        || RBCount(tree, 2000) != 0) {
+        printf("Handle deleted more than one occurrence.\n");
+        RBFree(tree);
+        return -1;
+    }
+
+    struct RBTree *lo;
+    struct RBTree *hi;
+    struct RBTree *set = RBCreate();
+    if (!set || RBUnion(tree, set) != NULL || RBJoin(tree, 5000, set) != NULL
+        || RBSerialize(tree, streamWrite, NULL) != -1
+        || RBSplit(tree, 500, &lo, &hi) != 0) {
+        printf("Multiset was combined with a set.\n");
+        RBFree(set);
+        RBFree(tree);
+        return -1;
+    }
+    RBFree(set);
+
+    int value = 500;
+    while (counts[value] == 0) {
+        value++;
+    }
+    if (RBCount(hi, value) != counts[value] || RBInsert(hi, value) != 1
+        || RBCount(hi, value) != counts[value] + 1 || RBCheck(lo) != 0 || RBCheck(hi) != 0) {
+        printf("Split halves lost their counts.\n");
+        RBFree(lo);
+        RBFree(hi);
+        return -1;
+    }
+    RBFree(lo);
+    RBFree(hi);
+    tree = RBCreate();
+    if (!tree || RBInsert(tree, 1) != 0 || RBInsert(tree, 1) != 1 || RBCount(tree, 1) != 1) {
+        printf("Regular tree counted a duplicate.\n");
+        RBFree(tree);
+        return -1;
+    }
+
+    RBFree(tree);
+    printf("Success.\n");
+    return 0;
+#endif
+}
+
+/* Tests a preallocated tree under repeated insert/delete churn, which
+ * should recycle released nodes instead of growing the pool. */
+int capacityTest(void) {
+    printf("Testing preallocated tree with insert/delete churn: ");
+
+    // capacities whose pool size overflows are refused before allocating
+    struct RBTree *huge = RBCreateWithCapacity(SIZE_MAX / 8);
+    if (huge || (huge = RBCreateWithCapacity(SIZE_MAX)) != NULL) {
+        printf("Created tree with overflowing capacity.\n");
+        RBFree(huge);
+        return -1;
+    }
+
+    struct RBTree *tree = RBCreateWithCapacity(100);
+    if (!tree) {
+        printf("Failed to create tree.\n");
+        return -1;
+    }
+
+    for (int round = 0; round < 100; round++) {
+        for (int i = 0; i < 100; i++) {
+            if (RBInsert(tree, i) != 0) {
+                printf("Failed to insert value %d.\n", i);
+                RBFree(tree);
+                return -1;
+            }
+        }
+
+        if (RBCheck(tree) == -1) {
+            printf("Tree is not a valid red-black tree.\n");
+            RBFree(tree);
+            return -1;
+        }
+
+        for (int i = 0; i < 100; i++) {
+            if (RBDelete(tree, i) != 0) {
+                printf("Failed to delete value %d.\n", i);
+                RBFree(tree);
+                return -1;
+            }
+        }
+    }
+
+    RBFree(tree);
+    printf("Success.\n");
+    return 0;
+}
+
+/* Tests the red-black tree structure with many ordered values.
+ * Returns 0 on success, a printed error and -1 on failure. */
+int manyOrderedValuesTest(void) {
+    printf("Testing red-black tree with %d ordered values: ", MAX);
+
+    struct RBTree *tree = RBCreate();
+    if (!tree) {
+        printf("Failed to create tree.\n");
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < MAX; i++) {
+        if (RBInsert(tree, i) == -1) {
+            printf("Failed to insert value %d.\n", i);
+            RBFree(tree);
+            return -1;
+        }
+    }
+
+    if (RBCheck(tree) == -1) {
+        printf("Tree is not a valid red-black tree.\n");
+        RBFree(tree);
+        return -1;
+    }
+
+    for (i = 0; i < MAX; i++) {
+        if (RBSearch(tree, i) == 0) {
+            printf("Failed to find value %d.\n", i);
+            RBFree(tree);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < 0.5*MAX; i++) {
+        int deleteErrorCode = RBDelete(tree, i);
+        if (deleteErrorCode == -1) {
+            printf("Failed to delete value %d.\n", i);
+            RBFree(tree);
+            return -1;
+        } else if (deleteErrorCode == 1) {
+            printf("Value %d could not be found in the tree.\n", i);
+            RBFree(tree);
+            return -1;
+        }
+    }
+
+    if (RBCheck(tree) == -1) {
+        printf("Tree is not a valid red-black tree.\n");
+        RBFree(tree);
+        return -1;
+    }
+
+    RBFree(tree);
+    printf("Success.\n");
+    return 0;
+}
+
+/* Tests the red-black tree structure with many random values.
+ * Returns 0 on success, a printed error and -1 on failure. */
+int manyRandomValuesTest(void) {
+    printf("Testing red-black tree with %d random values: ", MAX);
+
+    struct RBTree *tree = RBCreate();
+    if (!tree) {
+        printf("Failed to create tree.\n");
+        return -1;
+    }
+
+    srand((unsigned int)time(NULL));
+
+    int i;
+    int *values = malloc(sizeof(int) * MAX);
+    for (i = 0; i < MAX; i++) {
+        int value = rand() % MAX;
+        values[i] = value;
+    }
+
+    for (i = 0; i < MAX; i++) {
+        if (RBInsert(tree, values[i]) == -1) {
+            printf("Failed to insert value %d.\n", values[i]);
+            RBFree(tree);
+            free(values);
+            return -1;
+        }
+    }
+
+    if (RBCheck(tree) == -1) {
+        printf("Tree is not a valid red-black tree.\n");
+        RBFree(tree);
+        free(values);
+        return -1;
+    }
+
+    for (i = 0; i < MAX; i++) {
+        if (RBSearch(tree, values[i]) == 0) {
+            printf("Failed to find value %d.\n", values[i]);
+            RBFree(tree);
+            free(values);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < 0.5*MAX; i++) {
+        int deleteErrorCode = RBDelete(tree, values[i]);
+        if (deleteErrorCode == -1) {
+            printf("Failed to delete value %d.\n", values[i]);
+            RBFree(tree);
+            return -1;
+        }
+    }
+
+    if (RBCheck(tree) == -1) {
+        printf("Tree is not a valid red-black tree.\n");
+        RBFree(tree);
+        free(values);
+        return -1;
+    }
+
+    RBFree(tree);
+    free(values);
+    printf("Success.\n");
+    return 0;
+}
+
+int main(void) {
+    if (initializationTest()) {
+        return -1;
+    }
+    if (insertTest()) {
+        return -1;
+    }
+    if (duplicateTest()) {
+        return -1;
+    }
+    if (searchTest()) {
+        return -1;
+    }
+    if (deleteTest()) {
+        return -1;
+    }
+    if (deleteNonPresentTest()) {
+        return -1;
+    }
+    if (iteratorTest()) {
+        return -1;
+    }
+    if (rangeTest()) {
+        return -1;
+    }
+    if (orderStatisticsTest()) {
+        return -1;
+    }
+    if (buildTest()) {
+        return -1;
+    }
+    if (batchTest()) {
+        return -1;
+    }
+    if (mapTest()) {
+        return -1;
+    }
+    if (concurrentTest()) {
+        return -1;
+    }
+    if (snapshotTest()) {
+        return -1;
+    }
+    if (snapshotSharingTest()) {
+        return -1;
+    }
+    if (capacityTest()) {
+        return -1;
+    }
+    if (setOperationsTest()) {
+        return -1;
+    }
+    if (mappedTest()) {
+        return -1;
+    }
+    if (serializeTest()) {
+        return -1;
+    }
+    if (btreeTest()) {
+        return -1;
+    }
+    if (btreeOrderTest()) {
+        return -1;
+    }
+    if (frozenTest()) {
+        return -1;
+    }
+    if (statsTest()) {
+        return -1;
+    }
+    if (localCheckTest()) {
+        return -1;
+    }
+    if (topDownTest()) {
+        return -1;
+    }
+    if (handleTest()) {
+        return -1;
+    }
+    if (multisetTest()) {
         return -1;
     }
     if (manyOrderedValuesTest()) {